@@ -0,0 +1,55 @@
+#!/bin/sh
+# Generates the benchmark corpora and keystroke scripts into bench/data.
+# Files that already exist are kept, delete bench/data to regenerate them.
+
+set -e
+DATA=${1:-bench/data}
+mkdir -p "$DATA"
+
+# 1M line C file
+if [ ! -f "$DATA/big.c" ]; then
+    awk 'BEGIN {
+        for (i = 0; i < 100000; i++) {
+            printf "/* Function number %d, returns the sum\n", i
+            printf " * of its arguments */\n"
+            printf "static int func%d(int a, int b)\n{\n", i
+            printf "    char *s = \"string %d with \\\"escapes\\\"\";\n", i
+            printf "    if (a > %d) return a + b; // comment\n", i
+            printf "    while (b--) a += 0x%x;\n", i
+            printf "    return a * 3.14;\n}\n\n"
+        }
+    }' > "$DATA/big.c"
+fi
+
+# 50 MB JSON on a single line
+if [ ! -f "$DATA/oneline.json" ]; then
+    awk 'BEGIN {
+        printf "["
+        for (i = 0; i < 600000; i++) {
+            if (i) printf ","
+            printf "{\"id\":%d,\"name\":\"item%d\",\"tags\":[\"a\",\"b\"],\"v\":%d.5}", i, i, i
+        }
+        printf "]\n"
+    }' > "$DATA/oneline.json"
+fi
+
+# Tab heavy file
+if [ ! -f "$DATA/tabs.tsv" ]; then
+    awk 'BEGIN {
+        for (i = 0; i < 200000; i++)
+            printf "%d\t\tcol\t%d\t\t\tx\tyy\tzzz\t%d\n", i, i * 7, i % 13
+    }' > "$DATA/tabs.tsv"
+fi
+
+# Keystroke scripts, raw bytes as a terminal sends them
+rep() {
+    n=$1; shift
+    i=0
+    while [ $i -lt $n ]; do printf "$@"; i=$((i + 1)); done
+}
+
+[ -f "$DATA/scroll.keys" ] || rep 2000 '\033[6~' > "$DATA/scroll.keys"
+[ -f "$DATA/arrows.keys" ] || { rep 3000 '\033[B'; rep 1000 '\033[C'; rep 3000 '\033[A'; } > "$DATA/arrows.keys"
+[ -f "$DATA/typing.keys" ] || { rep 20 '\033[B'; rep 200 'x'; rep 200 '\177'; rep 50 'ab\r'; } > "$DATA/typing.keys"
+[ -f "$DATA/find.keys" ] || { printf '\006'; printf 'return'; rep 50 '\033[B'; printf '\r'; } > "$DATA/find.keys"
+exit 0
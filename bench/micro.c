@@ -0,0 +1,263 @@
+/* Microbenchmarks of the editor kernels on synthetic inputs.
+ *
+ * Every kernel is warmed up, then repeated until it has run for at least
+ * MICRO_MIN_TIME, and the results are printed as a JSON array:
+ *
+ *   make microbench
+ *   ./kilo-micro [kernel-name-filter]
+ */
+
+#define KILO_NO_MAIN
+#include "../kilo.c"
+
+#define MICRO_WARMUP 3
+#define MICRO_MIN_REPS 5
+#define MICRO_MAX_REPS 10000
+#define MICRO_MIN_TIME 0.2e9     /* ns */
+
+const char *micro_filter = NULL;
+int micro_first = 1;
+
+double microNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Runs 'fn' and prints a JSON object with its timings. 'bytes' is the input
+ * processed by one call, used for the throughput */
+void microRun(const char *kernel, const char *params, void (*fn)(void), double bytes)
+{
+    static double samples[MICRO_MAX_REPS];
+    int i, n = 0;
+    double total = 0;
+
+    if (micro_filter && !strstr(kernel, micro_filter)) return;
+
+    for (i = 0; i < MICRO_WARMUP; ++i) fn();
+    while (n < MICRO_MAX_REPS && (n < MICRO_MIN_REPS || total < MICRO_MIN_TIME)) {
+        double start = microNs();
+        fn();
+        samples[n] = microNs() - start;
+        total += samples[n++];
+    }
+    qsort(samples, n, sizeof(double), compareDouble);
+
+    double median = samples[n / 2];
+    printf("%s\n  {\"kernel\": \"%s\", \"params\": {%s}, \"reps\": %d, "
+            "\"median_ns\": %.0f, \"min_ns\": %.0f, \"mean_ns\": %.0f, \"mb_per_s\": %.1f}",
+            micro_first ? "[" : ",", kernel, params, n, median, samples[0],
+            total / n, bytes ? bytes / median * 1e3 : 0.0);
+    micro_first = 0;
+    fflush(stdout);
+}
+
+/*************
+*  inputs  *
+*************/
+
+void microFreeRows(void)
+{
+    int j;
+    for (j = 0; j < E.numrows; ++j) editorFreeRow(&E.row[j]);
+    E.numrows = 0;
+    E.cx = E.cy = E.rowoff = E.coloff = 0;
+    editorIndexInvalidate();
+}
+
+/* Fills a line of 'len' bytes of C-like code with a tab every 'tabevery'
+ * bytes (0 for none) */
+void microLine(char *buf, int len, int tabevery, int seed)
+{
+    static const char *words[] = {
+        "int ", "x ", "= ", "42; ", "/* c */ ", "\"str\" ", "if ", "(a) ",
+        "return ", "3.14 ", "while ", "foo(); ", "// end",
+    };
+    int i = 0, w = seed;
+    while (i < len) {
+        const char *word = words[w++ % (sizeof(words) / sizeof(words[0]) - 1)];
+        while (*word && i < len) buf[i++] = *word++;
+    }
+    if (tabevery) {
+        for (i = 0; i < len; i += tabevery) buf[i] = '\t';
+    }
+}
+
+/* Replaces the buffer with 'nrows' synthetic rows of 'len' bytes */
+void microBuffer(int nrows, int len, int tabevery, struct editorSyntax *syntax)
+{
+    char *buf = malloc(len + 1);
+    int j;
+
+    microFreeRows();
+    E.syntax = syntax;
+    for (j = 0; j < nrows; ++j) {
+        microLine(buf, len, tabevery, j);
+        editorInsertRow(E.numrows, buf, len);
+    }
+    E.dirty = 0;
+    free(buf);
+}
+
+double microBufferBytes(void)
+{
+    double bytes = 0;
+    int j;
+    for (j = 0; j < E.numrows; ++j) bytes += E.row[j].size;
+    return bytes;
+}
+
+/*************
+*  kernels  *
+*************/
+
+void benchUpdateRender(void)
+{
+    editorUpdateRender(&E.row[0]);
+}
+
+void benchUpdateSyntax(void)
+{
+    int j;
+    for (j = 0; j < E.numrows; ++j) editorHighlightRow(&E.row[j]);
+}
+
+char *micro_query;
+
+void benchFind(void)
+{
+    editorFindCallback(micro_query, ARROW_DOWN);
+}
+
+/* Replaces the query and back on alternate calls, so every call has the
+ * same matches to replace */
+void benchReplaceAll(void)
+{
+    static int back = 0;
+    if (back) editorReplaceAll("TOKEN", micro_query, 0, E.numrows);
+    else editorReplaceAll(micro_query, "TOKEN", 0, E.numrows);
+    back = !back;
+}
+
+void benchDrawRows(void)
+{
+    struct abuf ab = ABUF_INIT;
+    editorDrawRows(&ab);
+    abFree(&ab);
+    /* Scroll a screen each frame so every frame draws different rows */
+    E.rowoff += E.screenrows;
+    if (E.rowoff >= E.numrows) E.rowoff = 0;
+}
+
+void benchRowsToString(void)
+{
+    size_t len;
+    free(editorRowsToString(&len));
+}
+
+void benchSave(void)
+{
+    editorSave();
+}
+
+int main(int argc, char *argv[])
+{
+    char params[256];
+    int i;
+
+    if (argc > 1) micro_filter = argv[1];
+
+    /* Virtual screen, like a replay */
+    E.replay.script = "";
+    E.replay.rows = 42;
+    E.replay.cols = 120;
+    initEditor();
+
+    /* Tab expansion */
+    int lens[] = { 80, 1000, 100000 };
+    int tabs[] = { 0, 8, 1 };
+    for (i = 0; i < 3; ++i) {
+        int t;
+        for (t = 0; t < 3; ++t) {
+            microBuffer(1, lens[i], tabs[t], NULL);
+            snprintf(params, sizeof(params), "\"len\": %d, \"tab_every\": %d", lens[i], tabs[t]);
+            microRun("editorUpdateRow", params, benchUpdateRender, lens[i]);
+        }
+    }
+
+    /* Lexing throughput by language */
+    microBuffer(20000, 100, 0, NULL);
+    microRun("editorUpdateSyntax", "\"lang\": \"none\", \"rows\": 20000, \"len\": 100",
+            benchUpdateSyntax, microBufferBytes());
+    for (i = 0; i < (int)HLDB_ENTRIES; ++i) {
+        microBuffer(20000, 100, 0, &HLDB[i]);
+        snprintf(params, sizeof(params), "\"lang\": \"%s\", \"rows\": 20000, \"len\": 100",
+                HLDB[i].filetype);
+        microRun("editorUpdateSyntax", params, benchUpdateSyntax, microBufferBytes());
+    }
+
+    /* Search, a query found every 1000 rows and one never found */
+    microBuffer(200000, 80, 0, NULL);
+    for (i = 0; i < E.numrows; i += 1000) memcpy(E.row[i].render + 40, "needle", 6);
+    micro_query = "needle";
+    microRun("editorFindCallback", "\"rows\": 200000, \"len\": 80, \"hit_every\": 1000",
+            benchFind, microBufferBytes() / 200);
+    editorFindCallback(micro_query, '\r');
+    micro_query = "missing";
+    microRun("editorFindCallback", "\"rows\": 200000, \"len\": 80, \"hit_every\": 0",
+            benchFind, microBufferBytes());
+    editorFindCallback(micro_query, '\r');
+
+    /* Replace all, three matches a row */
+    microBuffer(200000, 80, 0, NULL);
+    for (i = 0; i < E.numrows; ++i) {
+        memcpy(E.row[i].chars + 10, "tok", 3);
+        memcpy(E.row[i].chars + 40, "tok", 3);
+        memcpy(E.row[i].chars + 70, "tok", 3);
+    }
+    micro_query = "tok";
+    microRun("editorReplaceAll", "\"rows\": 200000, \"len\": 80, \"per_row\": 3",
+            benchReplaceAll, microBufferBytes());
+
+    /* Frame building */
+    int widths[] = { 80, 200 };
+    for (i = 0; i < 2; ++i) {
+        E.screencols = widths[i];
+        microBuffer(10000, 150, 8, &HLDB[0]);
+        snprintf(params, sizeof(params), "\"screen\": \"%dx%d\", \"lang\": \"c\", \"tab_every\": 8",
+                E.screencols, E.screenrows);
+        microRun("editorDrawRows", params, benchDrawRows, 0);
+    }
+    E.screencols = 120;
+
+    /* Frame building with UTF-8 on every row, decoded from the column marks */
+    microBuffer(0, 0, 0, NULL);
+    for (i = 0; i < 10000; ++i) {
+        char buf[256];
+        int len = 0;
+        while (len < 150) len += snprintf(buf + len, sizeof(buf) - len, "h\xc3\xa9llo \xe6\x97\xa5\xe6\x9c\xac %d ", i);
+        editorInsertRow(E.numrows, buf, len);
+    }
+    E.dirty = 0;
+    E.coloff = 40;
+    microRun("editorDrawRows", "\"screen\": \"120x40\", \"lang\": \"none\", \"text\": \"utf8\"",
+            benchDrawRows, 0);
+    E.coloff = 0;
+
+    /* Serialization and save */
+    microBuffer(100000, 100, 0, NULL);
+    microRun("editorRowsToString", "\"rows\": 100000, \"len\": 100",
+            benchRowsToString, microBufferBytes());
+    char tmpl[] = "/tmp/kilo-micro-XXXXXX";
+    int fd = mkstemp(tmpl);
+    if (fd != -1) {
+        close(fd);
+        E.filename = strdup(tmpl);
+        microRun("editorSave", "\"rows\": 100000, \"len\": 100", benchSave, microBufferBytes());
+        unlink(tmpl);
+    }
+
+    printf("\n]\n");
+    return 0;
+}
@@ -0,0 +1,17 @@
+#!/bin/sh
+# Replays every keystroke script against every corpus with the headless
+# mode of kilo-bench and prints the reports.
+
+set -e
+KILO=${KILO:-./kilo-bench}
+DATA=${DATA:-bench/data}
+SIZE=${SIZE:-120x40}
+
+sh bench/gen.sh "$DATA"
+
+for corpus in big.c oneline.json tabs.tsv; do
+    for script in scroll arrows typing find; do
+        echo "== $corpus $script ($SIZE)"
+        "$KILO" -b "$DATA/$script.keys" -s "$SIZE" "$DATA/$corpus"
+    done
+done
@@ -9,18 +9,33 @@
 #define _GNU_SOURCE
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <time.h>
+#include <poll.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <termios.h>
 #include <unistd.h>
+#include <zlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /*************
 *  defines  *
@@ -29,7 +44,31 @@
 #define CTRL_KEY(x) ((x) & 0x1f)
 #define KILO_VERSION "0.0.1"
 #define KILO_TAB_STOP 8
+#define KILO_COL_STEP 64                /* Columns between the offsets kept for non-ASCII rows */
+#define KILO_BRACKET_BLOCK 4096         /* Render bytes summed together in long rows for bracket matching */
 #define KILO_QUIT_TIMES 3
+#define KILO_MAX_THREADS 64
+#define KILO_MIN_CHUNK (1 << 20)    /* Smallest slice of a file worth a thread */
+#define KILO_MAX_WATCHES 16
+#define KILO_READ_CHUNK (1 << 20)   /* Bytes read at once from growing files */
+#define KILO_STREAM_BUDGET (4 << 20)    /* Bytes read from a pipe between redraws */
+#define KILO_INPUT_BUF 4096             /* Keyboard bytes read at once */
+#define KILO_FRAME_US 16667             /* Shortest time between frames, 60 Hz */
+#define KILO_UNDO_LIMIT 64              /* MB of undo log, see -u */
+#define UNDO_NONE ((size_t)-1)
+#define KILO_JOURNAL_SYNC_US 1000000    /* Shortest time between journal fsyncs */
+#define KILO_BINARY_PROBE 4096          /* Bytes read to tell a binary file */
+#define KILO_GREP_WINDOW (16 << 20)     /* Bytes scanned between cancel checks */
+#define KILO_GREP_CONTEXT 200           /* Bytes of a line shown on each side of a hit */
+#define KILO_GREP_FLUSH (64 << 10)      /* Hit bytes a thread keeps before handing them */
+#define KILO_GREP_MAX_HITS 100000
+#define KILO_HEX_WIDTH 16               /* Bytes a line in the hex view */
+#define KILO_HEX_PAGE 4096              /* Bytes copied when the first one of them is edited */
+#define KILO_FILTER_IOV 512             /* Buffers written at once to a filter, two a row */
+#define KILO_PIPE_SIZE (1 << 20)        /* Asked for pipes with a lot to carry, fewer wakeups */
+#define KILO_GZIP_BUFFER (128 << 10)    /* zlib buffer of compressed files */
+#define KILO_RELOAD_DIFF_US 200000      /* Time spent diffing before replacing the rest whole */
+#define KILO_MEM_BUDGET 1024            /* MB the open buffers should fit in, see -M */
 
 enum editorKey {
     BACKSPACE = 127,    /* Backspace doesn't have a representation in C like 
@@ -42,7 +81,8 @@ enum editorKey {
     PAGE_DOWN,
     HOME_KEY,
     END_KEY,
-    DEL_KEY
+    DEL_KEY,
+    WAKEUP_KEY          /* Not a key: a background event needs a redraw */
 };
 
 enum editorHighlight {
@@ -54,8 +94,23 @@ enum editorHighlight {
     HL_STRING,
     HL_NUMBER,
     HL_MATCH,
+    HL_BRACKET,
 };
 
+/* Stats branches are expected not taken, define KILO_NO_STATS to remove them */
+#ifdef KILO_NO_STATS
+#define STATS_ON() 0
+#else
+#define STATS_ON() __builtin_expect(E.stats.enabled, 0)
+#endif
+
+/* Trace spans, only recorded when tracing was requested with -T */
+#define KILO_TRACE_EVENTS (1 << 16)     /* Per thread ring size */
+#define TRACE_ON() __builtin_expect(kilo_trace != NULL, 0)
+#define TRACE_BEGIN(name) do { if (TRACE_ON()) traceEvent(name, 'B', -1); } while (0)
+#define TRACE_END(name) do { if (TRACE_ON()) traceEvent(name, 'E', -1); } while (0)
+#define TRACE_END_ARG(name, arg) do { if (TRACE_ON()) traceEvent(name, 'E', arg); } while (0)
+
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 
@@ -74,33 +129,391 @@ struct editorSyntax {
     int flags;          /*What to highlight*/
 };
 
+/* Where a character starts in the render of a row with UTF-8 */
+struct colMark {
+    int off;            /* Byte in render */
+    int col;            /* Screen column */
+};
+
+/* Bracket nesting across a range of rows, strings and comments left out.
+ * Openers count +1 and closers -1 */
+struct bracketSum {
+    int net;            /* Sum of the range */
+    int lo;             /* Lowest prefix sum, <= 0. 1 for a row not lexed yet */
+    int hi;             /* Highest suffix sum, >= 0 */
+};
+
 typedef struct {
     int idx;            /* Index within file */
     int size;           /* Size of row */
     int rsize;          /* Size of rendered row */
+    int rwidth;         /* Screen columns of rendered row */
     char *chars;        /* Row */
     char *render;       /* Rendered row */
+    struct colMark *cols;   /* Character covering every KILO_COL_STEP'th column, NULL if ASCII */
     unsigned char *hl;
     int hl_open_comment;
+    struct bracketSum br;   /* Of this row, kept when its hl is dropped */
+    struct bracketSum *brblock; /* Of every KILO_BRACKET_BLOCK bytes, NULL for short rows */
 } erow;
 
+/* A row in the row index, with the sums of the subtree it roots */
+struct rowNode {
+    int l, r;           /* Children, 0 for none */
+    int count;          /* Rows in the subtree */
+    int height, hsum;   /* Visual lines of the row, and of the subtree */
+    int width, wmax;    /* Screen columns of the row, and the widest in the subtree */
+    struct bracketSum br, bsum;     /* Bracket nesting of the row, and of the subtree */
+};
+
+/* Balanced tree over the rows in file order. Soft wrap maps visual lines to
+ * file rows with it, and bracket matching skips the rows that can't hold a
+ * match, both in O(log n). Rows are found by position, so inserting,
+ * deleting or moving rows splits and merges O(log n) nodes */
+struct rowIndex {
+    struct rowNode *node;  /* Pool, 'free' links unused nodes through 'l' */
+    int root, used, cap, free;
+    int cols;           /* Screen width the heights were computed for */
+    int valid;          /* 0 if it must be rebuilt before the next query */
+    int brackets;       /* 0 until the bracket sums are filled in */
+};
+
+/* A file descriptor polled together with the keyboard */
+struct editorWatch {
+    int fd;
+    short events;               /* POLLIN or POLLOUT */
+    void (*callback)(int fd, void *data);
+    void *data;
+    int buffer;                 /* Id of the buffer it was added for, run with it in E */
+};
+
+/* Bytes of a line still waiting for its newline */
+struct lineBuffer {
+    char *b;
+    size_t len, cap;
+};
+
+/* Follow mode: bytes appended to the file are turned into rows */
+struct editorFollow {
+    int fd;                     /* File being followed, -1 if not following */
+    int inotify;                /* inotify instance watching it */
+    off_t off;                  /* Bytes of the file already turned into rows */
+    int open;                   /* The last row is waiting for its newline */
+};
+
+/* Rows read incrementally from a pipe (stdin) */
+struct editorStream {
+    int fd;                     /* -1 once the whole stream has been read */
+    struct lineBuffer partial;
+    size_t bytes;               /* Read so far */
+};
+
+/* The file on disk, watched for changes made by others */
+struct editorReload {
+    int inotify;                /* Watching its directory, -1 if not */
+    char *name;                 /* Its name in the directory */
+    struct stat st;             /* As last loaded or saved */
+};
+
+/* Formats of compressed files */
+enum editorCompressFormat {
+    COMPRESS_NONE = 0,
+    COMPRESS_GZIP,
+    COMPRESS_ZSTD
+};
+
+/* A compressed file: its decoder feeding E.stream, and its save running in
+ * the background */
+struct editorCompress {
+    int format;                 /* Of the file opened, and saved alike */
+    int fd;                     /* Read by the gzip thread */
+    int pipe;                   /* Written by the gzip thread */
+    pthread_t thread;
+    int running;                /* The gzip thread wasn't joined yet */
+    pid_t pid;                  /* zstd -d, 0 if none */
+    char error[80];             /* Why decoding failed */
+    int saving;                 /* Fields below belong to the save thread meanwhile */
+    pthread_t saver;
+    int notify[2];              /* The save thread writes a byte when done */
+    char *savebuf;              /* Copy of the rows */
+    size_t savelen;
+    char *savepath;
+    int savedirty;              /* E.dirty when the copy was taken */
+    int saveerr;                /* errno of a failed save */
+};
+
+/* Keyboard input read but not consumed yet, a burst is read with one syscall */
+struct editorInput {
+    char buf[KILO_INPUT_BUF];
+    int len, pos;
+    unsigned long reads;        /* Keyboard reads, keys of one read are a paste */
+};
+
+/* Headless replay of a recorded keystroke script, used for benchmarks */
+struct editorReplay {
+    char *script;               /* NULL when running on a terminal */
+    size_t len, pos;
+    int rows, cols;             /* Virtual screen size */
+    int sink;                   /* Output goes here instead of STDOUT_FILENO */
+    size_t bytes;               /* Written to the sink */
+    double *lat;                /* Key to frame latency of every key, in us */
+    size_t nlat, cap;
+    double open_ms;             /* Time spent in editorOpen */
+    unsigned long allocs;       /* Allocation counter when replay started */
+};
+
+/* What the terminal shows, so a frame only sends the lines that changed and
+ * scrolls the ones that moved */
+struct editorFrame {
+    uint64_t *hash;             /* Of every screen line as last sent, 0 if unknown */
+    int rows;                   /* Lines in 'hash', text rows plus the two bars */
+    long long top;              /* First visual line of the file on screen */
+    int wrap;                   /* Whether 'top' counts wrapped lines */
+    int valid;                  /* 0 when the screen must be cleared */
+};
+
+/* Undo log: primitive edits appended to one arena, undone in groups (one
+ * keypress, or a run of typing, or a paste). Every kind has its inverse at
+ * kind ^ 1 */
+enum undoKind {
+    UNDO_INSERT_TEXT = 0,
+    UNDO_DELETE_TEXT,
+    UNDO_INSERT_ROWS,
+    UNDO_DELETE_ROWS,
+    UNDO_MOVE_ROWS,             /* 'nrows' rows at 'row' moved to 'col' */
+    UNDO_MOVE_ROWS_BACK,        /* and back */
+    UNDO_REPLACE,               /* Matches replaced in 'nrows' rows from 'row' */
+    UNDO_REPLACE_BACK,          /* and put back */
+    UNDO_PERMUTE_ROWS,          /* 'nrows' rows from 'row' reordered */
+    UNDO_PERMUTE_ROWS_BACK,     /* and back */
+    UNDO_INSERT_SPARSE,         /* 'nrows' rows inserted at scattered indices */
+    UNDO_DELETE_SPARSE          /* and deleted */
+};
+
+struct undoRecord {
+    unsigned char kind;
+    unsigned char start;        /* First record of a group */
+    unsigned char reversed;     /* Bytes deleted by backspace, stored last to first */
+    int row, col;               /* Where the change happens */
+    int nrows;                  /* Rows in the bytes, separated by '\n' */
+    int cx, cy;                 /* Group start: cursor before the group */
+    int ax, ay;                 /* and after it */
+    size_t len;                 /* Bytes that follow the record */
+    size_t prevsize;            /* Size of the previous record, 0 for the first */
+};
+
+struct editorUndo {
+    char *log;                  /* Records, oldest first */
+    size_t len, cap;
+    size_t pos;                 /* Records from here on can be redone */
+    size_t top;                 /* Record before 'pos', UNDO_NONE if none */
+    size_t group;               /* Start of the group still open, or UNDO_NONE */
+    size_t limit;               /* Bytes the log may use */
+    int recording;              /* 0 while loading and while undoing */
+    int overflow;               /* The open group didn't fit in the limit */
+    int cx, cy;                 /* Cursor before the current keypress */
+};
+
+/* Crash recovery journal: the edits made since the last save, appended to
+ * a file next to the edited one by a background thread. The header
+ * identifies the version of the file the edits apply to */
+struct journalHeader {
+    char magic[8];              /* "KILOJNL1" */
+    uint64_t size;
+    int64_t mtime_sec, mtime_nsec;
+    uint64_t ino;
+};
+
+struct journalRecord {
+    uint32_t sum;               /* FNV-1a of the record, taken with sum 0, and its bytes */
+    uint32_t kind;              /* UNDO_* */
+    int32_t row, col, nrows;
+    uint32_t pad;
+    uint64_t len;               /* Bytes that follow */
+};
+
+struct editorJournal {
+    int enabled;                /* Journal the edits of this file */
+    int paused;                 /* While loading or replaying */
+    int clean;                  /* Quitting on purpose, the journal goes away */
+    int fd;                     /* -1 until the first edit after a save */
+    char *path;
+    int started;                /* The thread runs */
+    pthread_t thread;
+    pthread_mutex_t io;         /* Held while the file is written */
+    pthread_mutex_t lock;       /* Protects the fields below */
+    pthread_cond_t cond;
+    char *buf;                  /* Records not written yet */
+    size_t len, cap;
+    unsigned long gen;          /* Bumped when the journal is discarded */
+    int unsynced;               /* Written but not fsync'ed yet */
+    double synced;              /* Time of the last fsync */
+    int stop;
+    int error;                  /* errno of a failed write */
+};
+
+/* The journal of a buffer while another one is edited */
+struct journalFile {
+    int enabled;
+    int fd;
+    char *path;
+};
+
+/* Project search: a pool of threads walks the tree under the current
+ * directory through a shared stack of directories and files to search.
+ * Hits come back to the main loop through 'hits', with a byte written to
+ * a pipe it watches */
+struct grepTask {
+    char *path;
+    int dir;
+};
+
+struct editorGrep {
+    int active;                 /* The rows are hits */
+    int running;                /* Threads were started and not joined yet */
+    char *query;
+    int nthreads;
+    pthread_t threads[KILO_MAX_THREADS];
+    int pipe[2];
+    pthread_mutex_t lock;       /* Protects the fields below */
+    pthread_cond_t cond;        /* Tasks were pushed, or the search ended */
+    struct grepTask *tasks;
+    int ntasks, captasks;
+    int busy;                   /* Threads working on a task */
+    int done;                   /* Threads that returned */
+    struct lineBuffer hits;     /* Not appended as rows yet */
+    int signaled;               /* A byte is in the pipe */
+    unsigned long files, nhits;
+    int truncated;              /* Stopped at KILO_GREP_MAX_HITS */
+    volatile int cancel;
+};
+
+/* Copy of a page of the file with edits not written yet */
+struct hexPage {
+    size_t index;               /* Page number in the file */
+    unsigned char *data;
+};
+
+/* Hex view of a binary file, shown instead of the rows. Nothing is kept per
+ * line: every line on screen is computed from the mapping when drawn */
+struct editorHex {
+    int active;
+    int force;                  /* Set by -x, even for files that look like text */
+    int fd;
+    int readonly;               /* The file could only be opened for reading */
+    const unsigned char *map;
+    size_t size;
+    int digits;                 /* Of the offset column */
+    size_t off;                 /* Byte under the cursor */
+    int low;                    /* The low nibble is typed next */
+    int ascii;                  /* Cursor in the ASCII column, Tab switches */
+    size_t top;                 /* First line on screen */
+    struct hexPage *pages;      /* Edited pages, sorted by index */
+    int npages, cappages;
+};
+
+/* A range of rows piped through a shell command. The rows are written from
+ * their chars as the pipe takes them, the output is inserted as rows after
+ * the range as it arrives, and the range is deleted once the output ends */
+struct editorFilter {
+    pid_t pid;                  /* 0 if no command is running */
+    char *cmd;
+    int in, out, err;           /* Its stdin, stdout and stderr, -1 once closed */
+    int first, n;               /* Range filtered */
+    int sent;                   /* Rows of the range written */
+    size_t sentoff;             /* Bytes of the next one written, its newline included */
+    int got;                    /* Rows of output inserted */
+    struct lineBuffer partial;  /* Last line of output, until its newline */
+    char errmsg[80];            /* First line the command wrote to stderr */
+    int errlen;
+};
+
+/* Runtime instrumentation, toggled with CTRL-T. Counters are plain integer
+ * increments and timers are only read when enabled */
+struct editorStats {
+    int enabled;
+    char *dumpfile;             /* Totals are written here at exit */
+    double key_time;            /* When the first key not drawn yet was read */
+    /* Last frame, in microseconds */
+    double latency, scroll, draw, write;
+    size_t bytes;
+    int frame_syscalls, frame_relexed;
+    /* Counting since the last frame */
+    int syscalls, relexed;
+    /* Totals */
+    unsigned long frames, keys;
+    double sum_latency, max_latency, sum_scroll, sum_draw, sum_write;
+    unsigned long long sum_bytes, sum_syscalls, sum_relexed;
+    size_t rowmem;              /* Memory held by rows, refreshed every second */
+    size_t allmem;              /* and by all the buffers, when there are several */
+    time_t rowmem_time;
+};
+
 struct editorConfig {
     int cx, cy;                  /* Cursor position */
     int rx;                      /* Cursor horizontal position on render */
     int rowoff, coloff;          /* Scroll */
     int screencols, screenrows;  /* Terminal size */
+    int wrap;                    /* Soft wrap long rows instead of scrolling horizontally */
+    int vrowoff;                 /* Scroll in visual lines when wrapping */
+    struct rowIndex ri;          /* Visual lines and bracket nesting by row */
+    volatile sig_atomic_t resized;  /* Set by the SIGWINCH handler */
     int numrows;                 /* Num of rows of opened file */
+    int rowcap;                  /* Allocated rows */
     erow *row;                   /* Rows of opened file */
+    int mark;                    /* Other end of the line selection, -1 if none */
+    struct lineBuffer clip;      /* Cut or copied lines, joined by '\n' */
+    int cliprows;
     int dirty;
     char *filename;              /* Name of the opened file */
     char statusmsg[80];         /* Status message */
     time_t statusmsg_time;       /* Status time */
     struct editorSyntax *syntax;    /* Indicates filetype */
+    int cache;                   /* Use the sidecar line index cache */
+    off_t filesize;              /* Bytes loaded by editorOpen */
+    struct editorFollow follow;
+    struct editorStream stream;
+    struct editorCompress *compress;    /* Held by its threads, it never moves */
+    struct editorReload reload;
+    struct editorWatch watch[KILO_MAX_WATCHES];  /* Background events */
+    int nwatch;
+    struct editorInput input;
+    struct editorReplay replay;
+    struct editorStats stats;
+    struct editorFrame frame;
+    struct editorUndo undo;
+    struct editorJournal journal;
+    struct editorGrep grep;
+    struct editorHex hex;
+    struct editorFilter filter;
+    struct editorBuffer *buffers;   /* Open files, the fields of the current one are in E */
+    int nbuffers, buffer;        /* and the index of the current one */
+    size_t budget;               /* Bytes the buffers should fit in, see -M */
+    volatile sig_atomic_t hangup;   /* Set on SIGHUP/SIGTERM */
     struct termios orig_termios;
 };
 
 struct editorConfig E;
 
+/* The fields of E that belong to a buffer, copied out of E while another
+ * one is edited. Everything else (screen, clipboard, watches, stats, the
+ * journal thread, the grep pool) is shared by all of them */
+#define BUFFER_FIELDS(X) \
+    X(cx) X(cy) X(rx) X(rowoff) X(coloff) X(wrap) X(vrowoff) X(ri) \
+    X(numrows) X(rowcap) X(row) X(mark) X(dirty) X(filename) X(syntax) X(filesize) \
+    X(follow) X(stream) X(compress) X(reload) X(undo) X(hex) X(filter)
+#define BUFFER_FIELD(f) __typeof__(((struct editorConfig *)0)->f) f;
+
+struct editorBuffer {
+    BUFFER_FIELDS(BUFFER_FIELD)
+    int grep;                   /* E.grep.active, its rows are hits */
+    struct journalFile journal;
+    int id;                     /* Stays the same when buffers before it close */
+    double used;                /* Last time it was selected */
+    size_t mem;                 /* Bytes held when last counted, 0 if it changed since */
+    int evicted;                /* Dropped what can be rebuilt, nothing left to drop */
+};
+
 /***************
 *  filetypes  *
 ***************/
@@ -132,18 +545,224 @@ struct editorSyntax HLDB[] = {
 ****************/
 
 void editorRefreshScreen(void);
+void editorHandleResize(void);
+void editorUndoRecord(int kind, int row, int col, int nrows, const char *s, size_t len);
+void editorJournalRecord(int kind, int row, int col, int nrows, const char *s, size_t len);
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+void editorReplaceRows(int kind, int row, int nrows, const char *s, size_t len);
+int editorReplaceValid(int kind, const char *s, size_t len);
+void editorPermuteRows(int kind, int first, int n, const char *s, size_t len);
+void editorSparseRows(int kind, int row, int nrows, const char *s, size_t len);
+int editorSortValid(int kind, int row, int nrows, const char *s, size_t len);
+void editorHexOpen(int fd, struct stat *st);
+void editorHexClose(void);
+int editorCompressFormat(int fd);
+void editorDecodeStart(int fd, int format);
+int editorDecodeStop(void);
+void editorSaveCompressed(void);
+void editorReloadStamp(void);
+void editorMoveCursor(int key);
+size_t rowsMemory(const erow *row, int numrows, int rowcap);
+void editorBracketScan(erow *row);
+struct bracketSum bracketJoin(struct bracketSum a, struct bracketSum b);
+int editorRowHeight(erow *row);
+int editorRenderOffset(erow *row, int col, int *start);
+int editorBufferFind(int id);
+void editorBufferSwitch(int to);
+void editorBufferSelect(int to);
+void editorBufferNew(void);
+void editorBufferOpen(char *filename, int follow);
+void editorOpenFile(char *filename, int follow);
+
+/*************
+*  tracing  *
+*************/
+
+/* Begin/end events of the hot paths. Every thread records into its own ring,
+ * written only by that thread, so recording needs no lock. The rings are
+ * exported as Chrome trace event JSON (chrome://tracing, ui.perfetto.dev) */
+struct traceEvent {
+    const char *name;
+    uint64_t ts;                /* Nanoseconds */
+    int arg;                    /* Rows relexed for editorUpdateSyntax, -1 if none */
+    char phase;                 /* 'B'egin or 'E'nd */
+};
+
+struct traceRing {
+    struct traceEvent ev[KILO_TRACE_EVENTS];
+    uint64_t head;              /* Events ever written, the ring keeps the last ones */
+    int tid;
+    int busy;                   /* A live thread records into it */
+    struct traceRing *next;
+};
+
+char *kilo_trace = NULL;                /* Output file, NULL when not tracing */
+struct traceRing *trace_rings = NULL;   /* Rings of every thread that traced */
+int trace_tids = 0;
+__thread struct traceRing *trace_ring = NULL;
+pthread_key_t trace_key;                /* Hands the ring back when its thread exits */
+pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+
+void traceRingRelease(void *arg)
+{
+    struct traceRing *r = arg;
+    __atomic_store_n(&r->busy, 0, __ATOMIC_RELEASE);
+}
+
+void traceKeyInit(void)
+{
+    pthread_key_create(&trace_key, traceRingRelease);
+}
+
+/* Workers are started for every operation, so a ring left by a thread that
+ * exited is taken over, with its events, before a new one is made */
+void traceEvent(const char *name, char phase, int arg)
+{
+    struct traceRing *r = trace_ring;
+    if (!r) {
+        pthread_once(&trace_once, traceKeyInit);
+        for (r = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+            int idle = 0;
+            if (__atomic_compare_exchange_n(&r->busy, &idle, 1, 0,
+                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+        }
+        if (!r) {
+            r = calloc(1, sizeof(*r));
+            if (!r) return;
+            r->busy = 1;
+            r->tid = __atomic_add_fetch(&trace_tids, 1, __ATOMIC_RELAXED);
+            /* Lock-free push on the list of rings */
+            r->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+            while (!__atomic_compare_exchange_n(&trace_rings, &r->next, r, 0,
+                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        }
+        pthread_setspecific(trace_key, r);
+        trace_ring = r;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t h = r->head;
+    struct traceEvent *e = &r->ev[h % KILO_TRACE_EVENTS];
+    e->name = name;
+    e->ts = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    e->arg = arg;
+    e->phase = phase;
+    __atomic_store_n(&r->head, h + 1, __ATOMIC_RELEASE);
+}
+
+/* Writes the events still in the rings to the trace file, returns how many */
+long traceFlush(void)
+{
+    FILE *fp = fopen(kilo_trace, "w");
+    if (!fp) return -1;
+
+    long n = 0;
+    fprintf(fp, "{\"traceEvents\": [");
+    struct traceRing *r;
+    for (r = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        uint64_t i = head > KILO_TRACE_EVENTS ? head - KILO_TRACE_EVENTS : 0;
+        for (; i < head; ++i) {
+            struct traceEvent *e = &r->ev[i % KILO_TRACE_EVENTS];
+            fprintf(fp, "%s\n{\"name\": \"%s\", \"ph\": \"%c\", \"ts\": %llu.%03llu, "
+                    "\"pid\": 1, \"tid\": %d", n ? "," : "", e->name, e->phase,
+                    (unsigned long long)(e->ts / 1000), (unsigned long long)(e->ts % 1000), r->tid);
+            if (e->arg >= 0) fprintf(fp, ", \"args\": {\"rows\": %d}", e->arg);
+            fprintf(fp, "}");
+            n++;
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    if (fclose(fp) != 0) return -1;
+    return n;
+}
+
+void traceFlushAtExit(void)
+{
+    traceFlush();
+}
 
 /*************
 *  terminal  *
 *************/
 
+/* Bumped by the malloc wrappers of the benchmark build */
+unsigned long kilo_allocs = 0;
+
+#ifdef KILO_COUNT_ALLOCS
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    __atomic_fetch_add(&kilo_allocs, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+    __atomic_fetch_add(&kilo_allocs, 1, __ATOMIC_RELAXED);
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    __atomic_fetch_add(&kilo_allocs, 1, __ATOMIC_RELAXED);
+    return __real_realloc(ptr, size);
+}
+#endif
+
+/* Monotonic time in microseconds */
+double editorNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* All terminal output goes through here, so a replay can redirect it */
+void editorWriteOut(const char *s, size_t len)
+{
+    E.stats.syscalls++;
+    if (E.replay.script) {
+        E.replay.bytes += len;
+        write(E.replay.sink, s, len);
+    } else {
+        write(STDOUT_FILENO, s, len);
+    }
+}
+
+/* Reads a byte of input from the terminal or from the replayed script. The
+ * replay ends, and its report is printed by atexit, with the script */
+ssize_t editorReadInput(char *c)
+{
+    if (!E.replay.script) {
+        struct editorInput *in = &E.input;
+        if (E.hangup) exit(1);
+        if (in->pos == in->len) {
+            E.stats.syscalls++;
+            E.input.reads++;
+            ssize_t n = read(STDIN_FILENO, in->buf, KILO_INPUT_BUF);
+            if (n <= 0) return n;
+            in->len = n;
+            in->pos = 0;
+        }
+        *c = in->buf[in->pos++];
+        return 1;
+    }
+    if (E.replay.pos == E.replay.len) exit(0);
+    *c = E.replay.script[E.replay.pos++];
+    return 1;
+}
+
 void die(const char* s)
 {
     /* Clear screen */
-    write(STDOUT_FILENO, "\x1b[2J", 4);
+    editorWriteOut("\x1b[2J", 4);
     /* Position cursor on top left, so we can render the screen */
-    write(STDOUT_FILENO, "\x1b[1;1H", 3);
+    editorWriteOut("\x1b[1;1H", 3);
 
     perror(s);
     exit(1);
@@ -178,25 +797,101 @@ void enableRawMode(void)
         die("tcsetattr");
 }
 
+void editorWatchAdd(int fd, short events, void (*callback)(int, void *), void *data)
+{
+    if (E.nwatch == KILO_MAX_WATCHES) die("too many watches");
+    E.watch[E.nwatch].fd = fd;
+    E.watch[E.nwatch].events = events;
+    E.watch[E.nwatch].callback = callback;
+    E.watch[E.nwatch].data = data;
+    E.watch[E.nwatch].buffer = E.nbuffers ? E.buffers[E.buffer].id : 0;
+    E.nwatch++;
+}
+
+void editorWatchRemove(int fd)
+{
+    int j;
+    for (j = 0; j < E.nwatch; ++j) {
+        if (E.watch[j].fd == fd) {
+            memmove(&E.watch[j], &E.watch[j + 1], sizeof(struct editorWatch) * (E.nwatch - j - 1));
+            E.nwatch--;
+            return;
+        }
+    }
+}
+
+/* Waits up to 'timeout' ms (-1 for ever) until a key can be read, serving
+ * background watches meanwhile. Returns 1 if a key is ready, 0 if something
+ * else happened and the screen must be redrawn, -1 on timeout */
+int editorWaitKey(int timeout)
+{
+    if (E.replay.script || E.input.pos < E.input.len) return 1;
+    while (1) {
+        if (E.hangup) exit(1);
+        if (E.resized) {
+            editorHandleResize();
+            return 0;
+        }
+
+        struct pollfd fds[KILO_MAX_WATCHES + 1];
+        struct editorWatch watch[KILO_MAX_WATCHES];
+        int nwatch = E.nwatch, j;
+        /* Callbacks may add or remove watches, work on a copy */
+        memcpy(watch, E.watch, sizeof(struct editorWatch) * nwatch);
+        fds[0].fd = STDIN_FILENO;
+        fds[0].events = POLLIN;
+        for (j = 0; j < nwatch; ++j) {
+            fds[j + 1].fd = watch[j].fd;
+            fds[j + 1].events = watch[j].events;
+        }
+
+        E.stats.syscalls++;
+        int ready = poll(fds, nwatch + 1, timeout);
+        if (ready == -1) {
+            if (errno == EINTR) continue;
+            die("poll");
+        }
+        if (ready == 0) return -1;
+
+        int served = 0;
+        for (j = 0; j < nwatch; ++j) {
+            if (fds[j + 1].revents) {
+                /* A parked buffer is switched in around its callback */
+                int cur = E.buffer, at = editorBufferFind(watch[j].buffer);
+                if (at != -1 && at != cur) editorBufferSwitch(at);
+                watch[j].callback(watch[j].fd, watch[j].data);
+                if (at != -1 && at != cur) editorBufferSwitch(cur);
+                served = 1;
+            }
+        }
+        /* Keys first, a watch that is always ready must not starve them */
+        if (fds[0].revents) return 1;
+        if (served) return 0;
+    }
+}
+
 int editorReadKey(void)
 {
     int nread;
     char c;
-    while (( nread = read(STDIN_FILENO, &c, 1) ) != 1) {
+    if (editorWaitKey(-1) != 1) return WAKEUP_KEY;
+    while (( nread = editorReadInput(&c) ) != 1) {
         /* In cygwin, when read() times out it return -1 with an errno of EAGAIN */
-        if (nread == -1 && errno != EAGAIN) die("read");
+        if (nread == -1 && errno != EAGAIN && errno != EINTR) die("read");
     }
+    /* Start of the key to frame latency */
+    if (STATS_ON() && E.stats.key_time == 0) E.stats.key_time = editorNow();
 
     /* If it is escape sequence */
     if (c == '\x1b') {
         char seq[3];
 
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+        if (editorReadInput(&seq[0]) != 1) return '\x1b';
+        if (editorReadInput(&seq[1]) != 1) return '\x1b';
 
         if (seq[0] == '[') {
             if (seq[1] >= '0' && seq[1] <= '9') {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
+                if (editorReadInput(&seq[2]) != 1) return '\x1b';
                 if (seq[2] == '~') {
                     switch (seq[1]) {
                         case '1': return HOME_KEY;
@@ -274,13 +969,18 @@ int is_separator(int c)
     return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
 }
 
-void editorUpdateSyntax(erow *row)
+/* Highlights a single row, returns 1 if its multiline comment state changed
+ * and the next row needs to be highlighted again */
+int editorHighlightRow(erow *row)
 {
     row->hl = realloc(row->hl, row->rsize);
     memset(row->hl, HL_NORMAL, row->rsize);
 
     /* Return if the current file doesn't have a syntax */
-    if (E.syntax == NULL) return;
+    if (E.syntax == NULL) {
+        editorBracketScan(row);
+        return 0;
+    }
 
     char **keywords = E.syntax->keywords;
 
@@ -390,11 +1090,33 @@ void editorUpdateSyntax(erow *row)
         ++i;
     }
 
+    editorBracketScan(row);
+
     /*Handle multiline comments*/
     int changed = (row->hl_open_comment != in_comment);
     row->hl_open_comment = in_comment;
-    if (changed && row->idx + 1 < E.numrows)    /* propagate ml comment or uncomment */
-        editorUpdateSyntax(&E.row[row->idx + 1]);
+    return changed;
+}
+
+void editorUpdateSyntax(erow *row)
+{
+    /* Propagate ml comment or uncomment, in a loop instead of recursing so a
+     * comment spanning many rows can't overflow the stack */
+    int rows = 1;
+    TRACE_BEGIN("editorUpdateSyntax");
+    while (editorHighlightRow(row) && row->idx + 1 < E.numrows) {
+        row = &E.row[row->idx + 1];
+        rows++;
+    }
+    E.stats.relexed += rows;
+    TRACE_END_ARG("editorUpdateSyntax", rows);
+}
+
+/* Rows loaded from the sidecar cache only know their multiline comment state
+ * and are highlighted the first time they are needed */
+void editorEnsureHighlight(erow *row)
+{
+    if (!row->hl) editorUpdateSyntax(row);
 }
 
 int editorSyntaxToColor(int hl)
@@ -407,6 +1129,7 @@ int editorSyntaxToColor(int hl)
         case HL_STRING: return 35;
         case HL_NUMBER: return 31;
         case HL_MATCH:  return 34;
+        case HL_BRACKET: return 32;
         default: return 37;
     }
 }
@@ -416,8 +1139,16 @@ void editorSelectSyntaxHighlight(void)
     E.syntax = NULL;
     if (E.filename == NULL) return;
 
-    /* Find last ocurrence of . in filename */
+    /* Find last ocurrence of . in filename, the one before the suffix of a
+     * compressed file */
     char *ext = strrchr(E.filename, '.');
+    size_t extlen = ext ? strlen(ext) : 0;
+    if (ext && (!strcmp(ext, ".gz") || !strcmp(ext, ".zst"))) {
+        char *end = ext;
+        while (ext > E.filename && ext[-1] != '/' && *--ext != '.');
+        extlen = end - ext;
+        if (*ext != '.' || extlen == 0) ext = NULL;
+    }
 
     unsigned int j;
     for (j = 0; j < HLDB_ENTRIES; ++j) {
@@ -425,7 +1156,8 @@ void editorSelectSyntaxHighlight(void)
         unsigned int i = 0;
         while (s->filematch[i]) {
             int is_ext = (s->filematch[i][0] == '.');
-            if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+            if ((is_ext && ext && strlen(s->filematch[i]) == extlen &&
+                        !strncmp(ext, s->filematch[i], extlen)) ||
                 (!is_ext && strstr(E.filename, s->filematch[i]))) {
                 E.syntax = s;
 
@@ -442,160 +1174,936 @@ void editorSelectSyntaxHighlight(void)
     }
 }
 
-/********************
-*  row operations  *
-********************/
+/***************
+*  row index  *
+***************/
 
-int editorRowCxToRx(erow *row, int cx)
+/* Mark the index stale, it will be rebuilt on the next query. Used when
+ * every row is replaced at once (loading, closing), where a rebuild costs no
+ * more than the operation itself */
+void editorIndexInvalidate(void)
 {
-    int j, rx = 0;
-    for (j = 0; j < cx; ++j) {
-        if (row->chars[j] == '\t')
-            rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
-        rx++;
-    }
+    E.ri.valid = 0;
+}
 
-    return rx;
+int indexCount(int t)
+{
+    return E.ri.node[t].count;
 }
 
-int editorRowRxToCx(erow *row, int rx)
+/* Recomputes the sums of node 't' from its row and its children */
+void indexPull(int t)
 {
-    int cur_rx = 0;
-    int cx;
-    for (cx = 0; cx < row->size; cx++) {
-        if (row->chars[cx] == '\t')
-            cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
-        cur_rx++;
-        if (cur_rx > rx) return cx;
-    }
-    return cx;
+    struct rowNode *n = &E.ri.node[t], *l = &E.ri.node[n->l], *r = &E.ri.node[n->r];
+    n->count = l->count + 1 + r->count;
+    n->hsum = l->hsum + n->height + r->hsum;
+    n->wmax = n->width;
+    if (l->wmax > n->wmax) n->wmax = l->wmax;
+    if (r->wmax > n->wmax) n->wmax = r->wmax;
+    n->bsum = bracketJoin(bracketJoin(l->bsum, n->br), r->bsum);
 }
 
-void editorUpdateRow(erow *row)
+/* A node from the free list, or a new one. Node 0 stands for no child, all
+ * its fields stay 0 */
+int indexAlloc(void)
 {
-    /* Count how many tabs in line */
-    int j, tabs = 0;
-    for (j = 0; j < row->size; ++j) {
-        if (row->chars[j] == '\t') tabs++;
+    struct rowIndex *ri = &E.ri;
+    int t = ri->free;
+    if (t) {
+        ri->free = ri->node[t].l;
+        return t;
+    }
+    if (ri->used == ri->cap) {
+        ri->cap = ri->cap ? ri->cap * 2 : 1024;
+        ri->node = realloc(ri->node, sizeof(struct rowNode) * ri->cap);
+        if (!ri->node) die("realloc");
+        memset(&ri->node[0], 0, sizeof(struct rowNode));
     }
+    return ri->used++;
+}
 
-    /* Reserve maximum memory necessary */
-    free(row->render);
-    row->render = malloc(row->size + tabs*(KILO_TAB_STOP-1) + 1);
-    /* Handle error */
-    if (!row->render) die("malloc");
+void indexFree(int t)
+{
+    if (!t) return;
+    indexFree(E.ri.node[t].l);
+    indexFree(E.ri.node[t].r);
+    E.ri.node[t].l = E.ri.free;
+    E.ri.free = t;
+}
 
-    /* Convert chars to render (handle tabs, ...) */
-    int idx = 0;
-    for (j = 0; j < row->size; ++j) {
-        if (row->chars[j] == '\t') {
-            row->render[idx++] = ' ';
-            while (idx % KILO_TAB_STOP != 0) row->render[idx++] = ' ';
-        } else {
-            row->render[idx++] = row->chars[j];
-        }
+/* Balanced subtree of the 'n' rows from 'first', in O(n) */
+int indexBuild(int first, int n)
+{
+    if (n <= 0) return 0;
+    int mid = first + n / 2, t = indexAlloc();
+    int l = indexBuild(first, mid - first);
+    int r = indexBuild(mid + 1, first + n - mid - 1);
+    struct rowNode *node = &E.ri.node[t];
+    node->l = l;
+    node->r = r;
+    node->width = E.row[mid].rwidth;
+    node->height = editorRowHeight(&E.row[mid]);
+    node->br = E.row[mid].br;
+    indexPull(t);
+    return t;
+}
+
+/* Splits 't' into its first 'k' rows and the rest */
+void indexSplit(int t, int k, int *a, int *b)
+{
+    if (!t) {
+        *a = *b = 0;
+        return;
+    }
+    int lc = indexCount(E.ri.node[t].l);
+    if (k <= lc) {
+        indexSplit(E.ri.node[t].l, k, a, b);
+        E.ri.node[t].l = *b;
+        *b = t;
+    } else {
+        indexSplit(E.ri.node[t].r, k - lc - 1, a, b);
+        E.ri.node[t].r = *a;
+        *a = t;
     }
+    indexPull(t);
+}
 
-    row->render[idx] = '\0';
-    row->rsize = idx;
+/* Joins the rows of 'a' and then those of 'b'. The root is drawn at random
+ * with odds by size, which keeps the depth O(log n) expected whatever the
+ * order of the edits */
+int indexMerge(int a, int b)
+{
+    static uint32_t seed = 2463534242u;
+    if (!a || !b) return a ? a : b;
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    if (seed % (uint32_t)(indexCount(a) + indexCount(b)) < (uint32_t)indexCount(a)) {
+        int r = indexMerge(E.ri.node[a].r, b);
+        E.ri.node[a].r = r;
+        indexPull(a);
+        return a;
+    }
+    int l = indexMerge(a, E.ri.node[b].l);
+    E.ri.node[b].l = l;
+    indexPull(b);
+    return b;
+}
 
-    editorUpdateSyntax(row);
+/* Build the tree in O(n) from the row sizes, no row is rendered again. The
+ * bracket sums wait for the first match, as rows loaded from the cache
+ * aren't lexed yet */
+void editorIndexRebuild(void)
+{
+    struct rowIndex *ri = &E.ri;
+    ri->used = ri->free = 0;
+    indexAlloc();        /* Node 0 */
+    ri->root = indexBuild(0, E.numrows);
+    ri->cols = E.screencols;
+    ri->valid = 1;
+    ri->brackets = 0;
 }
 
-void editorInsertRow(int at, char *s, size_t len)
+/* After a resize only rows wider than the narrower of the two widths can
+ * change height, subtrees without any are skipped */
+void indexResize(int t, int first, int narrow)
 {
-    if (at < 0 || at > E.numrows) return;
+    struct rowNode *n = &E.ri.node[t];
+    if (!t || n->wmax <= narrow) return;
+    int lc = indexCount(n->l);
+    indexResize(n->l, first, narrow);
+    indexResize(n->r, first + lc + 1, narrow);
+    n = &E.ri.node[t];
+    if (n->width > narrow) n->height = editorRowHeight(&E.row[first + lc]);
+    indexPull(t);
+}
 
-    /* Fetch memory to save new line */
-    E.row = realloc(E.row, sizeof(erow) * ( E.numrows + 1 ));
-    if (!E.row) die("realloc");
+void editorIndexEnsure(void)
+{
+    struct rowIndex *ri = &E.ri;
+    if (!ri->valid || indexCount(ri->root) != E.numrows) {
+        editorIndexRebuild();
+    } else if (ri->cols != E.screencols) {
+        indexResize(ri->root, 0, ri->cols < E.screencols ? ri->cols : E.screencols);
+        ri->cols = E.screencols;
+    }
+}
 
-    memmove(&E.row[E.cy+1], &E.row[E.cy], sizeof(erow)*(E.numrows - at));
-    /* Update idx of subsequent rows */
-    int j;
-    for (j = at + 1; j <= E.numrows; ++j) E.row[j].idx++;
+void indexSet(int t, int pos, erow *row)
+{
+    struct rowNode *n = &E.ri.node[t];
+    int lc = indexCount(n->l);
+    if (pos < lc) {
+        indexSet(n->l, pos, row);
+    } else if (pos > lc) {
+        indexSet(n->r, pos - lc - 1, row);
+    } else {
+        n->width = row->rwidth;
+        n->height = editorRowHeight(row);
+        n->br = row->br;
+    }
+    indexPull(t);
+}
 
-    E.row[at].idx = at;
+/* Update the node of a single row after it was rendered or lexed, O(log n) */
+void editorIndexUpdateRow(erow *row)
+{
+    struct rowIndex *ri = &E.ri;
+    /* Rows of a replace being built by threads aren't in the file yet */
+    if (!ri->valid || row->idx >= indexCount(ri->root) || row != &E.row[row->idx]) return;
+    indexSet(ri->root, row->idx, row);
+}
 
-    /* Allocate new line */
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    if (!E.row[at].chars) die("malloc");
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
+/* The 'del' rows at 'at' were replaced by the 'ins' rows now there: their
+ * nodes are split out and the new ones merged in, O(ins + log n). New rows
+ * get their bracket sums when lexed, right after */
+void editorIndexSplice(int at, int del, int ins)
+{
+    struct rowIndex *ri = &E.ri;
+    if (!ri->valid) return;
+    if (indexCount(ri->root) != E.numrows - ins + del) {
+        ri->valid = 0;
+        return;
+    }
+    int a, b, c;
+    indexSplit(ri->root, at, &a, &b);
+    indexSplit(b, del, &b, &c);
+    indexFree(b);
+    ri->root = indexMerge(indexMerge(a, indexBuild(at, ins)), c);
+}
 
-    /* Initialize render row */
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    E.row[at].hl = NULL;
-    E.row[at].hl_open_comment = 0;
-    editorUpdateRow(&E.row[at]);
-    
-    /* Increase count */
-    E.numrows++;
+/* The rows in [lo, hi) were rotated left by 'k', O(log n) */
+void editorIndexRotate(int lo, int hi, int k)
+{
+    struct rowIndex *ri = &E.ri;
+    if (!ri->valid) return;
+    if (indexCount(ri->root) != E.numrows) {
+        ri->valid = 0;
+        return;
+    }
+    int a, b, c, d;
+    indexSplit(ri->root, lo, &a, &b);
+    indexSplit(b, k, &b, &c);
+    indexSplit(c, hi - lo - k, &c, &d);
+    ri->root = indexMerge(indexMerge(a, c), indexMerge(b, d));
+}
 
-    /* The file has changed */
-    E.dirty++;
+/***************
+*  soft wrap  *
+***************/
+
+/* Column where the visual line starting at column 'start' ends. A double
+ * width character that would straddle the edge goes to the next line */
+int editorWrapNext(erow *row, int start)
+{
+    int end = start + E.screencols, cstart;
+    if (end >= row->rwidth) return row->rwidth;
+    if (!row->cols) return end;
+    editorRenderOffset(row, end, &cstart);
+    return (cstart > start) ? cstart : end;
 }
 
-void editorFreeRow(erow *row)
+/* Column where visual line 'sub' of a row starts */
+int editorWrapStart(erow *row, int sub)
 {
-    free(row->render);
-    free(row->chars);
-    free(row->hl);
+    if (!row->cols) return sub * E.screencols;
+    int col = 0;
+    while (sub-- > 0 && col < row->rwidth) col = editorWrapNext(row, col);
+    return col;
 }
 
-void editorDelRow(int at)
+/* Number of screen lines a row takes when wrapped */
+int editorRowHeight(erow *row)
 {
-    if (at < 0 || at >= E.numrows) return;
+    if (row->rwidth == 0) return 1;
+    if (!row->cols) return (row->rwidth + E.screencols - 1) / E.screencols;
+    int height = 0, col = 0;
+    for (; col < row->rwidth; ++height) col = editorWrapNext(row, col);
+    return height;
+}
 
-    /* Free memory of the current row */
-    editorFreeRow(&E.row[at]);
+/* Sum of the heights of the rows before 'row' */
+int editorWrapPrefix(int row)
+{
+    editorIndexEnsure();
+    int t = E.ri.root, sum = 0;
+    while (t) {
+        struct rowNode *n = &E.ri.node[t];
+        int lc = indexCount(n->l);
+        if (row <= lc) {
+            t = n->l;
+        } else {
+            sum += E.ri.node[n->l].hsum + n->height;
+            row -= lc + 1;
+            t = n->r;
+        }
+    }
+    return sum;
+}
+
+int editorWrapTotal(void)
+{
+    editorIndexEnsure();
+    return E.ri.node[E.ri.root].hsum;
+}
+
+/* Returns the row that contains visual line 'vline', and in 'sub' the line
+ * within that row. Returns E.numrows if vline is past the end of the file */
+int editorWrapFind(int vline, int *sub)
+{
+    editorIndexEnsure();
+
+    int t = E.ri.root, pos = 0;
+    *sub = 0;
+    while (t) {
+        struct rowNode *n = &E.ri.node[t];
+        int lsum = E.ri.node[n->l].hsum;
+        if (vline < lsum) {
+            t = n->l;
+            continue;
+        }
+        pos += indexCount(n->l);
+        vline -= lsum;
+        if (vline < n->height) {
+            *sub = vline;
+            return pos;
+        }
+        vline -= n->height;
+        pos++;
+        t = n->r;
+    }
+    return pos;
+}
+
+/* Visual line and column of the cursor */
+void editorWrapCursor(int *vline, int *vcol)
+{
+    *vline = editorWrapPrefix(E.cy);
+    *vcol = E.rx;
+    if (E.cy < E.numrows) {
+        erow *row = &E.row[E.cy];
+        int sub = 0, start = 0;
+        if (!row->cols) {
+            int height = editorRowHeight(row);
+            sub = E.rx / E.screencols;
+            if (sub >= height) sub = height - 1;
+            start = sub * E.screencols;
+        } else {
+            int end;
+            while ((end = editorWrapNext(row, start)) <= E.rx && end < row->rwidth) {
+                start = end;
+                sub++;
+            }
+        }
+        *vline += sub;
+        *vcol -= start;
+    }
+}
+
+void editorToggleWrap(void)
+{
+    int sub;
+    if (E.wrap) {
+        E.rowoff = editorWrapFind(E.vrowoff, &sub);
+    } else {
+        E.vrowoff = editorWrapPrefix(E.rowoff);
+        E.coloff = 0;
+    }
+    E.wrap = !E.wrap;
+}
+
+/********************
+*  row operations  *
+********************/
+
+/* Code points not one column wide, sorted. Anything below the first one is
+ * narrow, controls are shown as one inverted character */
+struct widthRange {
+    int first, last, width;
+};
+
+const struct widthRange width_table[] = {
+    {0x0300, 0x036f, 0}, {0x0483, 0x0489, 0}, {0x0591, 0x05bd, 0}, {0x05bf, 0x05bf, 0},
+    {0x05c1, 0x05c2, 0}, {0x05c4, 0x05c5, 0}, {0x05c7, 0x05c7, 0}, {0x0610, 0x061a, 0},
+    {0x064b, 0x065f, 0}, {0x0670, 0x0670, 0}, {0x06d6, 0x06dc, 0}, {0x06df, 0x06e4, 0},
+    {0x06e7, 0x06e8, 0}, {0x06ea, 0x06ed, 0}, {0x0900, 0x0902, 0}, {0x093a, 0x093a, 0},
+    {0x093c, 0x093c, 0}, {0x0941, 0x0948, 0}, {0x094d, 0x094d, 0}, {0x0951, 0x0957, 0},
+    {0x0e31, 0x0e31, 0}, {0x0e34, 0x0e3a, 0}, {0x0e47, 0x0e4e, 0},
+    {0x1100, 0x115f, 2}, {0x1ab0, 0x1aff, 0}, {0x1dc0, 0x1dff, 0},
+    {0x200b, 0x200f, 0}, {0x202a, 0x202e, 0}, {0x2060, 0x2064, 0}, {0x20d0, 0x20ff, 0},
+    {0x231a, 0x231b, 2}, {0x2329, 0x232a, 2}, {0x23e9, 0x23ec, 2}, {0x23f0, 0x23f0, 2},
+    {0x23f3, 0x23f3, 2}, {0x25fd, 0x25fe, 2}, {0x2614, 0x2615, 2}, {0x2648, 0x2653, 2},
+    {0x267f, 0x267f, 2}, {0x2693, 0x2693, 2}, {0x26a1, 0x26a1, 2}, {0x26aa, 0x26ab, 2},
+    {0x26bd, 0x26be, 2}, {0x26c4, 0x26c5, 2}, {0x26ce, 0x26ce, 2}, {0x26d4, 0x26d4, 2},
+    {0x26ea, 0x26ea, 2}, {0x26f2, 0x26f3, 2}, {0x26f5, 0x26f5, 2}, {0x26fa, 0x26fa, 2},
+    {0x26fd, 0x26fd, 2}, {0x2705, 0x2705, 2}, {0x270a, 0x270b, 2}, {0x2728, 0x2728, 2},
+    {0x274c, 0x274c, 2}, {0x274e, 0x274e, 2}, {0x2753, 0x2755, 2}, {0x2757, 0x2757, 2},
+    {0x2795, 0x2797, 2}, {0x27b0, 0x27b0, 2}, {0x27bf, 0x27bf, 2}, {0x2b1b, 0x2b1c, 2},
+    {0x2b50, 0x2b50, 2}, {0x2b55, 0x2b55, 2}, {0x2cef, 0x2cf1, 0}, {0x2de0, 0x2dff, 0},
+    {0x2e80, 0x3029, 2}, {0x302a, 0x302d, 0}, {0x302e, 0x303e, 2}, {0x3041, 0x3098, 2},
+    {0x3099, 0x309a, 0}, {0x309b, 0x4dbf, 2}, {0x4e00, 0xa4cf, 2}, {0xa960, 0xa97f, 2},
+    {0xac00, 0xd7a3, 2}, {0xf900, 0xfaff, 2}, {0xfe00, 0xfe0f, 0}, {0xfe10, 0xfe19, 2},
+    {0xfe20, 0xfe2f, 0}, {0xfe30, 0xfe6f, 2}, {0xfeff, 0xfeff, 0}, {0xff00, 0xff60, 2},
+    {0xffe0, 0xffe6, 2}, {0x16fe0, 0x16fe4, 2}, {0x17000, 0x18cff, 2}, {0x1b000, 0x1b2ff, 2},
+    {0x1f004, 0x1f004, 2}, {0x1f0cf, 0x1f0cf, 2}, {0x1f18e, 0x1f18e, 2}, {0x1f191, 0x1f19a, 2},
+    {0x1f200, 0x1f251, 2}, {0x1f300, 0x1f320, 2}, {0x1f32d, 0x1f335, 2}, {0x1f337, 0x1f37c, 2},
+    {0x1f37e, 0x1f393, 2}, {0x1f3a0, 0x1f3ca, 2}, {0x1f3cf, 0x1f3d3, 2}, {0x1f3e0, 0x1f3f0, 2},
+    {0x1f3f4, 0x1f3f4, 2}, {0x1f3f8, 0x1f43e, 2}, {0x1f440, 0x1f440, 2}, {0x1f442, 0x1f4fc, 2},
+    {0x1f4ff, 0x1f53d, 2}, {0x1f54b, 0x1f54e, 2}, {0x1f550, 0x1f567, 2}, {0x1f57a, 0x1f57a, 2},
+    {0x1f595, 0x1f596, 2}, {0x1f5a4, 0x1f5a4, 2}, {0x1f5fb, 0x1f64f, 2}, {0x1f680, 0x1f6c5, 2},
+    {0x1f6cc, 0x1f6cc, 2}, {0x1f6d0, 0x1f6d2, 2}, {0x1f6d5, 0x1f6d7, 2}, {0x1f6eb, 0x1f6ec, 2},
+    {0x1f6f4, 0x1f6fc, 2}, {0x1f7e0, 0x1f7eb, 2}, {0x1f90c, 0x1f93a, 2}, {0x1f93c, 0x1f945, 2},
+    {0x1f947, 0x1f9ff, 2}, {0x1fa70, 0x1faff, 2}, {0x20000, 0x2fffd, 2}, {0x30000, 0x3fffd, 2},
+    {0xe0001, 0xe0001, 0}, {0xe0020, 0xe007f, 0}, {0xe0100, 0xe01ef, 0},
+};
+
+#define WIDTH_ENTRIES (sizeof(width_table) / sizeof(width_table[0]))
+
+int charWidth(int cp)
+{
+    if (cp < 0x300) return 1;
+    int lo = 0, hi = WIDTH_ENTRIES - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (cp < width_table[mid].first) hi = mid - 1;
+        else if (cp > width_table[mid].last) lo = mid + 1;
+        else return width_table[mid].width;
+    }
+    return 1;
+}
+
+/* Decodes the character at s[0, len), returns its length in bytes. A byte
+ * that doesn't start a valid UTF-8 sequence is a character by itself with
+ * '*cp' set to -1 */
+int utf8Decode(const char *s, int len, int *cp)
+{
+    unsigned char c = s[0];
+    int n, v, i;
+    if (c < 0x80) {
+        *cp = c;
+        return 1;
+    }
+    if (c >= 0xc2 && c <= 0xdf) n = 2, v = c & 0x1f;
+    else if (c >= 0xe0 && c <= 0xef) n = 3, v = c & 0x0f;
+    else if (c >= 0xf0 && c <= 0xf4) n = 4, v = c & 0x07;
+    else n = 0, v = 0;
+    if (n == 0 || n > len) {
+        *cp = -1;
+        return 1;
+    }
+    for (i = 1; i < n; ++i) {
+        if ((s[i] & 0xc0) != 0x80) {
+            *cp = -1;
+            return 1;
+        }
+        v = v << 6 | (s[i] & 0x3f);
+    }
+    /* Overlong forms, surrogates and past U+10FFFF */
+    if ((n == 3 && v < 0x800) || (n == 4 && (v < 0x10000 || v > 0x10ffff)) ||
+            (v >= 0xd800 && v <= 0xdfff)) {
+        *cp = -1;
+        return 1;
+    }
+    *cp = v;
+    return n;
+}
+
+/* Length of the character at s[0, len), and in '*width' its columns */
+int utf8Char(const char *s, int len, int *width)
+{
+    int cp, n = utf8Decode(s, len, &cp);
+    *width = (cp < 0) ? 1 : charWidth(cp);
+    return n;
+}
+
+/* Whether s[0, len) is all ASCII, 16 bytes at a time with SSE2 */
+int utf8IsAscii(const char *s, int len)
+{
+    int i = 0;
+#ifdef __SSE2__
+    __m128i high = _mm_setzero_si128();
+    for (; i + 16 <= len; i += 16) high = _mm_or_si128(high, _mm_loadu_si128((const __m128i *)&s[i]));
+    if (_mm_movemask_epi8(high)) return 0;
+#endif
+    for (; i < len; ++i)
+        if (s[i] & 0x80) return 0;
+    return 1;
+}
+
+/* Render offset of the character covering column 'col', and in '*start' the
+ * column it starts at. Past the end of the row every column is a byte */
+int editorRenderOffset(erow *row, int col, int *start)
+{
+    if (!row->cols || col >= row->rwidth) {
+        *start = col;
+        return col - row->rwidth + row->rsize;
+    }
+    struct colMark *m = &row->cols[col / KILO_COL_STEP];
+    int off = m->off, c = m->col, w;
+    while (1) {
+        int n = utf8Char(&row->render[off], row->rsize - off, &w);
+        if (c + w > col) break;
+        c += w;
+        off += n;
+    }
+    *start = c;
+    return off;
+}
+
+/* Column of the character starting at render offset 'off' */
+int editorRenderColumn(erow *row, int off)
+{
+    if (!row->cols || off >= row->rsize) return off - row->rsize + row->rwidth;
+    int lo = 0, hi = row->rwidth / KILO_COL_STEP;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (row->cols[mid].off <= off) lo = mid;
+        else hi = mid - 1;
+    }
+    int at = row->cols[lo].off, c = row->cols[lo].col, w;
+    while (at < off) {
+        at += utf8Char(&row->render[at], row->rsize - at, &w);
+        c += w;
+    }
+    return c;
+}
+
+/* Byte after the character at 'at' and the zero width ones joined to it */
+int editorRowNextChar(erow *row, int at)
+{
+    int w;
+    if (at >= row->size) return row->size;
+    at += utf8Char(&row->chars[at], row->size - at, &w);
+    while (at < row->size) {
+        int n = utf8Char(&row->chars[at], row->size - at, &w);
+        if (w) break;
+        at += n;
+    }
+    return at;
+}
+
+/* Start of the character before 'at', with the zero width ones joined to it */
+int editorRowPrevChar(erow *row, int at)
+{
+    int w;
+    while (at > 0) {
+        int from = at - 1;
+        while (from > 0 && at - from < 4 && (row->chars[from] & 0xc0) == 0x80) from--;
+        /* A stray continuation byte is a character by itself */
+        if (from + utf8Char(&row->chars[from], row->size - from, &w) != at) from = at - 1, w = 1;
+        at = from;
+        if (w) break;
+    }
+    return at;
+}
+
+int editorRowCxToRx(erow *row, int cx)
+{
+    int j, rx = 0;
+    if (!row->cols) {
+        for (j = 0; j < cx; ++j) {
+            if (row->chars[j] == '\t')
+                rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
+            rx++;
+        }
+        return rx;
+    }
+
+    for (j = 0; j < cx && j < row->size;) {
+        int w = 1;
+        if (row->chars[j] == '\t') {
+            rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
+            j++;
+        } else {
+            j += utf8Char(&row->chars[j], row->size - j, &w);
+        }
+        rx += w;
+    }
+    return rx;
+}
+
+/* Offset in render of chars[cx] */
+int editorRowCxToOffset(erow *row, int cx)
+{
+    if (!row->cols) return editorRowCxToRx(row, cx);
+    int j, off = 0, col = 0;
+    for (j = 0; j < cx && j < row->size;) {
+        if (row->chars[j] == '\t') {
+            int n = KILO_TAB_STOP - col % KILO_TAB_STOP;
+            off += n;
+            col += n;
+            j++;
+        } else {
+            int w, n = utf8Char(&row->chars[j], row->size - j, &w);
+            off += n;
+            col += w;
+            j += n;
+        }
+    }
+    /* Bytes other than tabs are copied as they are */
+    return off - (j - cx);
+}
+
+int editorRowRxToCx(erow *row, int rx)
+{
+    int cur_rx = 0;
+    int cx;
+    if (!row->cols) {
+        for (cx = 0; cx < row->size; cx++) {
+            if (row->chars[cx] == '\t')
+                cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
+            cur_rx++;
+            if (cur_rx > rx) return cx;
+        }
+        return cx;
+    }
+
+    for (cx = 0; cx < row->size;) {
+        int w = 1, n = 1;
+        if (row->chars[cx] == '\t')
+            cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
+        else
+            n = utf8Char(&row->chars[cx], row->size - cx, &w);
+        cur_rx += w;
+        if (cur_rx > rx) return cx;
+        cx += n;
+    }
+    return cx;
+}
+
+/* Marks where the character covering every KILO_COL_STEP'th column starts,
+ * so a row with UTF-8 is only decoded from the nearest mark when drawn */
+void editorUpdateColumns(erow *row)
+{
+    free(row->cols);
+    row->cols = malloc(sizeof(struct colMark) * (row->rsize / KILO_COL_STEP + 1));
+    if (!row->cols) die("malloc");
+
+    /* Every column takes at least a byte, so rsize bounds the marks */
+    int off = 0, col = 0, n = 0, w;
+    while (off < row->rsize) {
+        int len = utf8Char(&row->render[off], row->rsize - off, &w);
+        if (col + w > n * KILO_COL_STEP) {
+            row->cols[n].off = off;
+            row->cols[n].col = col;
+            n++;
+        }
+        col += w;
+        off += len;
+    }
+    if (n == 0 || col == n * KILO_COL_STEP) {
+        row->cols[n].off = off;
+        row->cols[n].col = col;
+    }
+    row->rwidth = col;
+}
+
+/* Builds render from chars. Only touches the row itself, so it is safe to
+ * call from the loader threads */
+void editorUpdateRender(erow *row)
+{
+    /* Count how many tabs in line */
+    int j, tabs = 0;
+    for (j = 0; j < row->size; ++j) {
+        if (row->chars[j] == '\t') tabs++;
+    }
+
+    /* Reserve maximum memory necessary */
+    free(row->render);
+    row->render = malloc(row->size + tabs*(KILO_TAB_STOP-1) + 1);
+    /* Handle error */
+    if (!row->render) die("malloc");
+
+    /* Plain ASCII rows take a column a byte and need no marks */
+    int ascii = utf8IsAscii(row->chars, row->size);
+
+    /* Convert chars to render (handle tabs, ...) */
+    int idx = 0;
+    if (ascii) {
+        for (j = 0; j < row->size; ++j) {
+            if (row->chars[j] == '\t') {
+                row->render[idx++] = ' ';
+                while (idx % KILO_TAB_STOP != 0) row->render[idx++] = ' ';
+            } else {
+                row->render[idx++] = row->chars[j];
+            }
+        }
+    } else {
+        /* Tab stops are counted in columns, not bytes */
+        int col = 0, w, n;
+        for (j = 0; j < row->size; j += n) {
+            if (row->chars[j] == '\t') {
+                n = 1;
+                do {
+                    row->render[idx++] = ' ';
+                } while (++col % KILO_TAB_STOP != 0);
+            } else {
+                n = utf8Char(&row->chars[j], row->size - j, &w);
+                memcpy(&row->render[idx], &row->chars[j], n);
+                idx += n;
+                col += w;
+            }
+        }
+    }
+
+    row->render[idx] = '\0';
+    row->rsize = idx;
+
+    if (ascii) {
+        free(row->cols);
+        row->cols = NULL;
+        row->rwidth = idx;
+    } else {
+        editorUpdateColumns(row);
+    }
+}
+
+void editorUpdateRow(erow *row)
+{
+    TRACE_BEGIN("editorUpdateRow");
+    editorUpdateRender(row);
+    editorIndexUpdateRow(row);
+    editorUpdateSyntax(row);
+    TRACE_END("editorUpdateRow");
+}
+
+/* Makes room for 'n' more rows, growing geometrically so rows appended one at
+ * a time (follow mode, streams) don't realloc the whole array every time */
+void editorReserveRows(size_t n)
+{
+    if (E.numrows + n <= (size_t)E.rowcap) return;
+    if (E.numrows + n > INT_MAX) die("too many lines");
+
+    size_t cap = E.rowcap ? E.rowcap : 64;
+    while (cap < E.numrows + n) cap *= 2;
+    if (cap > INT_MAX) cap = INT_MAX;
+    E.row = realloc(E.row, sizeof(erow) * cap);
+    if (!E.row) die("realloc");
+    E.rowcap = cap;
+}
+
+void editorInsertRow(int at, char *s, size_t len)
+{
+    if (at < 0 || at > E.numrows) return;
+    editorUndoRecord(UNDO_INSERT_ROWS, at, 0, 1, s, len);
+
+    /* Fetch memory to save new line */
+    editorReserveRows(1);
+
+    memmove(&E.row[at + 1], &E.row[at], sizeof(erow)*(E.numrows - at));
+    /* Update idx of subsequent rows */
+    int j;
+    for (j = at + 1; j <= E.numrows; ++j) E.row[j].idx++;
+
+    E.row[at].idx = at;
+
+    /* Allocate new line */
+    E.row[at].size = len;
+    E.row[at].chars = malloc(len + 1);
+    if (!E.row[at].chars) die("malloc");
+    memcpy(E.row[at].chars, s, len);
+    E.row[at].chars[len] = '\0';
+
+    /* Initialize render row. It starts with the state the next row was
+     * lexed with, so the syntax pass goes on to it only if that changes */
+    E.row[at].rsize = 0;
+    E.row[at].rwidth = 0;
+    E.row[at].render = NULL;
+    E.row[at].cols = NULL;
+    E.row[at].hl = NULL;
+    E.row[at].brblock = NULL;
+    E.row[at].hl_open_comment = (at > 0) ? E.row[at - 1].hl_open_comment : 0;
+
+    /* Increase count. The row gets its node before it is rendered, so that
+     * the rows the syntax pass goes on to are found at their place */
+    E.numrows++;
+    editorIndexSplice(at, 0, 1);
+    editorUpdateRow(&E.row[at]);
+
+    /* The file has changed */
+    E.dirty++;
+}
+
+/* Inserts the 'n' rows of 's', separated by '\n', with a single move of the
+ * rows below and a single pass of the syntax propagation */
+void editorInsertRows(int at, const char *s, size_t len, int n)
+{
+    if (at < 0 || at > E.numrows || n <= 0) return;
+    editorUndoRecord(UNDO_INSERT_ROWS, at, 0, n, s, len);
+
+    editorReserveRows(n);
+    memmove(&E.row[at + n], &E.row[at], sizeof(erow) * (E.numrows - at));
+    int j;
+    for (j = at + n; j < E.numrows + n; ++j) E.row[j].idx += n;
+
+    const char *p = s, *end = s + len;
+    for (j = 0; j < n; ++j) {
+        const char *nl = memchr(p, '\n', end - p);
+        size_t l = nl ? (size_t)(nl - p) : (size_t)(end - p);
+        erow *row = &E.row[at + j];
+        row->idx = at + j;
+        row->size = l;
+        row->chars = malloc(l + 1);
+        if (!row->chars) die("malloc");
+        memcpy(row->chars, p, l);
+        row->chars[l] = '\0';
+        row->rsize = 0;
+        row->render = NULL;
+        row->cols = NULL;
+        row->hl = NULL;
+        row->brblock = NULL;
+        row->hl_open_comment = 0;
+        editorUpdateRender(row);
+        p += l + 1;
+    }
+    E.numrows += n;
+    editorIndexSplice(at, 0, n);
+    /* As the last one takes over from the row before, the syntax pass only
+     * goes on to the next row if the state it was lexed with changes */
+    E.row[at + n - 1].hl_open_comment = (at > 0) ? E.row[at - 1].hl_open_comment : 0;
+
+    for (j = 0; j < n - 1; ++j) editorHighlightRow(&E.row[at + j]);
+    editorUpdateSyntax(&E.row[at + n - 1]);
+    E.dirty++;
+}
+
+void editorFreeRow(erow *row)
+{
+    free(row->render);
+    free(row->cols);
+    free(row->chars);
+    free(row->hl);
+    free(row->brblock);
+}
+
+void editorDelRow(int at)
+{
+    if (at < 0 || at >= E.numrows) return;
+    editorUndoRecord(UNDO_DELETE_ROWS, at, 0, 1, E.row[at].chars, E.row[at].size);
+
+    /* Free memory of the current row */
+    editorFreeRow(&E.row[at]);
     /* Move all rows, only pointers need to be moved */
     memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
     /* Update idx of subsequent rows */
     int j;
-    for (j = at + 1; j <= E.numrows; ++j) E.row[j].idx--;
+    for (j = at; j < E.numrows - 1; ++j) E.row[j].idx--;
 
     E.numrows--;
+    editorIndexSplice(at, 1, 0);
     E.dirty++;
 }
 
-void editorRowInsertChar(erow *row, int at, char c)
+/* Deletes 'n' rows with a single move of the rows below */
+void editorDelRows(int at, int n)
+{
+    if (at < 0 || n <= 0 || at + n > E.numrows) return;
+    if (E.undo.recording || (E.journal.enabled && !E.journal.paused)) {
+        /* The record holds the rows joined by '\n' */
+        size_t len = 0;
+        int j;
+        for (j = at; j < at + n; ++j) len += E.row[j].size + 1;
+        char *buf = malloc(len);
+        if (!buf) die("malloc");
+        char *p = buf;
+        for (j = at; j < at + n; ++j) {
+            memcpy(p, E.row[j].chars, E.row[j].size);
+            p += E.row[j].size;
+            *p++ = '\n';
+        }
+        editorUndoRecord(UNDO_DELETE_ROWS, at, 0, n, buf, len - 1);
+        free(buf);
+    }
+
+    int j;
+    for (j = at; j < at + n; ++j) editorFreeRow(&E.row[j]);
+    memmove(&E.row[at], &E.row[at + n], sizeof(erow) * (E.numrows - at - n));
+    E.numrows -= n;
+    for (j = at; j < E.numrows; ++j) E.row[j].idx -= n;
+    editorIndexSplice(at, n, 0);
+
+    /* The row now at 'at' follows a different one */
+    if (at < E.numrows) editorUpdateSyntax(&E.row[at]);
+    E.dirty++;
+}
+
+void editorRowInsertString(erow *row, int at, const char *s, size_t len)
 {
     /* Handle out of bounds */
     if (at < 0 || at > row->size) at = row->size;
+    if (len == 0) return;
+    editorUndoRecord(UNDO_INSERT_TEXT, row->idx, at, 1, s, len);
 
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[at+1], &row->chars[at], row->size - at + 1); /* TODO while loop */
-    row->size++;
-    row->chars[at] = c;
+    row->chars = realloc(row->chars, row->size + len + 1);
+    if (!row->chars) die("realloc");
+    memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+    memcpy(&row->chars[at], s, len);
+    row->size += len;
     editorUpdateRow(row);
 
     /* The file has changed */
     E.dirty++;
 }
 
+void editorRowInsertChar(erow *row, int at, char c)
+{
+    editorRowInsertString(row, at, &c, 1);
+}
+
 void editorRowAppendString(erow *row, char *s, size_t len)
 {
-    /* Reserve memory and append */
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
+    editorRowInsertString(row, row->size, s, len);
+}
 
-    editorUpdateRow(row);
+/* Deletes 'len' chars of the row starting at 'at' */
+void editorRowDelete(erow *row, int at, size_t len)
+{
+    if (at < 0 || at >= row->size) return;
+    if (len > (size_t)(row->size - at)) len = row->size - at;
+    if (len == 0) return;
+    editorUndoRecord(UNDO_DELETE_TEXT, row->idx, at, 1, &row->chars[at], len);
 
+    memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+    row->size -= len;
+    editorUpdateRow(row);
     E.dirty++;
 }
 
-void editorRowDelChar(erow *row, int at) 
+/* Moves the 'n' rows at 'from' so they start at 'to', as one rotation of
+ * the row structs: the text isn't copied and the idx of the rotated range is
+ * fixed once. The highlighting of a row only depends on the state left by
+ * the previous one, so only the rows after the seams are relexed */
+void editorMoveRows(int from, int n, int to)
 {
-    if (at < 0 || at >= row->size) return;
+    if (n <= 0 || from < 0 || to < 0 || from == to ||
+            from + n > E.numrows || to + n > E.numrows) return;
+    editorUndoRecord(UNDO_MOVE_ROWS, from, to, n, NULL, 0);
+
+    /* Rotate [lo, hi) left by 'k' through a buffer of the smaller side */
+    int lo = from < to ? from : to;
+    int hi = (from < to ? to : from) + n;
+    int k = from < to ? n : from - to;
+    int len = hi - lo;
+    int small = k < len - k ? k : len - k;
+    erow *tmp = malloc(sizeof(erow) * small);
+    if (!tmp) die("malloc");
+    if (k <= len - k) {
+        memcpy(tmp, &E.row[lo], sizeof(erow) * k);
+        memmove(&E.row[lo], &E.row[lo + k], sizeof(erow) * (len - k));
+        memcpy(&E.row[hi - k], tmp, sizeof(erow) * k);
+    } else {
+        memcpy(tmp, &E.row[lo + k], sizeof(erow) * (len - k));
+        memmove(&E.row[hi - k], &E.row[lo], sizeof(erow) * k);
+        memcpy(&E.row[lo], tmp, sizeof(erow) * (len - k));
+    }
+    free(tmp);
 
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
-    editorUpdateRow(row);
+    int j;
+    for (j = lo; j < hi; ++j) E.row[j].idx = j;
+    editorIndexRotate(lo, hi, k);
+    editorUpdateSyntax(&E.row[lo]);
+    editorUpdateSyntax(&E.row[hi - k]);
+    if (hi < E.numrows) editorUpdateSyntax(&E.row[hi]);
     E.dirty++;
 }
 
@@ -619,10 +2127,7 @@ void editorInsertNewline(void)
     } else {
         erow *row = &E.row[E.cy];
         editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-        row = &E.row[E.cy];
-        row->size = E.cx;
-        row->chars[E.cx] = '\0';
-        editorUpdateRow(row);
+        editorRowDelete(&E.row[E.cy], E.cx, E.row[E.cy].size - E.cx);
     }
 
     E.cy++;
@@ -637,8 +2142,9 @@ void editorDelChar(void)
 
     erow *row = &E.row[E.cy];
     if (E.cx > 0) {
-        editorRowDelChar(row, E.cx - 1);
-        E.cx--;
+        int at = row->cols ? editorRowPrevChar(row, E.cx) : E.cx - 1;
+        editorRowDelete(row, at, E.cx - at);
+        E.cx = at;
     } else {
         E.cx = E.row[E.cy - 1].size;
         editorRowAppendString(&E.row[E.cy-1], row->chars, row->size);
@@ -656,190 +2162,4615 @@ void editorSetStatusMessage(const char *fmt, ...)
     E.statusmsg_time = time(NULL);
 }
 
-/**************
-*  file i/o  *
-**************/
-
-/* The caller is expected to free the memory */
-char *editorRowsToString(int *buflen)
+/* The lines from the mark to the cursor, or the cursor line alone. Returns
+ * how many, 0 if there are none */
+int editorSelection(int *first)
 {
-    int totlen = 0, j;
+    int a = E.cy, b = (E.mark >= 0) ? E.mark : E.cy;
+    if (a > b) {
+        int t = a;
+        a = b;
+        b = t;
+    }
+    if (b >= E.numrows) b = E.numrows - 1;
+    if (a > b) return 0;
+    *first = a;
+    return b - a + 1;
+}
 
-    /* Count total size */
-    for (j = 0; j < E.numrows; ++j) {
-        totlen += E.row[j].size + 1;
+void editorToggleMark(void)
+{
+    if (E.mark >= 0) {
+        E.mark = -1;
+        editorSetStatusMessage("Mark cleared");
+    } else {
+        E.mark = E.cy;
+        editorSetStatusMessage("Mark set: Ctrl-X cut, Ctrl-C copy, Ctrl-U/Ctrl-D move lines");
     }
-    *buflen = totlen;
+}
 
-    /* Create string */
-    char *buf = malloc(totlen);
-    char *p = buf;
-    for (j = 0; j < E.numrows; ++j) {
-        /* Copy line */
-        memcpy(p, E.row[j].chars, E.row[j].size);
+/* Copies the selected lines to the clipboard */
+int editorCopyLines(void)
+{
+    int first, n = editorSelection(&first);
+    if (n == 0) return 0;
+
+    size_t len = 0;
+    int j;
+    for (j = first; j < first + n; ++j) len += E.row[j].size + 1;
+    if (len > E.clip.cap) {
+        free(E.clip.b);
+        E.clip.b = malloc(len);
+        if (!E.clip.b) die("malloc");
+        E.clip.cap = len;
+    }
+    char *p = E.clip.b;
+    for (j = first; j < first + n; ++j) {
+        memcpy(p, E.row[j].chars, E.row[j].size);
+        p += E.row[j].size;
+        *p++ = '\n';
+    }
+    E.clip.len = len - 1;
+    E.cliprows = n;
+    E.mark = -1;
+    return n;
+}
+
+void editorCutLines(void)
+{
+    int first = 0, n = editorSelection(&first);
+    if (editorCopyLines() == 0) return;
+    editorDelRows(first, n);
+    E.cy = first;
+    E.cx = 0;
+    editorSetStatusMessage("%d lines cut", n);
+}
+
+/* Inserts the clipboard above the cursor line */
+void editorPasteLines(void)
+{
+    if (E.cliprows == 0) {
+        editorSetStatusMessage("Nothing to paste");
+        return;
+    }
+    int at = (E.cy < E.numrows) ? E.cy : E.numrows;
+    editorInsertRows(at, E.clip.b, E.clip.len, E.cliprows);
+    E.cy = at + E.cliprows;
+    E.cx = 0;
+    editorSetStatusMessage("%d lines pasted", E.cliprows);
+}
+
+/* Moves the selected lines one line up (-1) or down (1) */
+void editorMoveLines(int dir)
+{
+    int first, n = editorSelection(&first);
+    if (n == 0 || first + dir < 0 || first + dir + n > E.numrows) return;
+    editorMoveRows(first, n, first + dir);
+    E.cy += dir;
+    if (E.mark >= 0) E.mark += dir;
+    if (E.cx > E.row[E.cy].size) E.cx = E.row[E.cy].size;
+}
+
+/**********************
+*  bracket matching  *
+**********************/
+
+/* +1 for an opening bracket, -1 for a closing one */
+int bracketKind(char c)
+{
+    switch (c) {
+        case '(': case '[': case '{': return 1;
+        case ')': case ']': case '}': return -1;
+        default: return 0;
+    }
+}
+
+/* Brackets in strings and comments don't count */
+int bracketCounts(erow *row, int off)
+{
+    unsigned char hl = row->hl[off];
+    return bracketKind(row->render[off]) &&
+        hl != HL_STRING && hl != HL_COMMENT && hl != HL_MLCOMMENT;
+}
+
+struct bracketSum bracketJoin(struct bracketSum a, struct bracketSum b)
+{
+    struct bracketSum s;
+    s.net = a.net + b.net;
+    s.lo = (a.net + b.lo < a.lo) ? a.net + b.lo : a.lo;
+    s.hi = (b.net + a.hi > b.hi) ? b.net + a.hi : b.hi;
+    return s;
+}
+
+/* Sums the brackets of a row once it is highlighted, as that tells which
+ * are in strings or comments. Long rows keep the sum of every block too */
+void editorBracketScan(erow *row)
+{
+    int nblocks = (row->rsize + KILO_BRACKET_BLOCK - 1) / KILO_BRACKET_BLOCK;
+    if (nblocks > 1) {
+        row->brblock = realloc(row->brblock, sizeof(struct bracketSum) * nblocks);
+        if (!row->brblock) die("realloc");
+    } else {
+        free(row->brblock);
+        row->brblock = NULL;
+    }
+
+    struct bracketSum s = {0, 0, 0};
+    int j = 0, k;
+    for (k = 0; k < nblocks; ++k) {
+        struct bracketSum b = {0, 0, 0};
+        int end = (k + 1 < nblocks) ? j + KILO_BRACKET_BLOCK : row->rsize;
+        for (; j < end; ++j) {
+            if (!bracketCounts(row, j)) continue;
+            b.net += bracketKind(row->render[j]);
+            if (b.net < b.lo) b.lo = b.net;
+        }
+        /* The highest suffix is the total minus the lowest prefix */
+        b.hi = b.net - b.lo;
+        if (row->brblock) row->brblock[k] = b;
+        s = bracketJoin(s, b);
+    }
+    row->br = s;
+    editorIndexUpdateRow(row);
+}
+
+/* Sets the bracket sums of the nodes from those kept in the rows */
+void bracketFill(int t, int first)
+{
+    if (!t) return;
+    struct rowNode *n = &E.ri.node[t];
+    int lc = indexCount(n->l);
+    bracketFill(n->l, first);
+    bracketFill(n->r, first + lc + 1);
+    n->br = E.row[first + lc].br;
+    indexPull(t);
+}
+
+/* Fills in the bracket sums of the index the first time they are needed.
+ * Only rows never lexed (loaded and not drawn yet) are highlighted, rows of
+ * an evicted buffer kept their sums. From then on every edit updates the
+ * rows it changes */
+void editorBracketEnsure(void)
+{
+    editorIndexEnsure();
+    if (E.ri.brackets) return;
+    int j;
+    for (j = 0; j < E.numrows; ++j)
+        if (E.row[j].br.lo > 0) editorHighlightRow(&E.row[j]);
+    bracketFill(E.ri.root, 0);
+    E.ri.brackets = 1;
+}
+
+/* First row from 'from' on where the 'depth' brackets left open get closed.
+ * 'first' is the first row of subtree 't'. Subtrees that can't close them
+ * are skipped, adding their sum to 'depth' */
+int bracketForward(int t, int first, int from, int *depth)
+{
+    struct rowNode *n = &E.ri.node[t];
+    if (!t || first + n->count <= from) return -1;
+    if (first >= from && *depth + n->bsum.lo > 0) {
+        *depth += n->bsum.net;
+        return -1;
+    }
+    int self = first + indexCount(n->l);
+    int r = bracketForward(n->l, first, from, depth);
+    if (r != -1) return r;
+    if (self >= from) {
+        if (*depth + n->br.lo <= 0) return self;
+        *depth += n->br.net;
+    }
+    return bracketForward(n->r, self + 1, from, depth);
+}
+
+/* Last row up to 'to' where the 'depth' closing brackets get opened */
+int bracketBackward(int t, int first, int to, int *depth)
+{
+    struct rowNode *n = &E.ri.node[t];
+    if (!t || first > to) return -1;
+    if (first + n->count - 1 <= to && n->bsum.hi < *depth) {
+        *depth -= n->bsum.net;
+        return -1;
+    }
+    int self = first + indexCount(n->l);
+    int r = bracketBackward(n->r, self + 1, to, depth);
+    if (r != -1) return r;
+    if (self <= to) {
+        if (n->br.hi >= *depth) return self;
+        *depth -= n->br.net;
+    }
+    return bracketBackward(n->l, first, to, depth);
+}
+
+/* Walks a row from render offset 'j' in direction 'dir' and returns where
+ * the 'depth' brackets get matched, or -1 with 'depth' updated if the row
+ * ends first. The blocks of a long row that can't match them are skipped */
+int bracketScanRow(erow *row, int j, int dir, int *depth)
+{
+    while (j >= 0 && j < row->rsize) {
+        int k = j / KILO_BRACKET_BLOCK;
+        if (row->brblock) {
+            struct bracketSum *b = &row->brblock[k];
+            int last = (k + 1) * KILO_BRACKET_BLOCK - 1;
+            if (dir > 0 && j == k * KILO_BRACKET_BLOCK && *depth + b->lo > 0) {
+                *depth += b->net;
+                j += KILO_BRACKET_BLOCK;
+                continue;
+            }
+            if (dir < 0 && (j == last || j == row->rsize - 1) && b->hi < *depth) {
+                *depth -= b->net;
+                j = k * KILO_BRACKET_BLOCK - 1;
+                continue;
+            }
+        }
+        if (bracketCounts(row, j)) {
+            *depth += bracketKind(row->render[j]) * dir;
+            if (*depth == 0) return j;
+        }
+        j += dir;
+    }
+    return -1;
+}
+
+/* Finds the bracket matching the one at render offset 'off' of row 'at'.
+ * Returns 0 if there is none, or it is of another kind */
+int editorBracketMatch(int at, int off, int *mrow, int *moff)
+{
+    erow *row = &E.row[at];
+    editorEnsureHighlight(row);
+    if (off >= row->rsize || !bracketCounts(row, off)) return 0;
+    int dir = bracketKind(row->render[off]);
+    int depth = 1;
+
+    /* Rest of the row, then whole rows through the index, then into the row
+     * where the depth gets back to zero */
+    int j = bracketScanRow(row, off + dir, dir, &depth);
+    if (j == -1) {
+        editorBracketEnsure();
+        int r = (dir > 0) ? bracketForward(E.ri.root, 0, at + 1, &depth) :
+            bracketBackward(E.ri.root, 0, at - 1, &depth);
+        if (r < 0 || r >= E.numrows) return 0;
+        row = &E.row[r];
+        editorEnsureHighlight(row);
+        j = bracketScanRow(row, (dir > 0) ? 0 : row->rsize - 1, dir, &depth);
+        if (j == -1) return 0;
+    }
+
+    char open = E.row[at].render[off], close = row->render[j];
+    if (dir < 0) {
+        open = row->render[j];
+        close = E.row[at].render[off];
+    }
+    if (!((open == '(' && close == ')') || (open == '[' && close == ']') ||
+                (open == '{' && close == '}'))) return 0;
+    *mrow = row->idx;
+    *moff = j;
+    return 1;
+}
+
+/* The bracket under the cursor and the one matching it, as rows and render
+ * offsets. Returns 0 if the cursor isn't on a bracket with a match */
+int editorBracketCursor(int *rows, int *offs)
+{
+    if (E.cy >= E.numrows || E.cx >= E.row[E.cy].size) return 0;
+    erow *row = &E.row[E.cy];
+    if (!bracketKind(row->chars[E.cx])) return 0;
+    rows[0] = E.cy;
+    offs[0] = editorRowCxToOffset(row, E.cx);
+    return editorBracketMatch(rows[0], offs[0], &rows[1], &offs[1]);
+}
+
+void editorJumpBracket(void)
+{
+    int rows[2], offs[2];
+    if (!editorBracketCursor(rows, offs)) {
+        editorSetStatusMessage("No matching bracket");
+        return;
+    }
+    erow *row = &E.row[rows[1]];
+    E.cy = rows[1];
+    E.cx = editorRowRxToCx(row, editorRenderColumn(row, offs[1]));
+}
+
+/**********
+*  undo  *
+**********/
+
+#define UNDO_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+struct undoRecord *editorUndoAt(size_t off)
+{
+    return (struct undoRecord *)(E.undo.log + off);
+}
+
+size_t editorUndoSize(struct undoRecord *r)
+{
+    return UNDO_ALIGN(sizeof(*r) + r->len);
+}
+
+char *editorUndoBytes(struct undoRecord *r)
+{
+    return (char *)(r + 1);
+}
+
+void editorUndoReserve(size_t n)
+{
+    struct editorUndo *u = &E.undo;
+    if (u->len + n <= u->cap) return;
+    size_t cap = u->cap ? u->cap : 4096;
+    while (cap < u->len + n) cap *= 2;
+    u->log = realloc(u->log, cap);
+    if (!u->log) die("realloc");
+    u->cap = cap;
+}
+
+/* Called before every keypress. Unless 'merge' is set the next change starts
+ * a new group */
+void editorUndoBoundary(int merge)
+{
+    if (!merge) {
+        E.undo.group = UNDO_NONE;
+        E.undo.overflow = 0;
+        E.undo.cx = E.cx;
+        E.undo.cy = E.cy;
+    }
+}
+
+/* Called after every keypress: redo puts the cursor back where it is now */
+void editorUndoCursor(void)
+{
+    if (E.undo.group == UNDO_NONE) return;
+    struct undoRecord *r = editorUndoAt(E.undo.group);
+    r->ax = E.cx;
+    r->ay = E.cy;
+}
+
+/* Drops the oldest groups until the log is back under 3/4 of its limit. If
+ * the open group alone doesn't fit, the whole log is dropped and the rest of
+ * that group isn't recorded */
+void editorUndoTrim(void)
+{
+    struct editorUndo *u = &E.undo;
+    if (u->len <= u->limit) return;
+
+    if (u->len - u->group > u->limit) {
+        u->len = u->pos = 0;
+        u->top = u->group = UNDO_NONE;
+        u->overflow = 1;
+        editorSetStatusMessage("Change too large to undo");
+        return;
+    }
+
+    size_t off = 0;
+    while (off < u->group) {
+        off += editorUndoSize(editorUndoAt(off));
+        if (editorUndoAt(off)->start && u->len - off <= u->limit / 4 * 3) break;
+    }
+    memmove(u->log, u->log + off, u->len - off);
+    u->len -= off;
+    u->pos -= off;
+    if (u->top != UNDO_NONE) u->top -= off;
+    if (u->group != UNDO_NONE) u->group -= off;
+    editorUndoAt(0)->prevsize = 0;
+}
+
+/* Appends 's' to the last record */
+void editorUndoExtend(struct undoRecord *r, const char *s, size_t len, int newline)
+{
+    struct editorUndo *u = &E.undo;
+    size_t off = (char *)r - u->log;
+    size_t n = len + (newline ? 1 : 0);
+    editorUndoReserve(UNDO_ALIGN(sizeof(*r) + r->len + n) - editorUndoSize(r));
+    r = editorUndoAt(off);
+    char *p = editorUndoBytes(r) + r->len;
+    if (newline) *p++ = '\n';
+    memcpy(p, s, len);
+    r->len += n;
+    u->len = off + editorUndoSize(r);
+    u->pos = u->len;
+}
+
+/* Tries to fold a change into the last record of the open group: typing
+ * extends the inserted text, backspace and delete extend the deleted text,
+ * and rows inserted or deleted one after another become a single record */
+int editorUndoCoalesce(int kind, int row, int col, const char *s, size_t len)
+{
+    struct editorUndo *u = &E.undo;
+    if (u->group == UNDO_NONE || u->top == UNDO_NONE || u->top < u->group) return 0;
+    struct undoRecord *r = editorUndoAt(u->top);
+
+    switch (kind) {
+        case UNDO_INSERT_TEXT:
+            if ((r->kind == UNDO_INSERT_TEXT && r->row == row && r->col + (long)r->len == col) ||
+                    (r->kind == UNDO_INSERT_ROWS && row == r->row + r->nrows - 1 &&
+                     col == E.row[row].size)) {
+                editorUndoExtend(r, s, len, 0);
+                return 1;
+            }
+            break;
+        case UNDO_DELETE_TEXT:
+            if (r->kind != UNDO_DELETE_TEXT || r->row != row || len != 1) break;
+            if (!r->reversed && col == r->col) {
+                editorUndoExtend(r, s, len, 0);
+                return 1;
+            }
+            if ((r->reversed || r->len == 1) && col + 1 == r->col) {
+                r->reversed = 1;
+                r->col = col;
+                editorUndoExtend(r, s, len, 0);
+                return 1;
+            }
+            break;
+        case UNDO_INSERT_ROWS:
+            if (r->kind == UNDO_INSERT_ROWS && row == r->row + r->nrows) {
+                editorUndoExtend(r, s, len, 1);
+                editorUndoAt(u->top)->nrows++;
+                return 1;
+            }
+            break;
+        case UNDO_DELETE_ROWS:
+            if (r->kind == UNDO_DELETE_ROWS && row == r->row) {
+                editorUndoExtend(r, s, len, 1);
+                editorUndoAt(u->top)->nrows++;
+                return 1;
+            }
+            break;
+    }
+    return 0;
+}
+
+/* Records a primitive edit, before it is applied to the rows */
+void editorUndoRecord(int kind, int row, int col, int nrows, const char *s, size_t len)
+{
+    struct editorUndo *u = &E.undo;
+    editorJournalRecord(kind, row, col, nrows, s, len);
+    if (!u->recording || u->overflow) return;
+
+    /* A new change drops what could be redone */
+    u->len = u->pos;
+
+    if (nrows != 1 || !editorUndoCoalesce(kind, row, col, s, len)) {
+        struct undoRecord rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.kind = kind;
+        rec.row = row;
+        rec.col = col;
+        rec.nrows = nrows;
+        rec.len = len;
+        rec.prevsize = (u->top == UNDO_NONE) ? 0 : u->len - u->top;
+        if (u->group == UNDO_NONE) {
+            rec.start = 1;
+            rec.cx = rec.ax = u->cx;
+            rec.cy = rec.ay = u->cy;
+        }
+
+        size_t off = u->len;
+        editorUndoReserve(editorUndoSize(&rec));
+        memcpy(u->log + off, &rec, sizeof(rec));
+        memcpy(editorUndoBytes(editorUndoAt(off)), s, len);
+        u->len = u->pos = off + editorUndoSize(&rec);
+        u->top = off;
+        if (rec.start) u->group = off;
+    }
+    editorUndoTrim();
+}
+
+/* Applies an edit through the row primitives */
+void editorApplyEdit(int kind, int row, int col, int nrows, const char *s, size_t len)
+{
+    switch (kind) {
+        case UNDO_INSERT_TEXT:
+            editorRowInsertString(&E.row[row], col, s, len);
+            break;
+        case UNDO_DELETE_TEXT:
+            editorRowDelete(&E.row[row], col, len);
+            break;
+        case UNDO_INSERT_ROWS:
+            editorInsertRows(row, s, len, nrows);
+            break;
+        case UNDO_DELETE_ROWS:
+            editorDelRows(row, nrows);
+            break;
+        case UNDO_MOVE_ROWS:
+            editorMoveRows(row, nrows, col);
+            break;
+        case UNDO_MOVE_ROWS_BACK:
+            editorMoveRows(col, nrows, row);
+            break;
+        case UNDO_REPLACE:
+        case UNDO_REPLACE_BACK:
+            editorReplaceRows(kind, row, nrows, s, len);
+            break;
+        case UNDO_PERMUTE_ROWS:
+        case UNDO_PERMUTE_ROWS_BACK:
+            editorPermuteRows(kind, row, nrows, s, len);
+            break;
+        case UNDO_INSERT_SPARSE:
+        case UNDO_DELETE_SPARSE:
+            editorSparseRows(kind, row, nrows, s, len);
+            break;
+    }
+}
+
+/* Applies a record, or its inverse */
+void editorUndoApply(struct undoRecord *r, int kind)
+{
+    char *s = editorUndoBytes(r);
+    if (r->reversed) {
+        /* Deleted by backspace, stored last to first */
+        size_t i;
+        for (i = 0; i < r->len / 2; ++i) {
+            char t = s[i];
+            s[i] = s[r->len - 1 - i];
+            s[r->len - 1 - i] = t;
+        }
+        r->reversed = 0;
+    }
+
+    editorApplyEdit(kind, r->row, r->col, r->nrows, s, r->len);
+}
+
+void editorUndo(void)
+{
+    struct editorUndo *u = &E.undo;
+    if (u->top == UNDO_NONE) {
+        editorSetStatusMessage("Nothing to undo");
+        return;
+    }
+
+    u->recording = 0;
+    struct undoRecord *r;
+    do {
+        r = editorUndoAt(u->top);
+        editorUndoApply(r, r->kind ^ 1);
+        u->pos = u->top;
+        u->top = r->prevsize ? u->top - r->prevsize : UNDO_NONE;
+    } while (!r->start);
+    u->recording = 1;
+
+    E.cx = r->cx;
+    E.cy = r->cy;
+}
+
+void editorRedo(void)
+{
+    struct editorUndo *u = &E.undo;
+    if (u->pos == u->len) {
+        editorSetStatusMessage("Nothing to redo");
+        return;
+    }
+
+    u->recording = 0;
+    struct undoRecord *first = editorUndoAt(u->pos);
+    int cx = first->ax, cy = first->ay;
+    do {
+        struct undoRecord *r = editorUndoAt(u->pos);
+        editorUndoApply(r, r->kind);
+        u->top = u->pos;
+        u->pos += editorUndoSize(r);
+    } while (u->pos < u->len && !editorUndoAt(u->pos)->start);
+    u->recording = 1;
+
+    E.cx = cx;
+    E.cy = cy;
+}
+
+/*************
+*  journal  *
+*************/
+
+/* Whether 'path' is the file 'st' was taken of, whatever name reached it:
+ * './a.c', 'a.c' and a symlink to it are the same file */
+int editorSameFile(const char *path, const struct stat *st)
+{
+    struct stat other;
+    return stat(path, &other) == 0 && other.st_dev == st->st_dev && other.st_ino == st->st_ino;
+}
+
+/* The journal of 'dir/name' is 'dir/.name.kilo-journal' */
+char *editorJournalPath(const char *filename)
+{
+    const char *base = strrchr(filename, '/');
+    base = base ? base + 1 : filename;
+    int dirlen = base - filename;
+    char *path = malloc(strlen(filename) + 16);
+    if (!path) die("malloc");
+    sprintf(path, "%.*s.%s.kilo-journal", dirlen, filename, base);
+    return path;
+}
+
+void editorJournalHeader(struct journalHeader *h, struct stat *st)
+{
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, "KILOJNL1", 8);
+    h->size = st->st_size;
+    h->mtime_sec = st->st_mtim.tv_sec;
+    h->mtime_nsec = st->st_mtim.tv_nsec;
+    h->ino = st->st_ino;
+}
+
+uint32_t editorJournalSum(struct journalRecord *rec, const char *s)
+{
+    uint32_t sum = rec->sum, h = 2166136261U;
+    size_t i;
+    rec->sum = 0;
+    for (i = 0; i < sizeof(*rec); ++i) h = (h ^ ((unsigned char *)rec)[i]) * 16777619U;
+    for (i = 0; i < rec->len; ++i) h = (h ^ (unsigned char)s[i]) * 16777619U;
+    rec->sum = sum;
+    return h;
+}
+
+int editorWriteAll(int fd, const char *s, size_t len)
+{
+    while (len) {
+        ssize_t n = write(fd, s, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        s += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Thread body: writes the records as they come, whatever accumulated while
+ * the previous batch was written goes in one write, and fsyncs at most once
+ * every KILO_JOURNAL_SYNC_US */
+void *editorJournalThread(void *arg)
+{
+    (void)arg;
+    struct editorJournal *j = &E.journal;
+    char *out = NULL;
+    size_t outcap = 0;
+
+    pthread_mutex_lock(&j->lock);
+    while (1) {
+        if (j->len) {
+            /* Swap the buffers, the editor keeps appending meanwhile */
+            char *batch = j->buf;
+            size_t len = j->len, cap = j->cap;
+            unsigned long gen = j->gen;
+            j->buf = out;
+            j->cap = outcap;
+            j->len = 0;
+            out = batch;
+            outcap = cap;
+            /* The file is taken with the batch, a buffer switch can't
+             * give it to another buffer in between */
+            pthread_mutex_lock(&j->io);
+            pthread_mutex_unlock(&j->lock);
+
+            TRACE_BEGIN("editorJournalWrite");
+            int err = 0;
+            if (j->fd != -1 && gen == j->gen && editorWriteAll(j->fd, out, len) == -1) err = errno;
+            pthread_mutex_unlock(&j->io);
+            TRACE_END("editorJournalWrite");
+
+            pthread_mutex_lock(&j->lock);
+            if (err) j->error = err;
+            j->unsynced = 1;
+            continue;
+        }
+
+        if (j->unsynced) {
+            double now = editorNow();
+            if (j->stop || now >= j->synced + KILO_JOURNAL_SYNC_US) {
+                j->unsynced = 0;
+                pthread_mutex_unlock(&j->lock);
+                pthread_mutex_lock(&j->io);
+                if (j->fd != -1) fdatasync(j->fd);
+                pthread_mutex_unlock(&j->io);
+                pthread_mutex_lock(&j->lock);
+                j->synced = now;
+            } else {
+                /* The condition waits on the monotonic clock, like editorNow */
+                double due = j->synced + KILO_JOURNAL_SYNC_US;
+                struct timespec ts;
+                ts.tv_sec = due / 1e6;
+                ts.tv_nsec = (due - ts.tv_sec * 1e6) * 1e3;
+                pthread_cond_timedwait(&j->cond, &j->lock, &ts);
+            }
+            continue;
+        }
+
+        if (j->stop) break;
+        pthread_cond_wait(&j->cond, &j->lock);
+    }
+    pthread_mutex_unlock(&j->lock);
+    free(out);
+    return NULL;
+}
+
+/* Starts a journal for the file as it is on disk now */
+int editorJournalCreate(void)
+{
+    struct editorJournal *j = &E.journal;
+    struct stat st;
+    if (stat(E.filename, &st) == -1) return -1;
+    struct journalHeader h;
+    editorJournalHeader(&h, &st);
+
+    pthread_mutex_lock(&j->io);
+    j->fd = open(j->path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+    if (j->fd != -1 && editorWriteAll(j->fd, (char *)&h, sizeof(h)) == -1) {
+        close(j->fd);
+        unlink(j->path);
+        j->fd = -1;
+    }
+    pthread_mutex_unlock(&j->io);
+    if (j->fd == -1) {
+        editorSetStatusMessage("Can't create journal %s: %s", j->path, strerror(errno));
+        j->enabled = 0;
+        return -1;
+    }
+
+    if (!j->started) {
+        if (pthread_create(&j->thread, NULL, editorJournalThread, NULL) != 0) die("pthread_create");
+        j->started = 1;
+    }
+    return 0;
+}
+
+/* Queues an edit for the journal, called with every change to the rows */
+void editorJournalRecord(int kind, int row, int col, int nrows, const char *s, size_t len)
+{
+    struct editorJournal *j = &E.journal;
+    if (!j->enabled || j->paused) return;
+    if (j->fd == -1 && editorJournalCreate() == -1) return;
+
+    struct journalRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.kind = kind;
+    rec.row = row;
+    rec.col = col;
+    rec.nrows = nrows;
+    rec.len = len;
+    rec.sum = editorJournalSum(&rec, s);
+
+    pthread_mutex_lock(&j->lock);
+    if (j->len + sizeof(rec) + len > j->cap) {
+        j->cap = (j->len + sizeof(rec) + len) * 2;
+        j->buf = realloc(j->buf, j->cap);
+        if (!j->buf) die("realloc");
+    }
+    memcpy(j->buf + j->len, &rec, sizeof(rec));
+    memcpy(j->buf + j->len + sizeof(rec), s, len);
+    j->len += sizeof(rec) + len;
+    int err = j->error;
+    j->error = 0;
+    pthread_cond_signal(&j->cond);
+    pthread_mutex_unlock(&j->lock);
+
+    if (err) editorSetStatusMessage("Journal write failed: %s", strerror(err));
+}
+
+/* The file on disk has every edit now, the journal isn't needed anymore */
+void editorJournalDiscard(void)
+{
+    struct editorJournal *j = &E.journal;
+    if (j->fd == -1) return;
+
+    pthread_mutex_lock(&j->lock);
+    j->len = 0;
+    j->gen++;
+    pthread_mutex_unlock(&j->lock);
+
+    pthread_mutex_lock(&j->io);
+    close(j->fd);
+    unlink(j->path);
+    j->fd = -1;
+    pthread_mutex_unlock(&j->io);
+}
+
+/* At exit, crash or not, whatever is queued reaches the disk. Only a
+ * deliberate quit removes the journal */
+void editorJournalAtExit(void)
+{
+    struct editorJournal *j = &E.journal;
+    if (j->started) {
+        pthread_mutex_lock(&j->lock);
+        j->stop = 1;
+        pthread_cond_signal(&j->cond);
+        pthread_mutex_unlock(&j->lock);
+        pthread_join(j->thread, NULL);
+    }
+    if (j->fd != -1) {
+        close(j->fd);
+        if (j->clean) unlink(j->path);
+    }
+}
+
+/* Stops journaling the file, before another one is opened */
+void editorJournalClose(void)
+{
+    struct editorJournal *j = &E.journal;
+    editorJournalDiscard();
+    j->enabled = 0;
+    free(j->path);
+    j->path = NULL;
+}
+
+/* Parks the journal of the buffer being left in 'park' and takes the one
+ * of the buffer switched to. What is still queued goes to its own file
+ * first, and the thread never holds a batch without the file */
+void editorJournalSwitch(struct journalFile *park, const struct journalFile *next)
+{
+    struct editorJournal *j = &E.journal;
+    pthread_mutex_lock(&j->lock);
+    pthread_mutex_lock(&j->io);
+    if (j->len && j->fd != -1 && editorWriteAll(j->fd, j->buf, j->len) == -1) j->error = errno;
+    j->len = 0;
+    park->enabled = j->enabled;
+    park->fd = j->fd;
+    park->path = j->path;
+    j->enabled = next->enabled;
+    j->fd = next->fd;
+    j->path = next->path;
+    pthread_mutex_unlock(&j->io);
+    pthread_mutex_unlock(&j->lock);
+}
+
+/* Whether an edit read back from a journal fits the rows */
+int editorJournalValid(struct journalRecord *rec, const char *s)
+{
+    if (rec->row < 0 || rec->col < 0 || rec->nrows < 1) return 0;
+    switch (rec->kind) {
+        case UNDO_INSERT_TEXT:
+            return rec->row < E.numrows && rec->col <= E.row[rec->row].size;
+        case UNDO_DELETE_TEXT:
+            return rec->row < E.numrows && rec->col + rec->len <= (uint64_t)E.row[rec->row].size;
+        case UNDO_INSERT_ROWS: {
+            int lines = 1;
+            const char *p = s, *end = s + rec->len;
+            while ((p = memchr(p, '\n', end - p))) {
+                lines++;
+                p++;
+            }
+            return rec->row <= E.numrows && lines == rec->nrows;
+        }
+        case UNDO_DELETE_ROWS:
+            return rec->row + rec->nrows <= E.numrows;
+        case UNDO_MOVE_ROWS:
+        case UNDO_MOVE_ROWS_BACK:
+            return rec->row + rec->nrows <= E.numrows && rec->col + rec->nrows <= E.numrows;
+        case UNDO_REPLACE:
+        case UNDO_REPLACE_BACK:
+            return editorReplaceValid(rec->kind, s, rec->len);
+        case UNDO_PERMUTE_ROWS:
+        case UNDO_PERMUTE_ROWS_BACK:
+        case UNDO_INSERT_SPARSE:
+        case UNDO_DELETE_SPARSE:
+            return editorSortValid(rec->kind, rec->row, rec->nrows, s, rec->len);
+    }
+    return 0;
+}
+
+/* Whether another buffer journals the file of this one, or to 'path'. A
+ * second journal would replay the records of the first and then append to
+ * the same file */
+int editorJournalTaken(const char *path)
+{
+    struct stat st;
+    int found = stat(E.filename, &st) == 0;
+    int i;
+    for (i = 0; i < E.nbuffers; ++i) {
+        struct editorBuffer *b = &E.buffers[i];
+        if (i == E.buffer || !b->journal.enabled) continue;
+        if (!strcmp(b->journal.path, path) ||
+                (found && b->filename && editorSameFile(b->filename, &st))) return 1;
+    }
+    return 0;
+}
+
+/* Starts journaling the file just opened. A journal left behind by a session
+ * that didn't end cleanly is replayed onto the rows first, up to its first
+ * damaged record, and then kept appending */
+void editorJournalOpen(void)
+{
+    struct editorJournal *j = &E.journal;
+    static int registered = 0;
+    if (!registered) {
+        atexit(editorJournalAtExit);
+        registered = 1;
+    }
+    char *path = editorJournalPath(E.filename);
+    if (editorJournalTaken(path)) {
+        editorSetStatusMessage("%s is journaled by another buffer, not this one", E.filename);
+        free(path);
+        return;
+    }
+    j->path = path;
+    j->enabled = 1;
+
+    int fd = open(j->path, O_RDWR | O_APPEND);
+    if (fd == -1) return;
+    struct stat jst, st;
+    char *buf = NULL;
+    if (fstat(fd, &jst) == -1 || stat(E.filename, &st) == -1 ||
+            (size_t)jst.st_size < sizeof(struct journalHeader) ||
+            (buf = mmap(NULL, jst.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return;
+    }
+
+    struct journalHeader h;
+    editorJournalHeader(&h, &st);
+    if (memcmp(buf, &h, sizeof(h))) {
+        /* Made for another version of the file, keep it aside */
+        char *stale = malloc(strlen(j->path) + 7);
+        if (!stale) die("malloc");
+        sprintf(stale, "%s.stale", j->path);
+        rename(j->path, stale);
+        editorSetStatusMessage("Journal doesn't match the file, kept as %s", stale);
+        free(stale);
+        munmap(buf, jst.st_size);
+        close(fd);
+        return;
+    }
+
+    size_t off = sizeof(h), size = jst.st_size;
+    int n = 0;
+    j->paused = 1;
+    while (size - off >= sizeof(struct journalRecord)) {
+        struct journalRecord rec;
+        memcpy(&rec, buf + off, sizeof(rec));
+        const char *s = buf + off + sizeof(rec);
+        if (rec.len > size - off - sizeof(rec) || editorJournalSum(&rec, s) != rec.sum ||
+                !editorJournalValid(&rec, s)) break;
+        editorApplyEdit(rec.kind, rec.row, rec.col, rec.nrows, s, rec.len);
+        off += sizeof(rec) + rec.len;
+        n++;
+    }
+    j->paused = 0;
+    munmap(buf, size);
+
+    if (n == 0) {
+        close(fd);
+        unlink(j->path);
+        return;
+    }
+    /* Drop a torn tail, new records go after the last good one */
+    if (off < size) ftruncate(fd, off);
+    j->fd = fd;
+    if (!j->started) {
+        if (pthread_create(&j->thread, NULL, editorJournalThread, NULL) != 0) die("pthread_create");
+        j->started = 1;
+    }
+    editorSetStatusMessage("Recovered %d edits from %s", n, j->path);
+}
+
+/*******************
+*  line indexing  *
+*******************/
+
+/* A slice of a file handled by one loader thread */
+struct lineChunk {
+    const char *buf;    /* Whole file */
+    size_t from, to;    /* Byte range scanned for newlines */
+    uint64_t *eol;      /* Offsets where the lines end */
+    size_t count, cap;
+    size_t firstrow;    /* First row built by this chunk */
+    size_t linestart;   /* Offset where that row starts */
+};
+
+void lineChunkPush(struct lineChunk *c, uint64_t off)
+{
+    if (c->count == c->cap) {
+        c->cap = c->cap ? c->cap * 2 : 1024;
+        c->eol = realloc(c->eol, sizeof(uint64_t) * c->cap);
+        if (!c->eol) die("realloc");
+    }
+    c->eol[c->count++] = off;
+}
+
+/* Thread body: records the offset of every '\n' in the chunk. Compares 16
+ * bytes at a time and walks the bits of the mask, so dense short lines cost
+ * no more than a single call to memchr per line would */
+void *lineIndexChunk(void *arg)
+{
+    struct lineChunk *c = arg;
+    const char *buf = c->buf;
+    size_t i = c->from;
+    TRACE_BEGIN("lineIndexChunk");
+
+#ifdef __SSE2__
+    const __m128i nl = _mm_set1_epi8('\n');
+    for (; i + 16 <= c->to; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&buf[i]);
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        while (mask) {
+            lineChunkPush(c, i + __builtin_ctz(mask));
+            mask &= mask - 1;
+        }
+    }
+#endif
+    while (i < c->to) {
+        const char *p = memchr(&buf[i], '\n', c->to - i);
+        if (!p) break;
+        lineChunkPush(c, p - buf);
+        i = p - buf + 1;
+    }
+    TRACE_END("lineIndexChunk");
+    return NULL;
+}
+
+/* Number of threads worth starting for 'len' bytes of input */
+int editorLoaderThreads(size_t len)
+{
+    int n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) n = 1;
+    if (n > KILO_MAX_THREADS) n = KILO_MAX_THREADS;
+    if (len < KILO_MIN_CHUNK * (size_t)n) n = len / KILO_MIN_CHUNK + 1;
+    return n;
+}
+
+/* Finds where every line of the buffer ends, splitting it in one chunk per
+ * core. The per-chunk offsets are stitched into '*eolp', which the caller
+ * must free. A last line without a trailing newline ends at 'len' */
+size_t editorIndexLines(const char *buf, size_t len, uint64_t **eolp)
+{
+    struct lineChunk chunks[KILO_MAX_THREADS];
+    pthread_t threads[KILO_MAX_THREADS];
+    int nchunks = editorLoaderThreads(len);
+    int i;
+
+    for (i = 0; i < nchunks; ++i) {
+        chunks[i].buf = buf;
+        chunks[i].from = len / nchunks * i;
+        chunks[i].to = (i == nchunks - 1) ? len : len / nchunks * (i + 1);
+        chunks[i].eol = NULL;
+        chunks[i].count = chunks[i].cap = 0;
+    }
+    for (i = 1; i < nchunks; ++i)
+        if (pthread_create(&threads[i], NULL, lineIndexChunk, &chunks[i]) != 0) die("pthread_create");
+    lineIndexChunk(&chunks[0]);
+    for (i = 1; i < nchunks; ++i) pthread_join(threads[i], NULL);
+
+    size_t total = 0;
+    for (i = 0; i < nchunks; ++i) total += chunks[i].count;
+    int tail = (len > 0 && buf[len - 1] != '\n');
+
+    uint64_t *eol = malloc(sizeof(uint64_t) * (total + tail + 1));
+    if (!eol) die("malloc");
+    size_t n = 0;
+    for (i = 0; i < nchunks; ++i) {
+        memcpy(&eol[n], chunks[i].eol, sizeof(uint64_t) * chunks[i].count);
+        n += chunks[i].count;
+        free(chunks[i].eol);
+    }
+    if (tail) eol[n++] = len;
+
+    *eolp = eol;
+    return n;
+}
+
+/* Fills a new row from a line of the file, trimming CR and LF like getline
+ * based loading did. Doesn't highlight, that depends on the previous row */
+void editorBuildRow(erow *row, int at, const char *s, size_t len)
+{
+    while (len > 0 && (s[len - 1] == '\r' || s[len - 1] == '\n')) len--;
+
+    row->idx = at;
+    row->size = len;
+    row->chars = malloc(len + 1);
+    if (!row->chars) die("malloc");
+    memcpy(row->chars, s, len);
+    row->chars[len] = '\0';
+    row->rsize = 0;
+    row->render = NULL;
+    row->cols = NULL;
+    row->hl = NULL;
+    row->brblock = NULL;
+    row->br = (struct bracketSum){0, 1, 0};
+    row->hl_open_comment = 0;
+    editorUpdateRender(row);
+    /* Without syntax highlighting rows are independent, so also do it here */
+    if (E.syntax == NULL) editorHighlightRow(row);
+}
+
+/* Thread body: turns the lines of the chunk into rows */
+void *lineBuildChunk(void *arg)
+{
+    struct lineChunk *c = arg;
+    size_t start = c->linestart;
+    size_t j;
+    TRACE_BEGIN("lineBuildChunk");
+    for (j = 0; j < c->count; ++j) {
+        editorBuildRow(&E.row[c->firstrow + j], c->firstrow + j, &c->buf[start], c->eol[j] - start);
+        start = c->eol[j] + 1;
+    }
+    TRACE_END("lineBuildChunk");
+    return NULL;
+}
+
+/* Appends the 'nlines' lines of buf ending at the offsets in 'eol' as rows.
+ * The rows are split evenly among the threads. If 'open_comment' is given it
+ * holds the multiline comment state of every row (one bit each) and the rows
+ * are highlighted lazily, when drawn. Otherwise the syntax pass, which
+ * depends on the previous row, runs sequentially */
+void editorLoadLines(const char *buf, const uint64_t *eol, size_t nlines,
+        const unsigned char *open_comment)
+{
+    struct lineChunk chunks[KILO_MAX_THREADS];
+    pthread_t threads[KILO_MAX_THREADS];
+    int nchunks = editorLoaderThreads(nlines ? eol[nlines - 1] : 0);
+    int i;
+
+    editorReserveRows(nlines);
+    editorIndexInvalidate();
+
+    for (i = 0; i < nchunks; ++i) {
+        size_t from = nlines / nchunks * i;
+        size_t to = (i == nchunks - 1) ? nlines : nlines / nchunks * (i + 1);
+        chunks[i].buf = buf;
+        chunks[i].eol = (uint64_t *)&eol[from];
+        chunks[i].count = to - from;
+        chunks[i].firstrow = E.numrows + from;
+        chunks[i].linestart = from ? eol[from - 1] + 1 : 0;
+    }
+    for (i = 1; i < nchunks; ++i)
+        if (pthread_create(&threads[i], NULL, lineBuildChunk, &chunks[i]) != 0) die("pthread_create");
+    lineBuildChunk(&chunks[0]);
+    for (i = 1; i < nchunks; ++i) pthread_join(threads[i], NULL);
+
+    int first = E.numrows;
+    E.numrows += nlines;
+    if (E.syntax == NULL) return;
+
+    int j;
+    if (open_comment) {
+        for (j = first; j < E.numrows; ++j)
+            E.row[j].hl_open_comment = (open_comment[(j - first) / 8] >> ((j - first) % 8)) & 1;
+    } else {
+        for (j = first; j < E.numrows; ++j) editorHighlightRow(&E.row[j]);
+    }
+}
+
+/*******************
+*  sidecar cache  *
+*******************/
+
+/* The line index and the multiline comment state of every row of a file are
+ * saved next to each other in $XDG_CACHE_HOME/kilo, so reopening the same
+ * file needs neither the newline scan nor the syntax pass. Layout, with
+ * every section 8 byte aligned so the file can be used straight from mmap:
+ *
+ *   struct cacheHeader | path, padded | uint64_t eol[nlines] | state bits
+ */
+#define KILO_CACHE_MAGIC "KILOIDX1"
+
+struct cacheHeader {
+    char magic[8];
+    uint64_t size;          /* Key: the file must still match all of these */
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t ino;
+    uint64_t dev;
+    uint64_t nlines;
+    uint64_t pathlen;       /* Length of the path that follows the header */
+    char filetype[16];      /* Syntax the comment states were computed with */
+};
+
+/* Everything the background thread needs to write a cache file */
+struct cacheJob {
+    char *cachepath;
+    char *path;
+    struct cacheHeader header;
+    uint64_t *eol;
+    unsigned char *bits;
+};
+
+#define CACHE_ALIGN(x) (((x) + 7) & ~(size_t)7)
+
+/* Cache writers still running, waited for at exit so that none is cut off
+ * with its .tmp file left behind in the cache directory */
+int cache_writers = 0;
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cache_done = PTHREAD_COND_INITIALIZER;
+
+void editorCacheAtExit(void)
+{
+    pthread_mutex_lock(&cache_lock);
+    while (cache_writers) pthread_cond_wait(&cache_done, &cache_lock);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/* Cache file for an absolute path, creating the cache directory if needed.
+ * The caller is expected to free the memory */
+char *editorCachePath(const char *path)
+{
+    char dir[PATH_MAX];
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+
+    if (xdg && *xdg) {
+        snprintf(dir, sizeof(dir), "%s", xdg);
+    } else if (home && *home) {
+        snprintf(dir, sizeof(dir), "%s/.cache", home);
+    } else {
+        return NULL;
+    }
+    mkdir(dir, 0700);
+    strncat(dir, "/kilo", sizeof(dir) - strlen(dir) - 1);
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST) return NULL;
+
+    /* FNV-1a of the path, the full path is also stored to detect collisions */
+    uint64_t hash = 14695981039346656037ULL;
+    const char *p;
+    for (p = path; *p; ++p) hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+
+    char *cachepath = malloc(strlen(dir) + 22);
+    if (!cachepath) die("malloc");
+    sprintf(cachepath, "%s/%016llx.idx", dir, (unsigned long long)hash);
+    return cachepath;
+}
+
+void editorCacheKey(struct cacheHeader *h, struct stat *st, const char *path)
+{
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, KILO_CACHE_MAGIC, 8);
+    h->size = st->st_size;
+    h->mtime_sec = st->st_mtim.tv_sec;
+    h->mtime_nsec = st->st_mtim.tv_nsec;
+    h->ino = st->st_ino;
+    h->dev = st->st_dev;
+    h->pathlen = strlen(path);
+    if (E.syntax) strncpy(h->filetype, E.syntax->filetype, sizeof(h->filetype) - 1);
+}
+
+/* Loads the rows of the mapped file 'buf' using the cache. Returns 0 if
+ * there is no usable cache for this exact file, and removes a stale one */
+int editorCacheLoad(const char *cachepath, const char *path, struct stat *st, const char *buf)
+{
+    int fd = open(cachepath, O_RDONLY);
+    if (fd == -1) return 0;
+
+    struct stat cst;
+    if (fstat(fd, &cst) == -1 || (size_t)cst.st_size < sizeof(struct cacheHeader)) {
+        close(fd);
+        unlink(cachepath);
+        return 0;
+    }
+    char *map = mmap(NULL, cst.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return 0;
+    TRACE_BEGIN("editorCacheLoad");
+
+    struct cacheHeader key;
+    editorCacheKey(&key, st, path);
+    struct cacheHeader *h = (struct cacheHeader *)map;
+    size_t pathoff = sizeof(*h);
+    size_t eoloff = pathoff + CACHE_ALIGN(key.pathlen);
+
+    int hit = 0;
+    key.nlines = h->nlines;
+    if (!memcmp(h, &key, sizeof(key)) && eoloff <= (size_t)cst.st_size &&
+            !memcmp(map + pathoff, path, key.pathlen)) {
+        size_t bitsoff = eoloff + sizeof(uint64_t) * h->nlines;
+        if (h->nlines <= (size_t)cst.st_size / sizeof(uint64_t) &&
+                bitsoff + (h->nlines + 7) / 8 <= (size_t)cst.st_size) {
+            /* Every line must end after the previous one, within the file */
+            uint64_t *eol = (uint64_t *)(map + eoloff), start = 0;
+            size_t j;
+            for (j = 0; j < h->nlines && eol[j] >= start && eol[j] <= (uint64_t)st->st_size; ++j)
+                start = eol[j] + 1;
+            if (j == h->nlines) {
+                editorLoadLines(buf, eol, h->nlines, (unsigned char *)map + bitsoff);
+                hit = 1;
+            }
+        }
+    }
+
+    munmap(map, cst.st_size);
+    if (!hit) unlink(cachepath);
+    TRACE_END("editorCacheLoad");
+    return hit;
+}
+
+/* Thread body: writes the cache to a temporary file and renames it into
+ * place, so a reader never sees a partial cache */
+void *editorCacheWrite(void *arg)
+{
+    struct cacheJob *job = arg;
+    TRACE_BEGIN("editorCacheWrite");
+    char *tmppath = malloc(strlen(job->cachepath) + 5);
+    if (!tmppath) goto out;
+    sprintf(tmppath, "%s.tmp", job->cachepath);
+
+    FILE *fp = fopen(tmppath, "w");
+    if (fp) {
+        static const char pad[8];
+        size_t nlines = job->header.nlines;
+        int ok = fwrite(&job->header, sizeof(job->header), 1, fp) == 1 &&
+            fwrite(job->path, 1, job->header.pathlen, fp) == job->header.pathlen &&
+            fwrite(pad, 1, CACHE_ALIGN(job->header.pathlen) - job->header.pathlen, fp) ==
+                CACHE_ALIGN(job->header.pathlen) - job->header.pathlen &&
+            fwrite(job->eol, sizeof(uint64_t), nlines, fp) == nlines &&
+            fwrite(job->bits, 1, (nlines + 7) / 8, fp) == (nlines + 7) / 8;
+        if (fclose(fp) == 0 && ok) rename(tmppath, job->cachepath);
+        else unlink(tmppath);
+    }
+    free(tmppath);
+
+out:
+    free(job->cachepath);
+    free(job->path);
+    free(job->eol);
+    free(job->bits);
+    free(job);
+    TRACE_END("editorCacheWrite");
+    pthread_mutex_lock(&cache_lock);
+    cache_writers--;
+    pthread_cond_broadcast(&cache_done);
+    pthread_mutex_unlock(&cache_lock);
+    return NULL;
+}
+
+/* Rebuilds the cache in the background from the index used to load the file
+ * and the comment state of its rows. Takes ownership of 'cachepath' and 'eol' */
+void editorCacheSave(char *cachepath, const char *path, struct stat *st,
+        uint64_t *eol, size_t nlines, int firstrow)
+{
+    struct cacheJob *job = malloc(sizeof(*job));
+    if (!job) die("malloc");
+    job->cachepath = cachepath;
+    job->path = strdup(path);
+    job->eol = eol;
+    editorCacheKey(&job->header, st, path);
+    job->header.nlines = nlines;
+
+    job->bits = calloc((nlines + 7) / 8 + 1, 1);
+    if (!job->path || !job->bits) die("malloc");
+    size_t j;
+    for (j = 0; j < nlines; ++j)
+        if (E.row[firstrow + j].hl_open_comment) job->bits[j / 8] |= 1 << (j % 8);
+
+    static int registered = 0;
+    if (!registered) {
+        atexit(editorCacheAtExit);
+        registered = 1;
+    }
+    pthread_mutex_lock(&cache_lock);
+    cache_writers++;
+    pthread_mutex_unlock(&cache_lock);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, editorCacheWrite, job) != 0) {
+        pthread_mutex_lock(&cache_lock);
+        cache_writers--;
+        pthread_mutex_unlock(&cache_lock);
+        job->header.nlines = 0;
+        free(job->cachepath);
+        free(job->path);
+        free(job->eol);
+        free(job->bits);
+        free(job);
+        return;
+    }
+    pthread_detach(thread);
+}
+
+/**************
+*  file i/o  *
+**************/
+
+/* The caller is expected to free the memory */
+char *editorRowsToString(size_t *buflen)
+{
+    size_t totlen = 0;
+    int j;
+
+    /* Count total size */
+    for (j = 0; j < E.numrows; ++j) {
+        totlen += E.row[j].size + 1;
+    }
+    *buflen = totlen;
+
+    /* Create string */
+    char *buf = malloc(totlen);
+    char *p = buf;
+    for (j = 0; j < E.numrows; ++j) {
+        /* Copy line */
+        memcpy(p, E.row[j].chars, E.row[j].size);
+
+        /* Insert end of line */
+        p += E.row[j].size;
+        *p = '\n';
+        p++;
+    }
+
+    return buf;
+}
+
+/* A file is taken as binary if its first bytes have a NUL */
+int editorIsBinary(int fd)
+{
+    char probe[KILO_BINARY_PROBE];
+    ssize_t n = pread(fd, probe, sizeof(probe), 0);
+    return n > 0 && memchr(probe, '\0', n) != NULL;
+}
+
+void editorOpen(char *filename)
+{
+    /* Save filename */
+    free(E.filename);
+    E.filename = strdup(filename);  /* strdup automatically performs a malloc */
+
+    editorSelectSyntaxHighlight();
+
+    /* Regular files are mapped and indexed in parallel */
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) die("open");
+    struct stat st;
+    if (fstat(fd, &st) == -1) die("fstat");
+    TRACE_BEGIN("editorOpen");
+    int format = (S_ISREG(st.st_mode) && !E.hex.force) ? editorCompressFormat(fd) : COMPRESS_NONE;
+    if (format != COMPRESS_NONE) {
+        editorDecodeStart(fd, format);
+        E.dirty = 0;
+        TRACE_END("editorOpen");
+        return;
+    }
+    if (S_ISREG(st.st_mode) && (E.hex.force || editorIsBinary(fd))) {
+        editorHexOpen(fd, &st);
+        E.dirty = 0;
+        TRACE_END("editorOpen");
+        return;
+    }
+    if (S_ISREG(st.st_mode)) {
+        if (st.st_size > 0) {
+            char *buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (buf == MAP_FAILED) die("mmap");
+            madvise(buf, st.st_size, MADV_SEQUENTIAL);
+
+            char *path = E.cache ? realpath(filename, NULL) : NULL;
+            char *cachepath = path ? editorCachePath(path) : NULL;
+            if (!cachepath || !editorCacheLoad(cachepath, path, &st, buf)) {
+                uint64_t *eol;
+                int first = E.numrows;
+                size_t nlines = editorIndexLines(buf, st.st_size, &eol);
+                editorLoadLines(buf, eol, nlines, NULL);
+                if (cachepath) {
+                    editorCacheSave(cachepath, path, &st, eol, nlines, first);
+                    cachepath = NULL;
+                } else {
+                    free(eol);
+                }
+            }
+            free(cachepath);
+            free(path);
+            munmap(buf, st.st_size);
+        }
+        E.filesize = st.st_size;
+        close(fd);
+        E.dirty = 0;
+        TRACE_END("editorOpen");
+        return;
+    }
+
+    /* Anything else (fifos, devices...) is read line by line */
+    FILE *fp = fdopen(fd, "r");
+    if (!fp) die("fdopen");
+
+    char *line = NULL;
+    ssize_t linelen = 0;
+    size_t linecap = 0;
+
+    while ((linelen = getline(&line, &linecap, fp)) != -1) {
+        /* Erase CR a LF at the end of the line, since erow are already rows */
+        while (linelen > 0 && (line[linelen-1] == '\r' || line[linelen - 1] == '\n'))
+            linelen--;
+        editorInsertRow(E.numrows, line, linelen);
+    }
+
+    /* Free and close file */
+    free(line);
+    fclose(fp);
+    E.dirty = 0;
+    TRACE_END("editorOpen");
+}
+
+void editorSave(void)
+{
+    if (!E.filename) {
+        E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+        if (!E.filename) {
+            editorSetStatusMessage("Save aborted");
+            return;
+        }
+
+        editorSelectSyntaxHighlight();
+    }
+    if (E.compress->format != COMPRESS_NONE) {
+        editorSaveCompressed();
+        return;
+    }
+
+    size_t len;
+    TRACE_BEGIN("editorSave");
+    char *buf = editorRowsToString(&len);
+
+    /* fcntl.h */
+    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);  /* 644 owner read/write, everyone else only read */
+    if (fd != -1) {
+        /* unistd.h, set file size */
+        if (ftruncate(fd, len) != -1) {
+            if (editorWriteAll(fd, buf, len) == 0) {
+                /* unistd.h */
+                close(fd);
+                free(buf);
+                editorSetStatusMessage("%zu bytes written to disk", len);
+                E.dirty = 0;
+                editorReloadStamp();
+                editorJournalDiscard();
+                TRACE_END("editorSave");
+                return;
+            }
+        }
+
+        close(fd);
+    }
+
+    free(buf);
+    TRACE_END("editorSave");
+    /* strerror is like perror, but it takes errno and produces a string */
+    editorSetStatusMessage("Can't save! I/O Error: %s", strerror(errno));
+}
+
+/*****************
+*  follow mode  *
+*****************/
+
+/* Appends a line at the end of the file through the normal insert path. The
+ * line comes from the file, it isn't an edit that can be undone or that
+ * the journal must replay */
+void editorAppendLine(const char *s, size_t len)
+{
+    while (len > 0 && s[len - 1] == '\r') len--;
+    int recording = E.undo.recording, paused = E.journal.paused;
+    E.undo.recording = 0;
+    E.journal.paused = 1;
+    editorInsertRow(E.numrows, (char *)s, len);
+    E.undo.recording = recording;
+    E.journal.paused = paused;
+}
+
+void lineBufferAppend(struct lineBuffer *lb, const char *s, size_t len)
+{
+    if (lb->len + len > lb->cap) {
+        lb->cap = (lb->len + len) * 2;
+        lb->b = realloc(lb->b, lb->cap);
+        if (!lb->b) die("realloc");
+    }
+    memcpy(&lb->b[lb->len], s, len);
+    lb->len += len;
+}
+
+/* Turns a chunk of a stream into rows. An incomplete last line is kept in
+ * 'lb' until the rest of it arrives */
+void editorAppendText(struct lineBuffer *lb, const char *s, size_t len)
+{
+    while (len) {
+        const char *nl = memchr(s, '\n', len);
+        if (!nl) {
+            lineBufferAppend(lb, s, len);
+            return;
+        }
+
+        size_t n = nl - s;
+        if (lb->len) {
+            lineBufferAppend(lb, s, n);
+            editorAppendLine(lb->b, lb->len);
+            lb->len = 0;
+        } else {
+            editorAppendLine(s, n);
+        }
+        s += n + 1;
+        len -= n + 1;
+    }
+}
+
+/* Adds a line, or the start of one, read from the followed file. While the
+ * last row is still open it is extended, so a line being written shows up
+ * on screen right away. Like editorAppendLine this isn't an edit */
+void editorFollowLine(const char *s, size_t len, int complete)
+{
+    struct editorFollow *f = &E.follow;
+    int recording = E.undo.recording, paused = E.journal.paused;
+    E.undo.recording = 0;
+    E.journal.paused = 1;
+    if (f->open && E.numrows > 0)
+        editorRowAppendString(&E.row[E.numrows - 1], (char *)s, len);
+    else
+        editorInsertRow(E.numrows, (char *)s, len);
+    if (complete) {
+        erow *row = &E.row[E.numrows - 1];
+        int end = row->size;
+        while (end > 0 && row->chars[end - 1] == '\r') end--;
+        editorRowDelete(row, end, row->size - end);
+    }
+    E.undo.recording = recording;
+    E.journal.paused = paused;
+    f->open = !complete;
+}
+
+/* Reads what was appended to the followed file since the last time */
+void editorFollowRead(void)
+{
+    struct editorFollow *f = &E.follow;
+    struct stat st;
+    if (fstat(f->fd, &st) == -1) return;
+
+    if (st.st_size < f->off) {
+        /* Truncated (e.g. copytruncate rotation), keep following from the start */
+        editorSetStatusMessage("%s: file truncated", E.filename);
+        lseek(f->fd, 0, SEEK_SET);
+        f->off = 0;
+        f->open = 0;
+    }
+    if (st.st_size == f->off) return;
+
+    /* Keep the viewport at the end if the cursor was on the last row */
+    int pinned = (E.cy >= E.numrows - 1);
+    int dirty = E.dirty;
+
+    static char *buf = NULL;
+    if (!buf && !(buf = malloc(KILO_READ_CHUNK))) die("malloc");
+    ssize_t n;
+    TRACE_BEGIN("editorFollowRead");
+    while ((n = read(f->fd, buf, KILO_READ_CHUNK)) > 0) {
+        const char *p = buf, *end = buf + n;
+        while (p < end) {
+            const char *nl = memchr(p, '\n', end - p);
+            editorFollowLine(p, (nl ? nl : end) - p, nl != NULL);
+            p = nl ? nl + 1 : end;
+        }
+        f->off += n;
+    }
+    TRACE_END("editorFollowRead");
+
+    /* The rows mirror the file, they are not unsaved changes */
+    E.dirty = dirty;
+    if (pinned) {
+        E.cy = (E.numrows > 0) ? E.numrows - 1 : 0;
+        if (E.cy >= E.numrows || E.cx > E.row[E.cy].size)
+            E.cx = (E.cy < E.numrows) ? E.row[E.cy].size : 0;
+    }
+}
+
+void editorFollowStop(void)
+{
+    struct editorFollow *f = &E.follow;
+    if (f->fd == -1) return;
+    editorWatchRemove(f->inotify);
+    close(f->inotify);
+    close(f->fd);
+    f->fd = -1;
+}
+
+void editorFollowEvent(int fd, void *data)
+{
+    (void)data;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int gone = 0;
+    ssize_t len;
+
+    /* Drain the queue, many writes only need one read */
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        char *p;
+        for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            if (((struct inotify_event *)p)->mask & (IN_MOVE_SELF | IN_DELETE_SELF))
+                gone = 1;
+        }
+    }
+
+    editorFollowRead();
+    if (gone) {
+        editorFollowStop();
+        editorSetStatusMessage("%s was moved or deleted, not following anymore", E.filename);
+    }
+}
+
+void editorFollowStart(void)
+{
+    struct editorFollow *f = &E.follow;
+    if (!E.filename) return;
+
+    f->fd = open(E.filename, O_RDONLY);
+    if (f->fd == -1) die("open");
+    f->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (f->inotify == -1) die("inotify_init1");
+    if (inotify_add_watch(f->inotify, E.filename, IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF) == -1)
+        die("inotify_add_watch");
+
+    /* Continue where editorOpen stopped. If the file didn't end in a newline
+     * the last row is kept open, the rest of it extends the row */
+    f->off = E.filesize;
+    lseek(f->fd, f->off, SEEK_SET);
+    char last;
+    f->open = f->off > 0 && E.numrows > 0 &&
+        pread(f->fd, &last, 1, f->off - 1) == 1 && last != '\n';
+
+    editorWatchAdd(f->inotify, POLLIN, editorFollowEvent, NULL);
+    /* Catch up with anything written while the file was being loaded */
+    editorFollowRead();
+}
+
+/*********************
+*  streaming input  *
+*********************/
+
+/* Reads what is available in the pipe. Stops after a few MB so the screen
+ * and the keyboard are served between chunks; poll() calls back right away
+ * if there is more */
+void editorStreamRead(int fd, void *data)
+{
+    (void)data;
+    struct editorStream *st = &E.stream;
+    int dirty = E.dirty;
+
+    static char *buf = NULL;
+    if (!buf && !(buf = malloc(KILO_READ_CHUNK))) die("malloc");
+    size_t budget = 0;
+    ssize_t n = 0;
+    TRACE_BEGIN("editorStreamRead");
+    while (budget < KILO_STREAM_BUDGET && (n = read(fd, buf, KILO_READ_CHUNK)) > 0) {
+        editorAppendText(&st->partial, buf, n);
+        st->bytes += n;
+        budget += n;
+    }
+    E.dirty = dirty;
+    TRACE_END("editorStreamRead");
+
+    if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+        /* End of the stream, the last line may not end in a newline */
+        if (st->partial.len) editorAppendLine(st->partial.b, st->partial.len);
+        free(st->partial.b);
+        st->partial.b = NULL;
+        st->partial.len = st->partial.cap = 0;
+        editorWatchRemove(fd);
+        close(fd);
+        st->fd = -1;
+        E.dirty = dirty;
+        if (E.compress->format != COMPRESS_NONE && editorDecodeStop() == -1)
+            editorSetStatusMessage("Can't decompress %s: %s", E.filename, E.compress->error);
+        else
+            editorSetStatusMessage("%zu bytes read", st->bytes);
+    }
+}
+
+/* Shows rows as they arrive from 'fd' instead of waiting for the end */
+void editorStreamStart(int fd)
+{
+    E.stream.fd = fd;
+    E.stream.bytes = 0;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    editorWatchAdd(fd, POLLIN, editorStreamRead, NULL);
+}
+
+/**********************
+*  compressed files  *
+**********************/
+
+/* Compressed files are decoded in the background into a pipe that is read
+ * as a stream, so rows show up as they are decoded: gzip by a thread with
+ * zlib, zstd by the zstd command. Saving compresses a copy of the rows on a
+ * thread, into a temporary file renamed over the original */
+
+/* Format of the file by its magic bytes */
+int editorCompressFormat(int fd)
+{
+    unsigned char magic[4];
+    ssize_t n = pread(fd, magic, sizeof(magic), 0);
+    if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) return COMPRESS_GZIP;
+    if (n == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+        return COMPRESS_ZSTD;
+    return COMPRESS_NONE;
+}
+
+/* Runs 'argv' with 'in' and 'out' as its stdin and stdout, and without a
+ * stderr that would write over the screen */
+pid_t compressSpawn(char *const argv[], int in, int out)
+{
+    pid_t pid = fork();
+    if (pid != 0) return pid;
+    int null = open("/dev/null", O_WRONLY);
+    dup2(in, STDIN_FILENO);
+    dup2(out, STDOUT_FILENO);
+    if (null != -1) dup2(null, STDERR_FILENO);
+    signal(SIGPIPE, SIG_DFL);
+    execvp(argv[0], argv);
+    _exit(127);
+}
+
+/* Exit status of a command, -1 if it didn't exit */
+int compressWait(pid_t pid)
+{
+    int status;
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) return -1;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/* Inflates the file into the pipe. It ends with the file, or when the
+ * stream is closed and writing fails */
+void *gzipInflateThread(void *arg)
+{
+    struct editorCompress *c = arg;
+    gzFile gz = gzdopen(c->fd, "rb");
+    char *buf = malloc(KILO_READ_CHUNK);
+    if (!gz || !buf) {
+        snprintf(c->error, sizeof(c->error), "out of memory");
+        if (!gz) close(c->fd);
+        close(c->pipe);
+        free(buf);
+        return NULL;
+    }
+
+    gzbuffer(gz, KILO_GZIP_BUFFER);
+    int n;
+    while ((n = gzread(gz, buf, KILO_READ_CHUNK)) > 0) {
+        if (editorWriteAll(c->pipe, buf, n) == -1) break;
+    }
+    /* A truncated file only shows in the error state */
+    int err;
+    const char *msg = gzerror(gz, &err), *colon = strstr(msg, ": ");
+    /* Without the "<fd:N>: " zlib puts before it */
+    if (colon && !strncmp(msg, "<fd:", 4)) msg = colon + 2;
+    if (n < 0 || err != Z_OK) snprintf(c->error, sizeof(c->error), "%s", msg);
+    gzclose(gz);
+    close(c->pipe);
+    free(buf);
+    return NULL;
+}
+
+/* Starts decoding 'fd' into a stream of rows */
+void editorDecodeStart(int fd, int format)
+{
+    struct editorCompress *c = E.compress;
+    int p[2];
+    if (pipe2(p, O_CLOEXEC) == -1) die("pipe2");
+    fcntl(p[0], F_SETPIPE_SZ, KILO_PIPE_SIZE);
+
+    c->format = format;
+    c->error[0] = '\0';
+    if (format == COMPRESS_GZIP) {
+        c->fd = fd;
+        c->pipe = p[1];
+        if (pthread_create(&c->thread, NULL, gzipInflateThread, c) != 0) die("pthread_create");
+        c->running = 1;
+    } else {
+        char *argv[] = { "zstd", "-d", "-c", "-q", NULL };
+        c->pid = compressSpawn(argv, fd, p[1]);
+        if (c->pid == -1) die("fork");
+        close(fd);
+        close(p[1]);
+    }
+    editorStreamStart(p[0]);
+
+    /* A replay doesn't serve the watches, the file is read whole right away */
+    while (E.replay.script && E.stream.fd != -1) {
+        struct pollfd pfd = { E.stream.fd, POLLIN, 0 };
+        if (poll(&pfd, 1, -1) == -1 && errno != EINTR) die("poll");
+        editorStreamRead(E.stream.fd, NULL);
+    }
+}
+
+/* Waits for the decoder, once the stream was read or closed. Returns -1 if
+ * it failed, the reason being in E.compress->error */
+int editorDecodeStop(void)
+{
+    struct editorCompress *c = E.compress;
+    if (c->running) {
+        pthread_join(c->thread, NULL);
+        c->running = 0;
+    }
+    if (c->pid) {
+        int status = compressWait(c->pid);
+        c->pid = 0;
+        if (status != 0 && !c->error[0])
+            snprintf(c->error, sizeof(c->error), "zstd exited with %d", status);
+    }
+    return c->error[0] ? -1 : 0;
+}
+
+/* Writes the copy of the rows compressed to a temporary file, which then
+ * replaces the file */
+void *compressSaveThread(void *arg)
+{
+    struct editorCompress *c = arg;
+    struct stat st;
+    mode_t mode = (stat(c->savepath, &st) == 0) ? (st.st_mode & 0777) : 0644;
+    size_t tmplen = strlen(c->savepath) + 16;
+    char *tmp = malloc(tmplen);
+    int fd = -1, ok = 0;
+    if (!tmp) goto done;
+    snprintf(tmp, tmplen, "%s.kilo-save", c->savepath);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+    if (fd == -1) goto done;
+
+    if (c->format == COMPRESS_GZIP) {
+        gzFile gz = gzdopen(fd, "wb");
+        if (!gz) goto done;
+        fd = -1;
+        gzbuffer(gz, KILO_GZIP_BUFFER);
+        const char *p = c->savebuf;
+        size_t left = c->savelen;
+        ok = 1;
+        while (ok && left) {
+            unsigned n = left > KILO_READ_CHUNK ? KILO_READ_CHUNK : left;
+            ok = gzwrite(gz, p, n) == (int)n;
+            p += n;
+            left -= n;
+        }
+        if (gzclose(gz) != Z_OK) ok = 0;
+    } else {
+        int p[2];
+        if (pipe2(p, O_CLOEXEC) == -1) goto done;
+        char *argv[] = { "zstd", "-c", "-q", NULL };
+        pid_t pid = compressSpawn(argv, p[0], fd);
+        close(p[0]);
+        ok = pid != -1 && editorWriteAll(p[1], c->savebuf, c->savelen) == 0;
+        close(p[1]);
+        if (pid != -1 && compressWait(pid) != 0) ok = 0;
+    }
+    if (ok && rename(tmp, c->savepath) == -1) ok = 0;
+
+done:
+    if (!ok) c->saveerr = errno ? errno : EIO;
+    if (fd != -1) close(fd);
+    if (!ok && tmp) unlink(tmp);
+    free(tmp);
+    if (write(c->notify[1], "", 1) == -1) c->saveerr = errno;
+    return NULL;
+}
+
+/* Joins the thread that saved, and reports */
+void editorSaveDone(int fd, void *data)
+{
+    (void)data;
+    struct editorCompress *c = E.compress;
+    char byte;
+    if (read(fd, &byte, 1) != 1) return;
+    pthread_join(c->saver, NULL);
+    editorWatchRemove(fd);
+    c->saving = 0;
+
+    if (c->saveerr) {
+        editorSetStatusMessage("Can't save! I/O Error: %s", strerror(c->saveerr));
+    } else {
+        /* Edits made while it was being written are still unsaved */
+        E.dirty = E.dirty > c->savedirty ? E.dirty - c->savedirty : 0;
+        editorSetStatusMessage("%zu bytes compressed to %s", c->savelen, c->savepath);
+    }
+    free(c->savebuf);
+    free(c->savepath);
+    c->savebuf = c->savepath = NULL;
+}
+
+/* Saves the rows compressed like the file was, without waiting for it */
+void editorSaveCompressed(void)
+{
+    struct editorCompress *c = E.compress;
+    if (c->saving) {
+        editorSetStatusMessage("Still saving %s", c->savepath);
+        return;
+    }
+    if (E.stream.fd != -1) {
+        editorSetStatusMessage("Can't save before %s is read whole", E.filename);
+        return;
+    }
+    if (c->notify[0] == -1 && pipe2(c->notify, O_CLOEXEC) == -1) {
+        editorSetStatusMessage("Can't save! %s", strerror(errno));
+        return;
+    }
+
+    c->savebuf = editorRowsToString(&c->savelen);
+    c->savepath = strdup(E.filename);
+    c->savedirty = E.dirty;
+    c->saveerr = 0;
+    if (pthread_create(&c->saver, NULL, compressSaveThread, c) != 0) {
+        editorSetStatusMessage("Can't save! %s", strerror(errno));
+        free(c->savebuf);
+        free(c->savepath);
+        c->savebuf = c->savepath = NULL;
+        return;
+    }
+    c->saving = 1;
+    editorWatchAdd(c->notify[0], POLLIN, editorSaveDone, NULL);
+    editorSetStatusMessage("Compressing %zu bytes to %s...", c->savelen, E.filename);
+
+    /* A replay doesn't serve the watches */
+    if (E.replay.script) editorSaveDone(c->notify[0], NULL);
+}
+
+/* Waits for a save still being written, before the rows go away */
+void editorSaveWait(void)
+{
+    if (E.compress->saving) editorSaveDone(E.compress->notify[0], NULL);
+}
+
+/************
+*  reload  *
+************/
+
+/* The directory of the file is watched, so both writes in place and files
+ * renamed over it (git checkout, editors that save atomically) are seen.
+ * A change is reloaded as a line diff against the rows: rows that didn't
+ * change are kept with their highlight, and the rest is edited through the
+ * usual primitives, so a reload is one more undo group */
+
+/* Old rows [a, a + n) become new lines [b, b + m) */
+struct diffHunk {
+    int a, n, b, m;
+};
+
+/* Myers' diff in linear space, on line hashes */
+struct lineDiff {
+    const uint64_t *ha, *hb;    /* Hashes of the rows and of the new lines */
+    const char *buf;            /* New file, and where its lines end */
+    const uint64_t *eol;
+    int *v1, *v2;               /* Furthest x on every diagonal, forward and backward */
+    double deadline;            /* Past it, what is left is replaced as a whole */
+    struct diffHunk *hunks;
+    int nhunks, cap;
+};
+
+struct reloadHashJob {
+    const char *buf;            /* New file, NULL to hash the rows */
+    const uint64_t *eol;
+    int from, to;
+    uint64_t *out;
+};
+
+/* Hash of a line, a word at a time */
+uint64_t lineHash(const char *s, size_t len)
+{
+    uint64_t h = len * 0x9e3779b97f4a7c15ULL, w;
+    while (len >= 8) {
+        memcpy(&w, s, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+        s += 8;
+        len -= 8;
+    }
+    if (len) {
+        w = 0;
+        memcpy(&w, s, len);
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+    }
+    return h ^ (h >> 29);
+}
+
+/* Line 'i' of the new file, as editorBuildRow would make it a row */
+const char *reloadLine(const char *buf, const uint64_t *eol, int i, size_t *len)
+{
+    size_t start = i ? eol[i - 1] + 1 : 0, end = eol[i];
+    while (end > start && buf[end - 1] == '\r') end--;
+    *len = end - start;
+    return buf + start;
+}
+
+int reloadSame(int row, const char *buf, const uint64_t *eol, int i)
+{
+    size_t len;
+    const char *s = reloadLine(buf, eol, i, &len);
+    return (size_t)E.row[row].size == len && !memcmp(E.row[row].chars, s, len);
+}
+
+/* Row 'a' and new line 'b' match when their hashes do and then their bytes,
+ * so a collision can't keep a stale row */
+int diffSame(struct lineDiff *d, int a, int b)
+{
+    return d->ha[a] == d->hb[b] && reloadSame(a, d->buf, d->eol, b);
+}
+
+void *reloadHashChunk(void *arg)
+{
+    struct reloadHashJob *job = arg;
+    int i;
+    for (i = job->from; i < job->to; ++i) {
+        if (job->buf) {
+            size_t len;
+            const char *s = reloadLine(job->buf, job->eol, i, &len);
+            job->out[i - job->from] = lineHash(s, len);
+        } else {
+            job->out[i - job->from] = lineHash(E.row[i].chars, E.row[i].size);
+        }
+    }
+    return NULL;
+}
+
+/* Hashes rows (buf NULL) or new lines [from, to) into 'out', in parallel */
+void reloadHash(const char *buf, const uint64_t *eol, int from, int to, size_t bytes, uint64_t *out)
+{
+    struct reloadHashJob jobs[KILO_MAX_THREADS];
+    pthread_t threads[KILO_MAX_THREADS];
+    int n = to - from, nchunks = editorLoaderThreads(bytes), i;
+    if (nchunks > n) nchunks = n ? n : 1;
+
+    for (i = 0; i < nchunks; ++i) {
+        jobs[i].buf = buf;
+        jobs[i].eol = eol;
+        jobs[i].from = from + (long)n * i / nchunks;
+        jobs[i].to = from + (long)n * (i + 1) / nchunks;
+        jobs[i].out = out + (jobs[i].from - from);
+    }
+    for (i = 1; i < nchunks; ++i)
+        if (pthread_create(&threads[i], NULL, reloadHashChunk, &jobs[i]) != 0) die("pthread_create");
+    reloadHashChunk(&jobs[0]);
+    for (i = 1; i < nchunks; ++i) pthread_join(threads[i], NULL);
+}
+
+void diffAdd(struct lineDiff *d, int a, int n, int b, int m)
+{
+    struct diffHunk *last = d->nhunks ? &d->hunks[d->nhunks - 1] : NULL;
+    if (last && last->a + last->n == a && last->b + last->m == b) {
+        last->n += n;
+        last->m += m;
+        return;
+    }
+    if (d->nhunks == d->cap) {
+        d->cap = d->cap ? d->cap * 2 : 64;
+        d->hunks = realloc(d->hunks, sizeof(struct diffHunk) * d->cap);
+        if (!d->hunks) die("realloc");
+    }
+    d->hunks[d->nhunks++] = (struct diffHunk){ a, n, b, m };
+}
+
+/* Finds where a shortest edit script of rows [a, a + n) into lines
+ * [b, b + m) crosses the middle, walking it from both ends at once. Cells
+ * of v1 and v2 are set to -1 as the walk reaches them, the diagonals in
+ * [-(d + 1), d + 1]. Returns 0 past the deadline */
+int diffBisect(struct lineDiff *d, int a, int n, int b, int m, int *x, int *y)
+{
+    int max = (n + m + 1) / 2, delta = n - m, front = delta & 1;
+    int *v1 = d->v1, *v2 = d->v2;
+    int k1start = 0, k1end = 0, k2start = 0, k2end = 0, dd, k;
+
+    v1[-1] = v1[0] = v2[-1] = v2[0] = -1;
+    v1[1] = v2[1] = 0;
+    for (dd = 0; dd < max; ++dd) {
+        if (dd) v1[-dd - 1] = v1[dd + 1] = v2[-dd - 1] = v2[dd + 1] = -1;
+        if ((dd & 255) == 255 && editorNow() > d->deadline) return 0;
+
+        for (k = -dd + k1start; k <= dd - k1end; k += 2) {
+            int x1 = (k == -dd || (k != dd && v1[k - 1] < v1[k + 1])) ? v1[k + 1] : v1[k - 1] + 1;
+            int y1 = x1 - k;
+            while (x1 < n && y1 < m && diffSame(d, a + x1, b + y1)) x1++, y1++;
+            v1[k] = x1;
+            if (x1 > n) {
+                k1end += 2;
+            } else if (y1 > m) {
+                k1start += 2;
+            } else if (front) {
+                int k2 = delta - k;
+                if (k2 >= -dd - 1 && k2 <= dd + 1 && v2[k2] != -1 && x1 >= n - v2[k2]) {
+                    *x = x1;
+                    *y = y1;
+                    return 1;
+                }
+            }
+        }
+
+        for (k = -dd + k2start; k <= dd - k2end; k += 2) {
+            int x2 = (k == -dd || (k != dd && v2[k - 1] < v2[k + 1])) ? v2[k + 1] : v2[k - 1] + 1;
+            int y2 = x2 - k;
+            while (x2 < n && y2 < m && diffSame(d, a + n - x2 - 1, b + m - y2 - 1)) x2++, y2++;
+            v2[k] = x2;
+            if (x2 > n) {
+                k2end += 2;
+            } else if (y2 > m) {
+                k2start += 2;
+            } else if (!front) {
+                int k1 = delta - k;
+                if (k1 >= -dd - 1 && k1 <= dd + 1 && v1[k1] != -1 && v1[k1] >= n - x2) {
+                    *x = v1[k1];
+                    *y = v1[k1] - k1;
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+void diffRange(struct lineDiff *d, int a, int n, int b, int m)
+{
+    while (n && m && diffSame(d, a, b)) a++, b++, n--, m--;
+    while (n && m && diffSame(d, a + n - 1, b + m - 1)) n--, m--;
+    if (!n || !m) {
+        if (n || m) diffAdd(d, a, n, b, m);
+        return;
+    }
+
+    int x, y;
+    if (!diffBisect(d, a, n, b, m, &x, &y)) {
+        diffAdd(d, a, n, b, m);
+        return;
+    }
+    diffRange(d, a, x, b, y);
+    diffRange(d, a + x, n - x, b + y, m - y);
+}
+
+/* Where 'row' is once the hunks are applied. A row that was replaced stays
+ * on its replacement, or on what follows */
+int reloadMapRow(struct diffHunk *h, int nhunks, int row)
+{
+    int shift = 0, i;
+    for (i = 0; i < nhunks && row >= h[i].a; ++i) {
+        if (row < h[i].a + h[i].n) {
+            int off = row - h[i].a;
+            if (off >= h[i].m) off = h[i].m ? h[i].m - 1 : 0;
+            return h[i].a + shift + off;
+        }
+        shift += h[i].m - h[i].n;
+    }
+    return row + shift;
+}
+
+/* Turns a row into a line, editing only what lies between the bytes they
+ * start and end with in common */
+void reloadReplaceRow(erow *row, const char *s, size_t len)
+{
+    size_t size = row->size, pre = 0, suf = 0;
+    while (pre < size && pre < len && row->chars[pre] == s[pre]) pre++;
+    while (suf < size - pre && suf < len - pre && row->chars[size - suf - 1] == s[len - suf - 1]) suf++;
+    editorRowDelete(row, pre, size - pre - suf);
+    editorRowInsertString(row, pre, s + pre, len - pre - suf);
+}
+
+/* Inserts new lines [from, from + n) at row 'at', at once unless they end
+ * in '\r' */
+void reloadInsert(int at, const char *buf, const uint64_t *eol, int from, int n)
+{
+    size_t start = from ? eol[from - 1] + 1 : 0, end = eol[from + n - 1];
+    int j;
+    for (j = from; j < from + n; ++j) {
+        if (eol[j] > (j ? eol[j - 1] + 1 : 0) && buf[eol[j] - 1] == '\r') break;
+    }
+    if (j == from + n) {
+        editorInsertRows(at, buf + start, end - start, n);
+        return;
+    }
+    for (j = 0; j < n; ++j) {
+        size_t len;
+        const char *s = reloadLine(buf, eol, from + j, &len);
+        editorInsertRow(at + j, (char *)s, len);
+    }
+}
+
+/* Remembers the file as it is now, loaded or saved */
+void editorReloadStamp(void)
+{
+    struct editorReload *r = &E.reload;
+    if (!E.filename || stat(E.filename, &r->st) == -1) memset(&r->st, 0, sizeof(r->st));
+}
+
+int editorReloadChanged(void)
+{
+    struct editorReload *r = &E.reload;
+    struct stat st;
+    if (!E.filename || stat(E.filename, &st) == -1 || !S_ISREG(st.st_mode)) return 0;
+    return st.st_ino != r->st.st_ino || st.st_dev != r->st.st_dev ||
+        st.st_size != r->st.st_size || st.st_mtim.tv_sec != r->st.st_mtim.tv_sec ||
+        st.st_mtim.tv_nsec != r->st.st_mtim.tv_nsec;
+}
+
+/* Makes the rows the file on disk, editing only the rows that differ */
+void editorReload(void)
+{
+    if (!E.filename || E.hex.active || E.compress->format != COMPRESS_NONE ||
+            E.stream.fd != -1 || E.grep.active || E.filter.pid) {
+        editorSetStatusMessage("Nothing to reload");
+        return;
+    }
+    int fd = open(E.filename, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        editorSetStatusMessage("Can't reload %s: %s", E.filename, strerror(errno));
+        if (fd != -1) close(fd);
+        return;
+    }
+    TRACE_BEGIN("editorReload");
+    double start = editorNow();
+    char *buf = NULL;
+    if (st.st_size > 0) {
+        buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (buf == MAP_FAILED) die("mmap");
+    }
+    close(fd);
+    uint64_t *eol;
+    int nlines = editorIndexLines(buf, st.st_size, &eol);
+
+    /* Most of a file that changed a little is the same at both ends, that
+     * is compared directly. The rest is diffed by hashes, checked against
+     * the bytes where they match */
+    int pre = 0, suf = 0;
+    while (pre < E.numrows && pre < nlines && reloadSame(pre, buf, eol, pre)) pre++;
+    while (suf < E.numrows - pre && suf < nlines - pre &&
+            reloadSame(E.numrows - 1 - suf, buf, eol, nlines - 1 - suf)) suf++;
+
+    struct lineDiff d;
+    memset(&d, 0, sizeof(d));
+    int n = E.numrows - pre - suf, m = nlines - pre - suf;
+    if (n && m) {
+        size_t bytes = eol[nlines - suf - 1] - (pre ? eol[pre - 1] : 0);
+        uint64_t *ha = malloc(sizeof(uint64_t) * n), *hb = malloc(sizeof(uint64_t) * m);
+        int max = (n + m + 1) / 2 + 2;
+        int *v = malloc(sizeof(int) * (2 * max + 1) * 2);
+        if (!ha || !hb || !v) die("malloc");
+        reloadHash(NULL, NULL, pre, pre + n, bytes, ha);
+        reloadHash(buf, eol, pre, pre + m, bytes, hb);
+        d.ha = ha - pre;
+        d.hb = hb - pre;
+        d.buf = buf;
+        d.eol = eol;
+        d.v1 = v + max;
+        d.v2 = v + 3 * max + 1;
+        d.deadline = editorNow() + KILO_RELOAD_DIFF_US;
+        diffRange(&d, pre, n, pre, m);
+        free(ha);
+        free(hb);
+        free(v);
+    } else if (n || m) {
+        diffAdd(&d, pre, n, pre, m);
+    }
+
+    /* One undo group, not journaled: the file is what it will describe */
+    int changed = 0, i, j;
+    editorUndoBoundary(0);
+    E.journal.paused = 1;
+    for (i = d.nhunks - 1; i >= 0; --i) {
+        struct diffHunk *h = &d.hunks[i];
+        int common = h->n < h->m ? h->n : h->m;
+        for (j = 0; j < common; ++j) {
+            size_t len;
+            const char *s = reloadLine(buf, eol, h->b + j, &len);
+            reloadReplaceRow(&E.row[h->a + j], s, len);
+        }
+        if (h->n > common) editorDelRows(h->a + common, h->n - common);
+        else if (h->m > common) reloadInsert(h->a + common, buf, eol, h->b + common, h->m - common);
+        changed += h->n > h->m ? h->n : h->m;
+    }
+    E.journal.paused = 0;
+    editorJournalDiscard();
+
+    E.cy = reloadMapRow(d.hunks, d.nhunks, E.cy);
+    E.rowoff = reloadMapRow(d.hunks, d.nhunks, E.rowoff);
+    if (E.mark >= 0) E.mark = reloadMapRow(d.hunks, d.nhunks, E.mark);
+    editorMoveCursor(0);
+    editorUndoCursor();
+    editorUndoBoundary(0);
+
+    E.dirty = 0;
+    E.filesize = st.st_size;
+    editorReloadStamp();
+    free(d.hunks);
+    free(eol);
+    if (buf) munmap(buf, st.st_size);
+    TRACE_END("editorReload");
+
+    if (changed)
+        editorSetStatusMessage("Reloaded %s: %d lines changed in %d places (%.1f ms)",
+                E.filename, changed, d.nhunks, (editorNow() - start) / 1e3);
+    else
+        editorSetStatusMessage("%s is unchanged", E.filename);
+}
+
+void editorReloadEvent(int fd, void *data)
+{
+    (void)data;
+    struct editorReload *r = &E.reload;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int hit = 0;
+    ssize_t len;
+
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        char *p;
+        for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            if (ev->len && !strcmp(ev->name, r->name)) hit = 1;
+        }
+    }
+
+    /* Our own saves change the file too, they are already stamped */
+    if (!hit || !editorReloadChanged()) return;
+    if (E.dirty) {
+        editorSetStatusMessage("%s changed on disk, Ctrl-O to reload it (edits can be undone)", E.filename);
+    } else {
+        editorReload();
+    }
+}
+
+void editorReloadStop(void)
+{
+    struct editorReload *r = &E.reload;
+    if (r->inotify == -1) return;
+    editorWatchRemove(r->inotify);
+    close(r->inotify);
+    r->inotify = -1;
+    free(r->name);
+    r->name = NULL;
+}
+
+/* Starts watching the file for changes made by others */
+void editorReloadStart(void)
+{
+    struct editorReload *r = &E.reload;
+    if (!E.filename) return;
+    editorReloadStop();
+
+    char *slash = strrchr(E.filename, '/');
+    char *dir = slash ? strndup(E.filename, slash - E.filename + 1) : strdup(".");
+    if (!dir) die("strdup");
+    r->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (r->inotify == -1 || inotify_add_watch(r->inotify, dir, IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+        if (r->inotify != -1) close(r->inotify);
+        r->inotify = -1;
+        free(dir);
+        return;
+    }
+    free(dir);
+    r->name = strdup(slash ? slash + 1 : E.filename);
+    if (!r->name) die("strdup");
+    editorReloadStamp();
+    editorWatchAdd(r->inotify, POLLIN, editorReloadEvent, NULL);
+}
+
+/**********
+*  find  *
+**********/
+
+void editorFindCallback(char *query, int key)
+{
+    static int last_match = -1; /* line of last match, -1 if none */
+    static int direction = 1;   /* -1 = backward; 1 = forward */
+
+    static int saved_hl_line;
+    static char *saved_hl = NULL;
+
+    /*Restore previous highlight*/
+    if (saved_hl) {
+        memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
+        free(saved_hl);
+        saved_hl = NULL;
+    }
+
+    /*Leaving search mode*/
+    if (key == '\r' || key == '\x1b') {
+        last_match = -1;
+        direction = 1;
+        return;
+    } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+        direction = 1;
+    } else if (key == ARROW_UP || key == ARROW_LEFT) {
+        direction = -1;
+    } else {
+        last_match = -1;
+        direction = 1;
+    }
+
+    /*current is the index of the current row we are searching. If there was a last match,
+     * it starts on the line after (or before, if we’re searching backwards). If there 
+     * wasn’t a last match, it starts at the top of the file and searches in the forward 
+     * direction to find the first match.*/
+    if (last_match == -1) direction = 1;
+    int current = last_match;
+    /*Search in every row*/
+    int i;
+    for (i = 0; i < E.numrows; ++i) {
+        current += direction;
+        if (current == -1) current = E.numrows - 1;
+        else if (current == E.numrows) current = 0;
+
+        erow *row = &E.row[current];
+        /*strstr finds first ocurrence of substring in string*/
+        char *match = strstr(row->render, query);
+
+        if (match) {
+            last_match = current;
+            E.cy = current;
+            E.cx = editorRowRxToCx(row, editorRenderColumn(row, match - row->render));
+            /*Scroll to the end of the file, so when editorScroll() is called, 
+             * it will scroll upwards to the found sequence*/
+            E.rowoff = E.numrows;
+
+            /*Highlight result, saving previous hl*/
+            editorEnsureHighlight(row);
+            saved_hl_line = current;
+            saved_hl = malloc(row->rsize);
+            memcpy(saved_hl, row->hl, row->rsize);
+            memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
+            break;
+        }
+    }
+}
+
+void editorFind(void)
+{
+    int saved_cx = E.cx;
+    int saved_cy = E.cy;
+    int saved_rowof = E.rowoff;
+    int saved_coloff = E.coloff;
+
+    char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+
+    if (query)
+        free(query);
+    else {
+        /*Restore previous position*/
+        E.cx = saved_cx;
+        E.cy = saved_cy;
+        E.rowoff = saved_rowof;
+        E.coloff = saved_coloff;
+    }
+}
+
+/*************
+*  replace  *
+*************/
+
+/* A replace record holds the query and its replacement, then for every row
+ * it changes the index of the row, the number of matches and where they
+ * started before the replace, all as int32s:
+ *
+ *   qlen rlen query repl (row count off...)...
+ *
+ * Putting it back replaces the replacements, each moved by rlen - qlen for
+ * every match before it */
+struct replaceEdit {
+    const char *from, *to;      /* Text replaced and its replacement */
+    int fromlen, tolen;
+    int step;                   /* How far each match moved from its offset */
+    size_t off;                 /* First row of the record */
+};
+
+int32_t replaceInt(const char *p)
+{
+    int32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+void replacePutInt(struct lineBuffer *lb, int32_t v)
+{
+    lineBufferAppend(lb, (const char *)&v, sizeof(v));
+}
+
+void replaceHeader(struct lineBuffer *lb, const char *query, const char *repl)
+{
+    int qlen = strlen(query), rlen = strlen(repl);
+    replacePutInt(lb, qlen);
+    replacePutInt(lb, rlen);
+    lineBufferAppend(lb, query, qlen);
+    lineBufferAppend(lb, repl, rlen);
+}
+
+/* Reads the header of a record, applied as 'kind'. Returns 0 if malformed */
+int replaceParse(int kind, const char *s, size_t len, struct replaceEdit *re)
+{
+    if (len < 8) return 0;
+    int32_t qlen = replaceInt(s), rlen = replaceInt(s + 4);
+    if (qlen < 1 || rlen < 0 || (size_t)qlen + rlen > len - 8) return 0;
+
+    const char *query = s + 8, *repl = s + 8 + qlen;
+    if (kind == UNDO_REPLACE) {
+        re->from = query;
+        re->fromlen = qlen;
+        re->to = repl;
+        re->tolen = rlen;
+        re->step = 0;
+    } else {
+        re->from = repl;
+        re->fromlen = rlen;
+        re->to = query;
+        re->tolen = qlen;
+        re->step = rlen - qlen;
+    }
+    re->off = 8 + qlen + rlen;
+    return 1;
+}
+
+/* Finds 'q' in [p, end). Rows are short, so a vectorized memchr for the
+ * first byte beats the setup memmem does for every call */
+const char *replaceFind(const char *p, const char *end, const char *q, int qlen)
+{
+    while (end - p >= qlen && (p = memchr(p, q[0], end - p - qlen + 1))) {
+        if (memcmp(p + 1, q + 1, qlen - 1) == 0) return p;
+        p++;
+    }
+    return NULL;
+}
+
+/* Builds the text of a row with 'count' matches of 'fromlen' bytes replaced
+ * by 'to', in a single allocation. Match i starts at offs[i] + i * step */
+char *replaceBuild(erow *row, const char *offs, int count, int step, int fromlen,
+        const char *to, int tolen, int *size)
+{
+    int newsize = row->size + count * (tolen - fromlen);
+    char *buf = malloc(newsize + 1);
+    if (!buf) die("malloc");
+
+    int i, src = 0, dst = 0;
+    for (i = 0; i < count; ++i) {
+        int at = replaceInt(offs + i * 4) + i * step;
+        memcpy(&buf[dst], &row->chars[src], at - src);
+        dst += at - src;
+        memcpy(&buf[dst], to, tolen);
+        dst += tolen;
+        src = at + fromlen;
+    }
+    memcpy(&buf[dst], &row->chars[src], row->size - src);
+    buf[newsize] = '\0';
+    *size = newsize;
+    return buf;
+}
+
+/* Applies a replace record, or puts back what it replaced */
+void editorReplaceRows(int kind, int row, int nrows, const char *s, size_t len)
+{
+    struct replaceEdit re;
+    if (!replaceParse(kind, s, len, &re)) return;
+    editorUndoRecord(kind, row, 0, nrows, s, len);
+
+    size_t off = re.off;
+    while (off + 8 <= len) {
+        erow *r = &E.row[replaceInt(s + off)];
+        int count = replaceInt(s + off + 4);
+        int size;
+        char *chars = replaceBuild(r, s + off + 8, count, re.step, re.fromlen,
+                re.to, re.tolen, &size);
+        free(r->chars);
+        r->chars = chars;
+        r->size = size;
+        editorUpdateRow(r);
+        off += 8 + (size_t)count * 4;
+    }
+    E.dirty++;
+}
+
+/* Whether a replace record read back from a journal fits the rows: every
+ * match must still be there */
+int editorReplaceValid(int kind, const char *s, size_t len)
+{
+    struct replaceEdit re;
+    if (!replaceParse(kind, s, len, &re)) return 0;
+
+    size_t off = re.off;
+    int last = -1;
+    while (off < len) {
+        if (len - off < 8) return 0;
+        int row = replaceInt(s + off), count = replaceInt(s + off + 4);
+        if (row <= last || row >= E.numrows || count < 1 ||
+                (size_t)count > (len - off - 8) / 4) return 0;
+
+        erow *r = &E.row[row];
+        long end = 0;
+        int i;
+        for (i = 0; i < count; ++i) {
+            long at = (long)replaceInt(s + off + 8 + i * 4) + (long)i * re.step;
+            if (at < end || at + re.fromlen > r->size ||
+                    memcmp(&r->chars[at], re.from, re.fromlen)) return 0;
+            end = at + re.fromlen;
+        }
+        last = row;
+        off += 8 + (size_t)count * 4;
+    }
+    return 1;
+}
+
+/* A slice of the rows searched by one replace thread */
+struct replaceChunk {
+    const char *query, *repl;
+    int qlen, rlen;
+    int from, to;               /* Rows searched */
+    struct lineBuffer matches;  /* Rows that change, laid out as in the record */
+    erow *rows;                 /* and their new text */
+    int nrows, cap;
+    long count;
+};
+
+/* Thread body: finds the matches of every row of the chunk and builds the
+ * rows that change on the side, leaving the rows themselves alone */
+void *replaceScanChunk(void *arg)
+{
+    struct replaceChunk *c = arg;
+    int j;
+    TRACE_BEGIN("replaceScanChunk");
+    for (j = c->from; j < c->to; ++j) {
+        erow *row = &E.row[j];
+        const char *p = row->chars, *end = row->chars + row->size;
+        size_t head = c->matches.len;
+        int count = 0;
+
+        while ((p = replaceFind(p, end, c->query, c->qlen))) {
+            if (count++ == 0) {
+                replacePutInt(&c->matches, j);
+                replacePutInt(&c->matches, 0);
+            }
+            replacePutInt(&c->matches, p - row->chars);
+            p += c->qlen;
+        }
+        if (count == 0) continue;
+        memcpy(&c->matches.b[head + 4], &count, sizeof(count));
+
+        if (c->nrows == c->cap) {
+            c->cap = c->cap ? c->cap * 2 : 256;
+            c->rows = realloc(c->rows, sizeof(erow) * c->cap);
+            if (!c->rows) die("realloc");
+        }
+        erow *nr = &c->rows[c->nrows++];
+        memset(nr, 0, sizeof(*nr));
+        nr->idx = j;
+        nr->chars = replaceBuild(row, &c->matches.b[head + 8], count, 0, c->qlen,
+                c->repl, c->rlen, &nr->size);
+        editorUpdateRender(nr);
+        /* Without syntax highlighting rows are independent, so also do it here */
+        if (E.syntax == NULL) editorHighlightRow(nr);
+        c->count += count;
+    }
+    TRACE_END("replaceScanChunk");
+    return NULL;
+}
+
+/* Replaces every match in the 'n' rows from 'first'. One thread per core
+ * searches a slice of the rows and builds the new ones, which are then
+ * swapped in here, so only the rows that change are rendered and relexed.
+ * It is recorded as a single edit. Returns the number of matches */
+long editorReplaceAll(const char *query, const char *repl, int first, int n)
+{
+    struct replaceChunk chunks[KILO_MAX_THREADS];
+    pthread_t threads[KILO_MAX_THREADS];
+    size_t bytes = 0;
+    int i, j;
+
+    if (n <= 0) return 0;
+    for (j = first; j < first + n; ++j) bytes += E.row[j].size;
+    int nchunks = editorLoaderThreads(bytes);
+    if (nchunks > n) nchunks = n;
+    TRACE_BEGIN("editorReplaceAll");
+
+    for (i = 0; i < nchunks; ++i) {
+        memset(&chunks[i], 0, sizeof(chunks[i]));
+        chunks[i].query = query;
+        chunks[i].repl = repl;
+        chunks[i].qlen = strlen(query);
+        chunks[i].rlen = strlen(repl);
+        chunks[i].from = first + n / nchunks * i;
+        chunks[i].to = (i == nchunks - 1) ? first + n : first + n / nchunks * (i + 1);
+    }
+    for (i = 1; i < nchunks; ++i)
+        if (pthread_create(&threads[i], NULL, replaceScanChunk, &chunks[i]) != 0) die("pthread_create");
+    replaceScanChunk(&chunks[0]);
+    for (i = 1; i < nchunks; ++i) pthread_join(threads[i], NULL);
+
+    /* Stitch the matches of the chunks into a single record */
+    struct lineBuffer rec = { NULL, 0, 0 };
+    long count = 0;
+    int changed = 0, firstrow = -1;
+    size_t total = 0;
+    for (i = 0; i < nchunks; ++i) {
+        count += chunks[i].count;
+        changed += chunks[i].nrows;
+        total += chunks[i].matches.len;
+        if (firstrow == -1 && chunks[i].nrows) firstrow = chunks[i].rows[0].idx;
+    }
+    if (count) {
+        replaceHeader(&rec, query, repl);
+        rec.cap = rec.len + total;
+        rec.b = realloc(rec.b, rec.cap);
+        if (!rec.b) die("realloc");
+        for (i = 0; i < nchunks; ++i)
+            lineBufferAppend(&rec, chunks[i].matches.b, chunks[i].matches.len);
+        editorUndoRecord(UNDO_REPLACE, firstrow, 0, changed, rec.b, rec.len);
+        free(rec.b);
+    }
+
+    for (i = 0; i < nchunks; ++i) {
+        for (j = 0; j < chunks[i].nrows; ++j) {
+            erow *nr = &chunks[i].rows[j];
+            erow *row = &E.row[nr->idx];
+            free(row->chars);
+            free(row->render);
+            free(row->cols);
+            row->chars = nr->chars;
+            row->size = nr->size;
+            row->render = nr->render;
+            row->rsize = nr->rsize;
+            row->rwidth = nr->rwidth;
+            row->cols = nr->cols;
+            if (nr->hl) {
+                free(row->hl);
+                free(row->brblock);
+                row->hl = nr->hl;
+                row->br = nr->br;
+                row->brblock = nr->brblock;
+            }
+            editorIndexUpdateRow(row);
+            if (E.syntax) editorUpdateSyntax(row);
+        }
+        free(chunks[i].rows);
+        free(chunks[i].matches.b);
+    }
+    if (count) E.dirty++;
+    if (E.cy < E.numrows && E.cx > E.row[E.cy].size) E.cx = E.row[E.cy].size;
+    TRACE_END_ARG("editorReplaceAll", changed);
+    return count;
+}
+
+/* Replaces the matches in the row from 'at' on, at most 'max' of them, as
+ * one record. Returns how many were replaced */
+int editorReplaceInRow(int cy, int at, const char *query, const char *repl, int max)
+{
+    erow *row = &E.row[cy];
+    struct lineBuffer rec = { NULL, 0, 0 };
+    int qlen = strlen(query), count = 0;
+
+    replaceHeader(&rec, query, repl);
+    size_t head = rec.len;
+    replacePutInt(&rec, cy);
+    replacePutInt(&rec, 0);
+    const char *p = &row->chars[at], *end = row->chars + row->size;
+    while (count < max && (p = replaceFind(p, end, query, qlen))) {
+        replacePutInt(&rec, p - row->chars);
+        p += qlen;
+        count++;
+    }
+    if (count) {
+        memcpy(&rec.b[head + 4], &count, sizeof(count));
+        editorReplaceRows(UNDO_REPLACE, cy, 1, rec.b, rec.len);
+    }
+    free(rec.b);
+    return count;
+}
+
+/* Highlights the match of 'len' chars at 'at' in row 'cy' and asks what to
+ * do with it */
+int editorReplaceAsk(int cy, int at, int len)
+{
+    erow *row = &E.row[cy];
+    int rx = editorRowCxToOffset(row, at);
+    int rlen = editorRowCxToOffset(row, at + len) - rx;
+    editorEnsureHighlight(row);
+    char *saved = malloc(row->rsize);
+    if (!saved) die("malloc");
+    memcpy(saved, row->hl, row->rsize);
+    memset(&row->hl[rx], HL_MATCH, rlen);
+
+    int c;
+    editorSetStatusMessage("Replace? (y)es (n)o (a)ll the rest (q)uit");
+    do {
+        editorRefreshScreen();
+        c = editorReadKey();
+    } while (c != 'y' && c != 'n' && c != 'a' && c != 'q' && c != '\x1b');
+
+    /* Rows may have been appended meanwhile, E.row can have moved */
+    row = &E.row[cy];
+    memcpy(row->hl, saved, row->rsize);
+    free(saved);
+    return c;
+}
+
+/* Asks for a query and its replacement. With lines selected every match in
+ * them is replaced at once. Otherwise it goes through the matches from the
+ * cursor on: y replaces one, n skips it, a replaces it and all the rest,
+ * q or ESC stops. It all undoes as one change */
+void editorReplace(void)
+{
+    char *query = editorPrompt("Replace: %s (ESC to cancel)", NULL);
+    if (!query) return;
+    char *repl = editorPrompt("Replace with: %s (ESC to cancel)", NULL);
+    if (!repl) {
+        free(query);
+        return;
+    }
+
+    int qlen = strlen(query), rlen = strlen(repl);
+    long count = 0;
+    int first, n;
+    if (E.mark >= 0 && (n = editorSelection(&first))) {
+        count = editorReplaceAll(query, repl, first, n);
+        E.mark = -1;
+    } else {
+        int cy = E.cy, cx = E.cx;
+        while (cy < E.numrows) {
+            erow *row = &E.row[cy];
+            const char *p = (cx <= row->size) ?
+                replaceFind(&row->chars[cx], row->chars + row->size, query, qlen) : NULL;
+            if (!p) {
+                cy++;
+                cx = 0;
+                continue;
+            }
+
+            int at = p - row->chars;
+            E.cy = cy;
+            E.cx = at;
+            int c = editorReplaceAsk(cy, at, qlen);
+            if (c == 'y') {
+                count += editorReplaceInRow(cy, at, query, repl, 1);
+                cx = at + rlen;
+            } else if (c == 'n') {
+                cx = at + qlen;
+            } else if (c == 'a') {
+                count += editorReplaceInRow(cy, at, query, repl, INT_MAX);
+                count += editorReplaceAll(query, repl, cy + 1, E.numrows - cy - 1);
+                break;
+            } else {
+                break;
+            }
+        }
+    }
+
+    editorSetStatusMessage("%ld replaced", count);
+    free(query);
+    free(repl);
+}
+
+/*************
+*  filters  *
+*************/
+
+/* Closes one end of the pipes to the command, and stops watching it */
+void filterClose(int *fd)
+{
+    if (*fd == -1) return;
+    editorWatchRemove(*fd);
+    close(*fd);
+    *fd = -1;
+}
+
+/* Inserts 'lines' rows of output, separated by '\n', after the range and
+ * the output before them. The cursor stays on the row it was on */
+void filterInsert(const char *s, size_t len, int lines)
+{
+    struct editorFilter *f = &E.filter;
+    int at = f->first + f->n + f->got;
+    editorInsertRows(at, s, len, lines);
+    f->got += lines;
+    if (E.cy >= at) E.cy += lines;
+}
+
+/* Deletes rows, moving the cursor to the first row after them if it was on
+ * one of them */
+void filterDelete(int at, int n)
+{
+    if (n <= 0) return;
+    editorDelRows(at, n);
+    if (E.cy >= at + n) {
+        E.cy -= n;
+    } else if (E.cy >= at) {
+        E.cy = at;
+        E.cx = 0;
+    }
+}
+
+/* Writes as many rows as the pipe takes, straight from their chars */
+void editorFilterWrite(int fd, void *data)
+{
+    (void)data;
+    struct editorFilter *f = &E.filter;
+    struct iovec iov[KILO_FILTER_IOV];
+    size_t budget = 0;
+
+    while (f->sent < f->n && budget < KILO_STREAM_BUDGET) {
+        int niov = 0, j;
+        size_t off = f->sentoff;
+        for (j = f->sent; j < f->n && niov < KILO_FILTER_IOV - 1; ++j) {
+            erow *row = &E.row[f->first + j];
+            if (off < (size_t)row->size) {
+                iov[niov].iov_base = row->chars + off;
+                iov[niov++].iov_len = row->size - off;
+            }
+            iov[niov].iov_base = "\n";
+            iov[niov++].iov_len = 1;
+            off = 0;
+        }
+
+        E.stats.syscalls++;
+        ssize_t w = writev(fd, iov, niov);
+        if (w == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) return;
+            /* EPIPE, the command quit without reading all of it */
+            filterClose(&f->in);
+            return;
+        }
+        budget += w;
+        while (w > 0) {
+            size_t left = E.row[f->first + f->sent].size + 1 - f->sentoff;
+            if ((size_t)w < left) {
+                f->sentoff += w;
+                break;
+            }
+            w -= left;
+            f->sent++;
+            f->sentoff = 0;
+        }
+    }
+    if (f->sent == f->n) filterClose(&f->in);
+}
+
+/* Keeps the first line the command writes to stderr, for the status bar */
+void editorFilterError(int fd, void *data)
+{
+    (void)data;
+    struct editorFilter *f = &E.filter;
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        char *nl = memchr(buf, '\n', n);
+        int room = sizeof(f->errmsg) - 1 - f->errlen;
+        int len = nl ? nl - buf : n;
+        if (len > room) len = room;
+        memcpy(f->errmsg + f->errlen, buf, len);
+        f->errlen += len;
+        f->errmsg[f->errlen] = '\0';
+        /* Nothing more is kept after the first newline */
+        if (nl) f->errlen = sizeof(f->errmsg) - 1;
+    }
+    if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) filterClose(&f->err);
+}
+
+/* Waits for the command and closes what is left of its pipes. Returns its
+ * exit status, -1 if it didn't exit */
+int filterReap(void)
+{
+    struct editorFilter *f = &E.filter;
+    int status;
+    filterClose(&f->in);
+    filterClose(&f->out);
+    while (waitpid(f->pid, &status, 0) == -1 && errno == EINTR);
+    /* It is gone, what it wrote to stderr is all in the pipe by now */
+    if (f->err != -1) editorFilterError(f->err, NULL);
+    filterClose(&f->err);
+    f->pid = 0;
+    f->partial.len = 0;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/* The output ended: the range is replaced by it, or left alone if the
+ * command failed */
+void editorFilterFinish(void)
+{
+    struct editorFilter *f = &E.filter;
+    if (f->partial.len) filterInsert(f->partial.b, f->partial.len, 1);
+
+    int status = filterReap();
+    if (status == 0) {
+        filterDelete(f->first, f->n);
+        editorSetStatusMessage("%d lines filtered through '%s', %d lines out", f->n, f->cmd, f->got);
+    } else {
+        filterDelete(f->first + f->n, f->got);
+        const char *sep = f->errlen ? ": " : "";
+        if (status == -1)
+            editorSetStatusMessage("'%s' was killed%s%s", f->cmd, sep, f->errmsg);
+        else
+            editorSetStatusMessage("'%s' exited with %d%s%s", f->cmd, status, sep, f->errmsg);
+    }
+    free(f->cmd);
+    f->cmd = NULL;
+}
+
+/* Turns what the command wrote into rows. Unlike editorStreamRead, a single
+ * chunk is read a call: short lines make many rows out of few bytes, and
+ * each of them is inserted before the rest of the file, so the screen and
+ * the keyboard are served between chunks */
+void editorFilterRead(int fd, void *data)
+{
+    (void)data;
+    struct editorFilter *f = &E.filter;
+    static char *buf = NULL;
+    if (!buf && !(buf = malloc(KILO_READ_CHUNK))) die("malloc");
+
+    ssize_t n = read(fd, buf, KILO_READ_CHUNK);
+    if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+        editorFilterFinish();
+        return;
+    }
+    if (n == -1) return;
+
+    TRACE_BEGIN("editorFilterRead");
+    /* Complete lines go in with one insert, the last one may not be */
+    const char *p = buf, *end = buf + n, *last = NULL, *nl;
+    int lines = 0;
+    while ((nl = memchr(p, '\n', end - p))) {
+        lines++;
+        last = nl;
+        p = nl + 1;
+    }
+    if (!last) {
+        lineBufferAppend(&f->partial, buf, n);
+    } else {
+        if (f->partial.len) {
+            lineBufferAppend(&f->partial, buf, last - buf);
+            filterInsert(f->partial.b, f->partial.len, lines);
+        } else {
+            filterInsert(buf, last - buf, lines);
+        }
+        f->partial.len = 0;
+        lineBufferAppend(&f->partial, last + 1, end - last - 1);
+    }
+    TRACE_END("editorFilterRead");
+}
+
+/* Kills the command and drops the output it sent so far */
+void editorFilterStop(void)
+{
+    struct editorFilter *f = &E.filter;
+    if (!f->pid) return;
+    kill(f->pid, SIGTERM);
+    filterReap();
+    filterDelete(f->first + f->n, f->got);
+    free(f->cmd);
+    f->cmd = NULL;
+}
+
+/* Starts piping rows [first, first + n) through 'cmd', run by sh */
+void editorFilterStart(const char *cmd, int first, int n)
+{
+    struct editorFilter *f = &E.filter;
+    int in[2], out[2], err[2];
+    if (pipe2(in, O_CLOEXEC) == -1) die("pipe2");
+    if (pipe2(out, O_CLOEXEC) == -1) die("pipe2");
+    if (pipe2(err, O_CLOEXEC) == -1) die("pipe2");
+
+    pid_t pid = fork();
+    if (pid == -1) die("fork");
+    if (pid == 0) {
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        dup2(err[1], STDERR_FILENO);
+        signal(SIGPIPE, SIG_DFL);
+        execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    close(err[1]);
+
+    f->pid = pid;
+    f->cmd = strdup(cmd);
+    f->in = in[1];
+    f->out = out[0];
+    f->err = err[0];
+    f->first = first;
+    f->n = n;
+    f->sent = f->got = 0;
+    f->sentoff = 0;
+    f->partial.len = 0;
+    f->errmsg[0] = '\0';
+    f->errlen = 0;
+
+    /* A bigger pipe is only a hint, big ranges then take fewer wakeups */
+    fcntl(f->in, F_SETPIPE_SZ, KILO_PIPE_SIZE);
+    fcntl(f->out, F_SETPIPE_SZ, KILO_PIPE_SIZE);
+    fcntl(f->in, F_SETFL, O_NONBLOCK);
+    fcntl(f->out, F_SETFL, O_NONBLOCK);
+    fcntl(f->err, F_SETFL, O_NONBLOCK);
+    editorWatchAdd(f->in, POLLOUT, editorFilterWrite, NULL);
+    editorWatchAdd(f->out, POLLIN, editorFilterRead, NULL);
+    editorWatchAdd(f->err, POLLIN, editorFilterError, NULL);
+    editorSetStatusMessage("Filtering %d lines through '%s', ESC to stop", n, cmd);
+
+    /* A replay never waits for the keyboard, so nothing serves the watches
+     * there: the command is run to the end right away */
+    while (E.replay.script && f->pid) {
+        struct pollfd fds[3];
+        void (*callbacks[3])(int, void *);
+        int nfds = 0, j;
+        if (f->in != -1) {
+            fds[nfds] = (struct pollfd){ f->in, POLLOUT, 0 };
+            callbacks[nfds++] = editorFilterWrite;
+        }
+        if (f->err != -1) {
+            fds[nfds] = (struct pollfd){ f->err, POLLIN, 0 };
+            callbacks[nfds++] = editorFilterError;
+        }
+        fds[nfds] = (struct pollfd){ f->out, POLLIN, 0 };
+        callbacks[nfds++] = editorFilterRead;
+        if (poll(fds, nfds, -1) == -1 && errno != EINTR) die("poll");
+        for (j = 0; j < nfds && f->pid; ++j)
+            if (fds[j].revents) callbacks[j](fds[j].fd, NULL);
+    }
+}
+
+/* While a command runs its range can't change, nor can what is undone with
+ * it. Returns 1 if the key was taken */
+int editorFilterKey(int c)
+{
+    switch (c) {
+        case ARROW_UP:
+        case ARROW_DOWN:
+        case ARROW_LEFT:
+        case ARROW_RIGHT:
+        case PAGE_UP:
+        case PAGE_DOWN:
+        case HOME_KEY:
+        case END_KEY:
+        case CTRL_KEY('q'):
+        case CTRL_KEY('t'):
+        case CTRL_KEY('g'):
+        case CTRL_KEY('w'):
+        case CTRL_KEY('k'):
+        case CTRL_KEY('l'):
+        case CTRL_KEY('n'):
+        case CTRL_KEY('a'):
+            return 0;
+        case '\x1b':
+            editorFilterStop();
+            editorSetStatusMessage("Filter stopped");
+            return 1;
+        default:
+            editorSetStatusMessage("Filtering through '%s', ESC to stop", E.filter.cmd);
+            return 1;
+    }
+}
+
+/*****************
+*  sort lines  *
+*****************/
+
+/* Sort and uniq of the selected rows, or of all of them. Rows are sorted as
+ * an array of indices, so their text is never copied, and then moved into
+ * place as one permutation of the row structs. The rows uniq drops are
+ * deleted in a single pass, as a sparse record: for every row, its index,
+ * its length and its text */
+struct sortSpec {
+    int numeric, reverse, unique;
+    int key;                    /* Field sorted on, from 1, 0 for the whole row */
+    int first;                  /* First row sorted */
+    int32_t *keyoff;            /* Where the key of every row starts */
+    double *num;                /* and its value, when numeric */
+};
+
+/* Where field 'key' of the row starts, fields being separated by blanks */
+int sortKeyOffset(erow *row, int key)
+{
+    int i = 0;
+    while (1) {
+        while (i < row->size && isblank((unsigned char)row->chars[i])) i++;
+        if (--key == 0 || i == row->size) return i;
+        while (i < row->size && !isblank((unsigned char)row->chars[i])) i++;
+    }
+}
+
+/* Compares rows first + a and first + b */
+int sortCompare(struct sortSpec *s, int32_t a, int32_t b)
+{
+    int c;
+    if (s->numeric) {
+        c = (s->num[a] > s->num[b]) - (s->num[a] < s->num[b]);
+    } else {
+        erow *ra = &E.row[s->first + a], *rb = &E.row[s->first + b];
+        int oa = s->keyoff ? s->keyoff[a] : 0, ob = s->keyoff ? s->keyoff[b] : 0;
+        int la = ra->size - oa, lb = rb->size - ob;
+        c = memcmp(&ra->chars[oa], &rb->chars[ob], la < lb ? la : lb);
+        if (c == 0) c = (la > lb) - (la < lb);
+    }
+    return s->reverse ? -c : c;
+}
+
+/* What is sorted: a row and the first 8 bytes of its key, big endian, or
+ * its value with the bits flipped, so that both compare as integers. Most
+ * comparisons are decided by the prefix alone, without touching the rows */
+struct sortItem {
+    uint64_t prefix;
+    int32_t row;
+};
+
+uint64_t sortPrefix(struct sortSpec *s, int32_t k)
+{
+    if (s->numeric) {
+        uint64_t u;
+        memcpy(&u, &s->num[k], sizeof(u));
+        return (u >> 63) ? ~u : u | (1ULL << 63);
+    }
+    erow *row = &E.row[s->first + k];
+    int off = s->keyoff ? s->keyoff[k] : 0, i;
+    uint64_t p = 0;
+    for (i = 0; i < 8; ++i)
+        p = p << 8 | (off + i < row->size ? (unsigned char)row->chars[off + i] : 0);
+    return p;
+}
+
+int sortItemCompare(struct sortSpec *s, const struct sortItem *x, const struct sortItem *y)
+{
+    if (x->prefix == y->prefix) return sortCompare(s, x->row, y->row);
+    int c = (x->prefix < y->prefix) ? -1 : 1;
+    return s->reverse ? -c : c;
+}
+
+/* A part of the array sorted by one thread */
+struct sortJob {
+    struct sortSpec *spec;
+    struct sortItem *a, *tmp;
+    size_t n;
+    int threads;                /* Threads it may use */
+};
+
+/* Thread body: stable merge sort, handing one half to a new thread while
+ * there are threads to spare */
+void *sortRange(void *arg)
+{
+    struct sortJob *j = arg;
+    struct sortSpec *s = j->spec;
+    struct sortItem *a = j->a, *t = j->tmp;
+    size_t n = j->n, i, k;
+
+    if (n <= 16) {
+        for (i = 1; i < n; ++i) {
+            struct sortItem v = a[i];
+            for (k = i; k > 0 && sortItemCompare(s, &a[k - 1], &v) > 0; --k) a[k] = a[k - 1];
+            a[k] = v;
+        }
+        return NULL;
+    }
+
+    size_t mid = n / 2;
+    struct sortJob left = { s, a, t, mid, j->threads / 2 };
+    struct sortJob right = { s, a + mid, t + mid / 2, n - mid, j->threads - j->threads / 2 };
+    if (left.threads > 0) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, sortRange, &left) != 0) die("pthread_create");
+        sortRange(&right);
+        pthread_join(thread, NULL);
+    } else {
+        left.threads = 1;
+        sortRange(&left);
+        sortRange(&right);
+    }
+
+    /* Merge the halves through a copy of the left one, unless they are
+     * already in order. So 't' needs half as many items as 'a' */
+    if (sortItemCompare(s, &a[mid - 1], &a[mid]) <= 0) return NULL;
+    memcpy(t, a, sizeof(*a) * mid);
+    size_t l = 0, r = mid, o = 0;
+    while (l < mid && r < n) a[o++] = (sortItemCompare(s, &a[r], &t[l]) < 0) ? a[r++] : t[l++];
+    while (l < mid) a[o++] = t[l++];
+    return NULL;
+}
+
+/* Relexes rows that now follow different ones. While none of them, nor the
+ * row before, leaves a multiline comment open, every row still starts
+ * outside of one and keeps its highlighting */
+void editorRelexRows(int first, int n)
+{
+    if (E.syntax == NULL || n <= 0) return;
+    int j, open = 0;
+    for (j = first ? first - 1 : 0; j < first + n && !open; ++j) open = E.row[j].hl_open_comment;
+    if (!open) return;
+    for (j = first; j < first + n - 1; ++j) editorHighlightRow(&E.row[j]);
+    editorUpdateSyntax(&E.row[first + n - 1]);
+}
+
+/* Reorders the 'n' rows from 'first' so that row k is the one that was at
+ * first + perm[k], or puts them back. Follows the cycles of the permutation,
+ * moving every row struct once */
+void editorPermuteRows(int kind, int first, int n, const char *s, size_t len)
+{
+    if (first < 0 || n <= 0 || first + n > E.numrows || len != (size_t)n * 4) return;
+    editorUndoRecord(kind, first, 0, n, s, len);
+
+    int32_t *p = malloc(sizeof(int32_t) * n);
+    if (!p) die("malloc");
+    int k;
+    if (kind == UNDO_PERMUTE_ROWS) {
+        memcpy(p, s, len);
+    } else {
+        for (k = 0; k < n; ++k) p[replaceInt(s + k * 4)] = k;
+    }
+
+    erow *rows = &E.row[first];
+    for (k = 0; k < n; ++k) {
+        if (p[k] < 0) continue;
+        erow t = rows[k];
+        int j = k;
+        while (p[j] != k) {
+            int next = p[j];
+            rows[j] = rows[next];
+            p[j] = -1;
+            j = next;
+        }
+        rows[j] = t;
+        p[j] = -1;
+    }
+    free(p);
+
+    for (k = 0; k < n; ++k) rows[k].idx = first + k;
+    editorIndexSplice(first, n, n);
+    editorRelexRows(first, n);
+    E.dirty++;
+}
+
+/* Deletes the rows of a sparse record, or inserts them back, in a single
+ * pass over the rows from 'row', the first of them, on */
+void editorSparseRows(int kind, int row, int nrows, const char *s, size_t len)
+{
+    if (nrows <= 0) return;
+    editorUndoRecord(kind, row, 0, nrows, s, len);
+
+    size_t *ent = malloc(sizeof(size_t) * nrows), off = 0;
+    if (!ent) die("malloc");
+    int k;
+    for (k = 0; k < nrows; ++k) {
+        ent[k] = off;
+        off += 8 + replaceInt(s + off + 4);
+    }
+    /* Every row from 'row' on moves, their nodes are built again */
+    int old = E.numrows;
+
+    if (kind == UNDO_DELETE_SPARSE) {
+        int src, dst = row;
+        k = 0;
+        for (src = row; src < E.numrows; ++src) {
+            if (k < nrows && src == replaceInt(s + ent[k])) {
+                editorFreeRow(&E.row[src]);
+                k++;
+                continue;
+            }
+            E.row[dst] = E.row[src];
+            E.row[dst].idx = dst;
+            dst++;
+        }
+        E.numrows = dst;
+        editorIndexSplice(row, old - row, E.numrows - row);
+        /* The rows after the gaps follow different ones */
+        for (k = 0; k < nrows; ++k) {
+            int at = replaceInt(s + ent[k]) - k;
+            if (at < E.numrows) editorUpdateSyntax(&E.row[at]);
+        }
+    } else {
+        editorReserveRows(nrows);
+        int src = E.numrows - 1, dst = E.numrows + nrows - 1;
+        for (k = nrows - 1; k >= 0; --k) {
+            int at = replaceInt(s + ent[k]), l = replaceInt(s + ent[k] + 4);
+            for (; dst > at; --dst) {
+                E.row[dst] = E.row[src--];
+                E.row[dst].idx = dst;
+            }
+            erow *r = &E.row[dst--];
+            r->idx = at;
+            r->size = l;
+            r->chars = malloc(l + 1);
+            if (!r->chars) die("malloc");
+            memcpy(r->chars, s + ent[k] + 8, l);
+            r->chars[l] = '\0';
+            r->rsize = 0;
+            r->render = NULL;
+            r->cols = NULL;
+            r->hl = NULL;
+            r->brblock = NULL;
+            r->hl_open_comment = 0;
+            editorUpdateRender(r);
+        }
+        E.numrows += nrows;
+        editorIndexSplice(row, old - row, E.numrows - row);
+        for (k = 0; k < nrows; ++k) {
+            int at = replaceInt(s + ent[k]);
+            editorUpdateSyntax(&E.row[at]);
+            if (at + 1 < E.numrows) editorUpdateSyntax(&E.row[at + 1]);
+        }
+    }
+    free(ent);
+    E.dirty++;
+}
+
+/* Whether a permutation or a sparse record read back from a journal fits
+ * the rows */
+int editorSortValid(int kind, int row, int nrows, const char *s, size_t len)
+{
+    int k;
+    if (kind == UNDO_PERMUTE_ROWS || kind == UNDO_PERMUTE_ROWS_BACK) {
+        if (row + nrows > E.numrows || len != (size_t)nrows * 4) return 0;
+        unsigned char *seen = calloc(nrows, 1);
+        if (!seen) die("calloc");
+        for (k = 0; k < nrows; ++k) {
+            int32_t p = replaceInt(s + k * 4);
+            if (p < 0 || p >= nrows || seen[p]) break;
+            seen[p] = 1;
+        }
+        free(seen);
+        return k == nrows;
+    }
+
+    size_t off = 0;
+    int last = -1;
+    for (k = 0; k < nrows; ++k) {
+        if (len - off < 8) return 0;
+        int at = replaceInt(s + off), l = replaceInt(s + off + 4);
+        int limit = (kind == UNDO_DELETE_SPARSE) ? E.numrows - 1 : E.numrows + k;
+        if (at <= last || at > limit || (k == 0 && at != row) ||
+                l < 0 || (size_t)l > len - off - 8) return 0;
+        last = at;
+        off += 8 + l;
+    }
+    return off == len;
+}
+
+/* Lists the rows of the range equal to the one kept before them as a sparse
+ * record: whole rows, or keys after a sort, with 'perm' the order the rows
+ * will be in. Returns how many */
+int editorUniqRecord(struct lineBuffer *rec, int first, int n, struct sortSpec *spec,
+        const int32_t *perm)
+{
+    int j, last = 0, count = 0;
+    for (j = 1; j < n; ++j) {
+        int a = perm ? perm[last] : last, b = perm ? perm[j] : j;
+        erow *ra = &E.row[first + a], *rb = &E.row[first + b];
+        int same = spec ? sortCompare(spec, a, b) == 0 :
+            (ra->size == rb->size && memcmp(ra->chars, rb->chars, ra->size) == 0);
+        if (!same) {
+            last = j;
+            continue;
+        }
+        replacePutInt(rec, first + j);
+        replacePutInt(rec, rb->size);
+        lineBufferAppend(rec, rb->chars, rb->size);
+        count++;
+    }
+    return count;
+}
+
+/* Sorts the 'n' rows from 'first' and, with 'unique', drops the rows whose
+ * key equals the one before. Returns the rows dropped */
+int editorSortRows(int first, int n, struct sortSpec *spec)
+{
+    if (n < 2) return 0;
+    TRACE_BEGIN("editorSortRows");
+
+    size_t bytes = 0;
+    int k;
+    for (k = 0; k < n; ++k) bytes += E.row[first + k].size;
+    spec->first = first;
+    if (spec->key) {
+        spec->keyoff = malloc(sizeof(int32_t) * n);
+        if (!spec->keyoff) die("malloc");
+        for (k = 0; k < n; ++k) spec->keyoff[k] = sortKeyOffset(&E.row[first + k], spec->key);
+    }
+    if (spec->numeric) {
+        spec->num = malloc(sizeof(double) * n);
+        if (!spec->num) die("malloc");
+        for (k = 0; k < n; ++k) {
+            erow *row = &E.row[first + k];
+            spec->num[k] = strtod(&row->chars[spec->keyoff ? spec->keyoff[k] : 0], NULL);
+        }
+    }
+
+    struct sortItem *items = malloc(sizeof(*items) * n), *tmp = malloc(sizeof(*tmp) * (n / 2));
+    if (!items || !tmp) die("malloc");
+    for (k = 0; k < n; ++k) {
+        items[k].prefix = sortPrefix(spec, k);
+        items[k].row = k;
+    }
+    struct sortJob job = { spec, items, tmp, n, editorLoaderThreads(bytes) };
+    sortRange(&job);
+    free(tmp);
+
+    /* The order the rows end up in, reusing the array */
+    int32_t *perm = (int32_t *)items;
+    for (k = 0; k < n; ++k) perm[k] = items[k].row;
+
+    /* The rows uniq drops are listed before they move */
+    struct lineBuffer rec = { NULL, 0, 0 };
+    int dropped = spec->unique ? editorUniqRecord(&rec, first, n, spec, perm) : 0;
+
+    for (k = 0; k < n && perm[k] == k; ++k);
+    if (k < n) editorPermuteRows(UNDO_PERMUTE_ROWS, first, n, (char *)perm, sizeof(int32_t) * n);
+    if (dropped) editorSparseRows(UNDO_DELETE_SPARSE, replaceInt(rec.b), dropped, rec.b, rec.len);
+
+    free(rec.b);
+    free(perm);
+    free(spec->keyoff);
+    free(spec->num);
+    TRACE_END_ARG("editorSortRows", n);
+    return dropped;
+}
+
+/* Drops the rows equal to the one before among the 'n' from 'first'.
+ * Returns how many */
+int editorUniqRows(int first, int n)
+{
+    struct lineBuffer rec = { NULL, 0, 0 };
+    int dropped = editorUniqRecord(&rec, first, n, NULL, NULL);
+    if (dropped) editorSparseRows(UNDO_DELETE_SPARSE, replaceInt(rec.b), dropped, rec.b, rec.len);
+    free(rec.b);
+    return dropped;
+}
+
+/* Runs a line command on the selected rows, or on all of them:
+ *
+ *   sort [-n] [-r] [-u] [-k N]   sort numerically, in reverse, dropping rows
+ *                                with equal keys, on the fields from N on
+ *   uniq                         drop rows equal to the one before
+ *   !command                     replace them with their output through a
+ *                                shell command */
+void editorLineCommand(void)
+{
+    char *cmd = editorPrompt("Lines: %s (sort [-nru] [-k N] | uniq | !command, ESC to cancel)", NULL);
+    if (!cmd) return;
+
+    if (cmd[0] == '!') {
+        int first = 0, n = E.numrows;
+        if (E.mark >= 0) n = editorSelection(&first);
+        E.mark = -1;
+        if (cmd[1]) editorFilterStart(cmd + 1, first, n);
+        else editorSetStatusMessage("Usage: !command");
+        free(cmd);
+        return;
+    }
+
+    struct sortSpec spec;
+    memset(&spec, 0, sizeof(spec));
+    int sort = 0, bad = 0;
+    char *tok = strtok(cmd, " ");
+    if (tok && strcmp(tok, "sort") == 0) sort = 1;
+    else if (!tok || strcmp(tok, "uniq") != 0) bad = 1;
+    while (!bad && (tok = strtok(NULL, " "))) {
+        char *o;
+        if (!sort || tok[0] != '-' || !tok[1]) bad = 1;
+        for (o = tok + 1; !bad && *o; ++o) {
+            if (*o == 'n') spec.numeric = 1;
+            else if (*o == 'r') spec.reverse = 1;
+            else if (*o == 'u') spec.unique = 1;
+            else if (*o == 'k') {
+                char *arg = o[1] ? o + 1 : strtok(NULL, " ");
+                spec.key = arg ? atoi(arg) : 0;
+                if (spec.key < 1) bad = 1;
+                break;
+            } else bad = 1;
+        }
+    }
+    free(cmd);
+    if (bad) {
+        editorSetStatusMessage("Usage: sort [-nru] [-k N] | uniq | !command");
+        return;
+    }
+
+    int first = 0, n = E.numrows;
+    if (E.mark >= 0) n = editorSelection(&first);
+    int dropped = sort ? editorSortRows(first, n, &spec) : editorUniqRows(first, n);
+    E.mark = -1;
+    if (E.cy > E.numrows) E.cy = E.numrows;
+    E.cx = 0;
+
+    if (sort) editorSetStatusMessage("%d lines sorted, %d dropped", n, dropped);
+    else editorSetStatusMessage("%d lines dropped", dropped);
+}
+
+/**************
+*  hex view  *
+**************/
+
+/* Binary files are shown as offset, hex bytes and ASCII. Edited bytes go to
+ * a copy of their page, and Ctrl-S writes the copies back in place, so the
+ * file is never loaded nor rewritten whole */
+
+/* Finds the copy of page 'index', or where it goes in E.hex.pages */
+int hexPageFind(size_t index, int *at)
+{
+    struct editorHex *h = &E.hex;
+    int lo = 0, hi = h->npages;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (h->pages[mid].index < index) lo = mid + 1;
+        else hi = mid;
+    }
+    *at = lo;
+    return lo < h->npages && h->pages[lo].index == index;
+}
+
+/* Bytes of page 'index' in the file, the last one may be short */
+size_t hexPageLen(size_t index)
+{
+    size_t start = index * KILO_HEX_PAGE;
+    return (E.hex.size - start < KILO_HEX_PAGE) ? E.hex.size - start : KILO_HEX_PAGE;
+}
+
+/* Copies line 'line' as edited into 'buf', returns its length. A line
+ * never crosses a page since KILO_HEX_PAGE is a multiple of the width */
+int hexLine(size_t line, unsigned char *buf)
+{
+    struct editorHex *h = &E.hex;
+    size_t off = line * KILO_HEX_WIDTH;
+    if (off >= h->size) return 0;
+    int n = (h->size - off < KILO_HEX_WIDTH) ? h->size - off : KILO_HEX_WIDTH;
+    int at;
+    if (hexPageFind(off / KILO_HEX_PAGE, &at))
+        memcpy(buf, h->pages[at].data + off % KILO_HEX_PAGE, n);
+    else
+        memcpy(buf, h->map + off, n);
+    return n;
+}
+
+void editorHexSetByte(size_t off, unsigned char c)
+{
+    struct editorHex *h = &E.hex;
+    size_t index = off / KILO_HEX_PAGE;
+    int at;
+    if (!hexPageFind(index, &at)) {
+        if (h->npages == h->cappages) {
+            h->cappages = h->cappages ? h->cappages * 2 : 16;
+            h->pages = realloc(h->pages, sizeof(struct hexPage) * h->cappages);
+            if (!h->pages) die("realloc");
+        }
+        unsigned char *data = malloc(KILO_HEX_PAGE);
+        if (!data) die("malloc");
+        memcpy(data, h->map + index * KILO_HEX_PAGE, hexPageLen(index));
+        memmove(&h->pages[at + 1], &h->pages[at], sizeof(struct hexPage) * (h->npages - at));
+        h->pages[at].index = index;
+        h->pages[at].data = data;
+        h->npages++;
+    }
+    h->pages[at].data[off % KILO_HEX_PAGE] = c;
+    E.dirty++;
+}
 
-        /* Insert end of line */
-        p += E.row[j].size;
-        *p = '\n';
-        p++;
+/* Drops the first 'n' page copies, once they are on disk */
+void hexDropPages(int n)
+{
+    struct editorHex *h = &E.hex;
+    int i;
+    for (i = 0; i < n; ++i) free(h->pages[i].data);
+    memmove(h->pages, &h->pages[n], sizeof(struct hexPage) * (h->npages - n));
+    h->npages -= n;
+}
+
+/* Shows the regular file open at 'fd' as hex, the view owns 'fd' from now */
+void editorHexOpen(int fd, struct stat *st)
+{
+    struct editorHex *h = &E.hex;
+
+    /* Edits are written in place, keep the file open for writing if we can */
+    int rw = open(E.filename, O_RDWR);
+    if (rw != -1) {
+        close(fd);
+        fd = rw;
+    }
+    h->readonly = (rw == -1);
+    h->fd = fd;
+    h->size = st->st_size;
+    h->map = NULL;
+    if (h->size) {
+        /* Shared, so the pages written back show through the mapping */
+        void *map = mmap(NULL, h->size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) die("mmap");
+        madvise(map, h->size, MADV_RANDOM);
+        h->map = map;
     }
+    h->digits = 8;
+    while (h->digits < 16 && h->size && (h->size - 1) >> (4 * h->digits)) h->digits++;
+    h->off = h->top = 0;
+    h->low = h->ascii = 0;
+    h->npages = 0;
+    h->active = 1;
+    E.filesize = st->st_size;
+}
 
-    return buf;
+void editorHexClose(void)
+{
+    struct editorHex *h = &E.hex;
+    if (!h->active) return;
+    hexDropPages(h->npages);
+    if (h->map) munmap((void *)h->map, h->size);
+    close(h->fd);
+    h->active = 0;
 }
 
-void editorOpen(char *filename)
+void editorHexSave(void)
 {
-    /* Save filename */
-    free(E.filename);
-    E.filename = strdup(filename);  /* strdup automatically performs a malloc */
+    struct editorHex *h = &E.hex;
+    size_t bytes = 0;
+    int i;
+    TRACE_BEGIN("editorSave");
+    for (i = 0; i < h->npages; ++i) {
+        size_t len = hexPageLen(h->pages[i].index);
+        if (pwrite(h->fd, h->pages[i].data, len, h->pages[i].index * KILO_HEX_PAGE) != (ssize_t)len) {
+            hexDropPages(i);
+            TRACE_END("editorSave");
+            editorSetStatusMessage("Can't save! I/O Error: %s", strerror(errno));
+            return;
+        }
+        bytes += len;
+    }
+    hexDropPages(h->npages);
+    E.dirty = 0;
+    TRACE_END("editorSave");
+    editorSetStatusMessage("%zu bytes written to disk", bytes);
+}
 
-    editorSelectSyntaxHighlight();
+/* Scrolls so the line of the cursor is on screen */
+void editorHexScroll(void)
+{
+    struct editorHex *h = &E.hex;
+    size_t line = h->off / KILO_HEX_WIDTH;
+    if (line < h->top) h->top = line;
+    if (line >= h->top + E.screenrows) h->top = line - E.screenrows + 1;
+}
 
-    /* Open file */
-    FILE *fp = fopen(filename, "r");
-    if (!fp) die("fopen");
+void editorHexMove(int key)
+{
+    struct editorHex *h = &E.hex;
+    size_t last = h->size ? h->size - 1 : 0;
+    size_t page = (size_t)E.screenrows * KILO_HEX_WIDTH;
+    switch (key) {
+        case ARROW_LEFT:
+            if (h->off > 0) h->off--;
+            break;
+        case ARROW_RIGHT:
+            if (h->off < last) h->off++;
+            break;
+        case ARROW_UP:
+            if (h->off >= KILO_HEX_WIDTH) h->off -= KILO_HEX_WIDTH;
+            break;
+        case ARROW_DOWN:
+            if (last - h->off >= KILO_HEX_WIDTH) h->off += KILO_HEX_WIDTH;
+            break;
+        case PAGE_UP:
+            h->off = (h->off >= page) ? h->off - page : h->off % KILO_HEX_WIDTH;
+            break;
+        case PAGE_DOWN:
+            h->off = (last - h->off >= page) ? h->off + page : last;
+            break;
+        case HOME_KEY:
+            h->off -= h->off % KILO_HEX_WIDTH;
+            break;
+        case END_KEY:
+            h->off += KILO_HEX_WIDTH - 1 - h->off % KILO_HEX_WIDTH;
+            if (h->off > last) h->off = last;
+            break;
+    }
+    h->low = 0;
+}
 
-    char *line;
-    ssize_t linelen = 0;
-    size_t linecap = 0;
+/* Moves the cursor to an offset typed in decimal, or hex with 0x */
+void editorHexGoto(void)
+{
+    char *query = editorPrompt("Go to offset: %s (ESC to cancel)", NULL);
+    if (!query) return;
+    char *end;
+    errno = 0;
+    unsigned long long off = strtoull(query, &end, 0);
+    if (errno || end == query || *end || off >= E.hex.size) {
+        editorSetStatusMessage("Bad offset: %s", query);
+    } else {
+        E.hex.off = off;
+        E.hex.low = 0;
+    }
+    free(query);
+}
 
-    while ((linelen = getline(&line, &linecap, fp)) != -1) {
-        /* Erase CR a LF at the end of the line, since erow are already rows */
-        while (linelen > 0 && (line[linelen-1] == '\r' || line[linelen - 1] == '\n'))
-            linelen--;
-        editorInsertRow(E.numrows, line, linelen);
+/* Handles a key in the hex view, returns 0 for the ones that work as on
+ * text. Typing overwrites: hex digits a nibble at a time, or any printable
+ * character in the ASCII column */
+int editorHexKey(int c)
+{
+    struct editorHex *h = &E.hex;
+    switch (c) {
+        case CTRL_KEY('q'):
+        case CTRL_KEY('t'):
+        case CTRL_KEY('g'):
+        case CTRL_KEY('p'):
+        case CTRL_KEY('l'):
+        case CTRL_KEY('n'):
+        case CTRL_KEY('a'):
+        case '\x1b':
+            return 0;
+        case ARROW_UP:
+        case ARROW_DOWN:
+        case ARROW_LEFT:
+        case ARROW_RIGHT:
+        case PAGE_UP:
+        case PAGE_DOWN:
+        case HOME_KEY:
+        case END_KEY:
+            editorHexMove(c);
+            return 1;
+        case '\t':
+            h->ascii = !h->ascii;
+            h->low = 0;
+            return 1;
+        case CTRL_KEY('s'):
+            editorHexSave();
+            return 1;
+        case CTRL_KEY('f'):
+            editorHexGoto();
+            return 1;
+    }
+    if (c < 32 || c >= 127 || !h->size) return 1;
+    if (!h->ascii && !isxdigit(c)) return 1;
+    if (h->readonly) {
+        editorSetStatusMessage("%s is read-only", E.filename);
+        return 1;
     }
 
-    /* Free and close file */
-    free(line);
-    fclose(fp);
+    unsigned char line[KILO_HEX_WIDTH];
+    hexLine(h->off / KILO_HEX_WIDTH, line);
+    unsigned char b = line[h->off % KILO_HEX_WIDTH];
+    if (h->ascii) {
+        b = c;
+    } else {
+        int v = isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+        b = h->low ? (b & 0xf0) | v : (b & 0x0f) | v << 4;
+    }
+    editorHexSetByte(h->off, b);
+
+    if (!h->ascii && !h->low) {
+        h->low = 1;
+    } else {
+        if (h->off < h->size - 1) h->off++;
+        h->low = 0;
+    }
+    return 1;
+}
+
+/*********************
+*  project search  *
+*********************/
+
+/* Drops the rows of the file being edited, so another one can be opened.
+ * Its edits must be saved or given up by then */
+void editorCloseFile(void)
+{
+    int j;
+    editorFollowStop();
+    editorFilterStop();
+    if (E.stream.fd != -1) {
+        editorWatchRemove(E.stream.fd);
+        close(E.stream.fd);
+        E.stream.fd = -1;
+        E.stream.partial.len = 0;
+    }
+    editorReloadStop();
+    editorDecodeStop();
+    editorSaveWait();
+    E.compress->format = COMPRESS_NONE;
+    editorJournalClose();
+    editorHexClose();
+
+    for (j = 0; j < E.numrows; ++j) editorFreeRow(&E.row[j]);
+    E.numrows = 0;
+    E.cx = E.cy = E.rx = 0;
+    E.rowoff = E.coloff = E.vrowoff = 0;
+    E.mark = -1;
+    editorIndexInvalidate();
+    free(E.filename);
+    E.filename = NULL;
+    E.syntax = NULL;
+    E.filesize = 0;
     E.dirty = 0;
+    E.undo.len = E.undo.pos = 0;
+    E.undo.top = E.undo.group = UNDO_NONE;
+    E.undo.overflow = 0;
 }
 
-void editorSave(void)
+/* Finds 'q' in buf[0, len). The first and the last byte of the query are
+ * compared against 16 positions at a time and the rest is only checked
+ * where both match, so a common first byte doesn't slow it down */
+const char *grepFind(const char *buf, size_t len, const char *q, size_t qlen)
 {
-    if (!E.filename) {
-        E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-        if (!E.filename) {
-            editorSetStatusMessage("Save aborted");
-            return;
+    size_t i = 0;
+    if (len < qlen) return NULL;
+#ifdef __SSE2__
+    const __m128i first = _mm_set1_epi8(q[0]), last = _mm_set1_epi8(q[qlen - 1]);
+    for (; i + qlen - 1 + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)&buf[i]);
+        __m128i b = _mm_loadu_si128((const __m128i *)&buf[i + qlen - 1]);
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                    _mm_cmpeq_epi8(b, last)));
+        while (mask) {
+            size_t at = i + __builtin_ctz(mask);
+            if (qlen <= 2 || memcmp(&buf[at + 1], &q[1], qlen - 2) == 0) return &buf[at];
+            mask &= mask - 1;
         }
+    }
+#endif
+    return replaceFind(&buf[i], buf + len, q, qlen);
+}
 
-        editorSelectSyntaxHighlight();
+/* Number of newlines in buf[0, len) */
+size_t grepCountLines(const char *buf, size_t len)
+{
+    size_t i = 0, n = 0;
+#ifdef __SSE2__
+    const __m128i nl = _mm_set1_epi8('\n');
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&buf[i]);
+        n += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)));
     }
+#endif
+    for (; i < len; ++i) n += (buf[i] == '\n');
+    return n;
+}
 
-    int len;
-    char *buf = editorRowsToString(&len);
+/* Called with the lock held: wakes the main loop, once until it reads */
+void grepNotify(struct editorGrep *g)
+{
+    if (g->signaled) return;
+    g->signaled = 1;
+    if (write(g->pipe[1], "", 1) == -1) g->signaled = 0;
+}
 
-    /* fcntl.h */
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);  /* 644 owner read/write, everyone else only read */
-    if (fd != -1) {
-        /* unistd.h, set file size */
-        if (ftruncate(fd, len) != -1) {
-            if (write(fd, buf, len) == len) {
-                /* unistd.h */
-                close(fd);
-                free(buf);
-                editorSetStatusMessage("%d bytes written to disk", len);
-                E.dirty = 0;
-                return;
-            }
+/* Hands the hits found by a thread to the main loop */
+void grepFlush(struct editorGrep *g, struct lineBuffer *out)
+{
+    if (out->len == 0) return;
+    pthread_mutex_lock(&g->lock);
+    lineBufferAppend(&g->hits, out->b, out->len);
+    g->nhits += grepCountLines(out->b, out->len);
+    if (g->nhits >= KILO_GREP_MAX_HITS) {
+        g->truncated = 1;
+        g->cancel = 1;
+        pthread_cond_broadcast(&g->cond);
+    }
+    grepNotify(g);
+    pthread_mutex_unlock(&g->lock);
+    out->len = 0;
+}
+
+void grepPush(struct editorGrep *g, char *path, int dir)
+{
+    pthread_mutex_lock(&g->lock);
+    if (g->ntasks == g->captasks) {
+        g->captasks = g->captasks ? g->captasks * 2 : 256;
+        g->tasks = realloc(g->tasks, sizeof(struct grepTask) * g->captasks);
+        if (!g->tasks) die("realloc");
+    }
+    g->tasks[g->ntasks].path = path;
+    g->tasks[g->ntasks].dir = dir;
+    g->ntasks++;
+    pthread_cond_signal(&g->cond);
+    pthread_mutex_unlock(&g->lock);
+}
+
+/* Queues the entries of a directory. Hidden ones and symlinks are skipped */
+void grepDir(struct editorGrep *g, const char *path)
+{
+    DIR *d = opendir(path);
+    if (!d) return;
+    struct dirent *de;
+    while (!g->cancel && (de = readdir(d))) {
+        if (de->d_name[0] == '.') continue;
+        char *child;
+        if (strcmp(path, ".") == 0) {
+            child = strdup(de->d_name);
+        } else {
+            child = malloc(strlen(path) + strlen(de->d_name) + 2);
+            if (child) sprintf(child, "%s/%s", path, de->d_name);
         }
+        if (!child) die("malloc");
+
+        int type = de->d_type;
+        struct stat st;
+        if (type == DT_UNKNOWN && lstat(child, &st) == 0)
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        if (type == DT_DIR || type == DT_REG) grepPush(g, child, type == DT_DIR);
+        else free(child);
+    }
+    closedir(d);
+}
 
+/* Searches a file. Only its first bytes are read to tell a binary file, one
+ * with a NUL in them, and skip it. Text files are mapped and scanned one
+ * window at a time, stopping between windows if cancelled. Every matching
+ * line becomes a hit "path:line:text" */
+void grepFile(struct editorGrep *g, const char *path, struct lineBuffer *out)
+{
+    size_t qlen = strlen(g->query);
+    struct stat st;
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || (size_t)st.st_size < qlen ||
+            editorIsBinary(fd)) {
         close(fd);
+        return;
     }
+    size_t len = st.st_size;
+    char *buf = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED) return;
+    madvise(buf, len, MADV_SEQUENTIAL);
+
+    size_t pos = 0, counted = 0, line = 1;
+    while (pos < len && !g->cancel) {
+        /* Matches starting in [pos, end) */
+        size_t end = (len - pos > KILO_GREP_WINDOW) ? pos + KILO_GREP_WINDOW : len;
+        size_t hay = ((len - end > qlen - 1) ? end + qlen - 1 : len) - pos;
+        const char *p = grepFind(&buf[pos], hay, g->query, qlen);
+        if (!p) {
+            pos = end;
+            continue;
+        }
 
-    free(buf);
-    /* strerror is like perror, but it takes errno and produces a string */
-    editorSetStatusMessage("Can't save! I/O Error: %s", strerror(errno));
+        size_t at = p - buf;
+        line += grepCountLines(&buf[counted], at - counted);
+        counted = at;
+        /* Long lines are cut around the match */
+        size_t lo = (at > KILO_GREP_CONTEXT) ? at - KILO_GREP_CONTEXT : 0;
+        const char *ls = memrchr(&buf[lo], '\n', at - lo);
+        const char *le = memchr(p, '\n', len - at);
+        const char *s = ls ? ls + 1 : &buf[lo];
+        const char *e = le ? le : buf + len;
+        if (e - p > KILO_GREP_CONTEXT) e = p + KILO_GREP_CONTEXT;
+
+        char prefix[32];
+        int plen = snprintf(prefix, sizeof(prefix), ":%zu:", line);
+        lineBufferAppend(out, path, strlen(path));
+        lineBufferAppend(out, prefix, plen);
+        lineBufferAppend(out, s, e - s);
+        lineBufferAppend(out, "\n", 1);
+        if (out->len >= KILO_GREP_FLUSH) grepFlush(g, out);
+
+        pos = le ? (size_t)(le - buf) + 1 : len;
+    }
+    munmap(buf, len);
 }
 
-/**********
-*  find  *
-**********/
+/* Thread body: takes directories and files off the shared stack until it
+ * is empty and no thread is reading a directory that could refill it */
+void *grepThread(void *arg)
+{
+    struct editorGrep *g = arg;
+    struct lineBuffer out = { NULL, 0, 0 };
 
-void editorFindCallback(char *query, int key)
+    pthread_mutex_lock(&g->lock);
+    while (1) {
+        while (g->ntasks == 0 && g->busy > 0 && !g->cancel) pthread_cond_wait(&g->cond, &g->lock);
+        if (g->ntasks == 0 || g->cancel) break;
+        struct grepTask t = g->tasks[--g->ntasks];
+        g->busy++;
+        pthread_mutex_unlock(&g->lock);
+
+        if (t.dir) {
+            grepDir(g, t.path);
+        } else {
+            TRACE_BEGIN("grepFile");
+            grepFile(g, t.path, &out);
+            grepFlush(g, &out);
+            TRACE_END("grepFile");
+        }
+        free(t.path);
+
+        pthread_mutex_lock(&g->lock);
+        if (!t.dir) g->files++;
+        g->busy--;
+        if (g->busy == 0 && g->ntasks == 0) pthread_cond_broadcast(&g->cond);
+    }
+    g->done++;
+    pthread_cond_broadcast(&g->cond);
+    grepNotify(g);
+    pthread_mutex_unlock(&g->lock);
+    free(out.b);
+    return NULL;
+}
+
+void editorGrepStatus(void)
 {
-    static int last_match = -1; /* line of last match, -1 if none */
-    static int direction = 1;   /* -1 = backward; 1 = forward */
+    struct editorGrep *g = &E.grep;
+    if (g->running)
+        editorSetStatusMessage("Searching '%s': %lu hits in %lu files (ESC to stop)",
+                g->query, g->nhits, g->files);
+    else
+        editorSetStatusMessage("'%s': %lu hits in %lu files%s", g->query, g->nhits, g->files,
+                g->truncated ? ", stopped at the limit" : g->cancel ? ", stopped" : "");
+}
 
-    static int saved_hl_line;
-    static char *saved_hl = NULL;
+/* Stops the search, if running, and waits for the threads. They give up
+ * within a window of the file they are in */
+void editorGrepStop(void)
+{
+    struct editorGrep *g = &E.grep;
+    int i;
+    if (!g->running) return;
+
+    pthread_mutex_lock(&g->lock);
+    if (g->done < g->nthreads) g->cancel = 1;
+    pthread_cond_broadcast(&g->cond);
+    pthread_mutex_unlock(&g->lock);
+    for (i = 0; i < g->nthreads; ++i) pthread_join(g->threads[i], NULL);
+
+    editorWatchRemove(g->pipe[0]);
+    close(g->pipe[0]);
+    close(g->pipe[1]);
+    for (i = 0; i < g->ntasks; ++i) free(g->tasks[i].path);
+    g->ntasks = 0;
+    g->hits.len = 0;
+    g->running = 0;
+    editorGrepStatus();
+}
 
-    /*Restore previous highlight*/
-    if (saved_hl) {
-        memcpy(&E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-        free(saved_hl);
-        saved_hl = NULL;
+/* Main loop side: appends the hits found so far as rows */
+void editorGrepEvent(int fd, void *data)
+{
+    (void)data;
+    struct editorGrep *g = &E.grep;
+    char drain[64];
+    while (read(fd, drain, sizeof(drain)) > 0);
+
+    pthread_mutex_lock(&g->lock);
+    struct lineBuffer hits = g->hits;
+    g->hits.b = NULL;
+    g->hits.len = g->hits.cap = 0;
+    g->signaled = 0;
+    int finished = (g->done == g->nthreads);
+    pthread_mutex_unlock(&g->lock);
+
+    TRACE_BEGIN("editorGrepEvent");
+    int dirty = E.dirty;
+    const char *p = hits.b, *end = hits.b + hits.len, *nl;
+    while (p < end && (nl = memchr(p, '\n', end - p))) {
+        editorAppendLine(p, nl - p);
+        p = nl + 1;
     }
+    E.dirty = dirty;
+    free(hits.b);
+    TRACE_END("editorGrepEvent");
 
-    /*Leaving search mode*/
-    if (key == '\r' || key == '\x1b') {
-        last_match = -1;
-        direction = 1;
-        return;
-    } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-        direction = 1;
-    } else if (key == ARROW_UP || ARROW_LEFT) {
-        direction = -1;
+    if (finished) editorGrepStop();
+    else editorGrepStatus();
+}
+
+/* Searches every file under the current directory for a literal string.
+ * The file being edited is closed and the hits become its rows, as they
+ * are found. Enter on one of them opens its file at its line */
+void editorGrep(void)
+{
+    struct editorGrep *g = &E.grep;
+    char *query = editorPrompt("Grep: %s (ESC to cancel)", NULL);
+    if (!query) return;
+
+    /* The hits go to a buffer of their own, the one of the last search is
+     * emptied and reused */
+    editorGrepStop();
+    int i;
+    for (i = 0; i < E.nbuffers; ++i)
+        if (i == E.buffer ? g->active : E.buffers[i].grep) break;
+    if (i < E.nbuffers) {
+        editorBufferSelect(i);
+        editorCloseFile();
     } else {
-        last_match = -1;
-        direction = 1;
+        editorBufferNew();
+        E.undo.recording = 1;
     }
+    g->active = 1;
+    free(g->query);
+    g->query = query;
+    g->cancel = g->truncated = g->signaled = 0;
+    g->busy = g->done = 0;
+    g->files = g->nhits = 0;
+    if (pipe2(g->pipe, O_NONBLOCK | O_CLOEXEC) == -1) die("pipe");
+    grepPush(g, strdup("."), 1);
+
+    /* Some threads wait on the disk, start a few even on one core */
+    int n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 4) n = 4;
+    if (n > KILO_MAX_THREADS) n = KILO_MAX_THREADS;
+    g->nthreads = n;
+    g->running = 1;
+    editorWatchAdd(g->pipe[0], POLLIN, editorGrepEvent, NULL);
+    for (i = 0; i < n; ++i)
+        if (pthread_create(&g->threads[i], NULL, grepThread, g) != 0) die("pthread_create");
+    editorGrepStatus();
+}
 
-    /*current is the index of the current row we are searching. If there was a last match,
-     * it starts on the line after (or before, if we’re searching backwards). If there 
-     * wasn’t a last match, it starts at the top of the file and searches in the forward 
-     * direction to find the first match.*/
-    if (last_match == -1) direction = 1;
-    int current = last_match;
-    /*Search in every row*/
+/* Opens the file of the hit under the cursor at its line */
+void editorGrepOpen(void)
+{
+    if (E.cy >= E.numrows) return;
+    erow *row = &E.row[E.cy];
+
+    /* The path ends at the first ":<line>:" */
+    char *colon = row->chars;
+    long line = 0;
+    while ((colon = memchr(colon, ':', row->chars + row->size - colon))) {
+        char *end;
+        line = strtol(colon + 1, &end, 10);
+        if (end > colon + 1 && *end == ':' && line > 0) break;
+        colon++;
+    }
+    if (!colon) return;
+
+    char *path = strndup(row->chars, colon - row->chars);
+    if (!path) die("strndup");
+
+    /* In a buffer of its own, or the one that already holds the file, so
+     * the hits stay one CTRL-N away */
+    int from = E.buffer;
+    editorSetStatusMessage("%s:%ld", path, line);
+    editorBufferOpen(path, 0);
+    if (E.buffer != from) {
+        E.cy = (line - 1 < E.numrows) ? line - 1 : E.numrows;
+        E.cx = 0;
+    }
+    free(path);
+}
+
+/*************
+*  buffers  *
+*************/
+
+/* Every open file is a buffer. The one being edited lives in E and the
+ * others are parked in E.buffers, so the rest of the editor only ever
+ * deals with E. Rows keep their render and highlight while parked:
+ * switching copies the fields of E and nothing is read or lexed again */
+#define BUFFER_PARK(f) b->f = E.f;
+#define BUFFER_LOAD(f) E.f = b->f;
+
+/* Puts the fields of an empty buffer in E. The undo limit and -x stay */
+void editorBufferReset(void)
+{
+    E.cx = E.cy = E.rx = 0;
+    E.rowoff = E.coloff = 0;
+    E.wrap = 0;
+    E.vrowoff = 0;
+    memset(&E.ri, 0, sizeof(E.ri));
+    E.numrows = E.rowcap = 0;
+    E.row = NULL;
+    E.mark = -1;
+    E.dirty = 0;
+    E.filename = NULL;
+    E.syntax = NULL;
+    E.filesize = 0;
+    memset(&E.follow, 0, sizeof(E.follow));
+    E.follow.fd = -1;
+    memset(&E.stream, 0, sizeof(E.stream));
+    E.stream.fd = -1;
+    size_t limit = E.undo.limit;
+    memset(&E.undo, 0, sizeof(E.undo));
+    E.undo.top = E.undo.group = UNDO_NONE;
+    E.undo.limit = limit;
+    int force = E.hex.force;
+    memset(&E.hex, 0, sizeof(E.hex));
+    E.hex.force = force;
+    memset(&E.reload, 0, sizeof(E.reload));
+    E.reload.inotify = -1;
+    E.compress = calloc(1, sizeof(struct editorCompress));
+    if (!E.compress) die("calloc");
+    E.compress->notify[0] = E.compress->notify[1] = -1;
+    memset(&E.filter, 0, sizeof(E.filter));
+    E.filter.in = E.filter.out = E.filter.err = -1;
+    E.grep.active = 0;
+}
+
+/* Index of the buffer with this id, -1 if it was closed */
+int editorBufferFind(int id)
+{
     int i;
-    for (i = 0; i < E.numrows; ++i) {
-        current += direction;
-        if (current == -1) current = E.numrows - 1;
-        else if (current == E.numrows) current = 0;
+    for (i = 0; i < E.nbuffers; ++i)
+        if (E.buffers[i].id == id) return i;
+    return -1;
+}
 
-        erow *row = &E.row[current];
-        /*strstr finds first ocurrence of substring in string*/
-        char *match = strstr(row->render, query);
+/* Copies the fields of the current buffer out of E, and hands its journal
+ * over for 'next' */
+void editorBufferPark(const struct journalFile *next)
+{
+    struct editorBuffer *b = &E.buffers[E.buffer];
+    BUFFER_FIELDS(BUFFER_PARK)
+    b->grep = E.grep.active;
+    b->mem = 0;
+    editorJournalSwitch(&b->journal, next);
+}
 
-        if (match) {
-            last_match = current;
-            E.cy = current;
-            E.cx = editorRowRxToCx(row, match - row->render);
-            /*Scroll to the end of the file, so when editorScroll() is called, 
-             * it will scroll upwards to the found sequence*/
-            E.rowoff = E.numrows;
+/* Makes 'to' the buffer in E, once the current one is parked or gone */
+void editorBufferLoad(int to)
+{
+    struct editorBuffer *b = &E.buffers[to];
+    BUFFER_FIELDS(BUFFER_LOAD)
+    E.grep.active = b->grep;
+    E.buffer = to;
+}
+
+/* Switches the buffer E holds, without drawing it. Watches do it around
+ * their callbacks */
+void editorBufferSwitch(int to)
+{
+    if (to == E.buffer) return;
+    editorBufferPark(&E.buffers[to].journal);
+    editorBufferLoad(to);
+}
+
+/* Bytes held by a buffer: rows, undo log, indexes and hex edits */
+size_t bufferMemory(const struct editorBuffer *b)
+{
+    return rowsMemory(b->row, b->numrows, b->rowcap) + b->undo.cap +
+        sizeof(struct rowNode) * b->ri.cap +
+        (size_t)b->hex.npages * KILO_HEX_PAGE;
+}
+
+/* Bytes held by buffer 'i', read from its parked fields. A parked one is
+ * only counted again if it changed since */
+size_t editorBufferMemoryOf(int i)
+{
+    struct editorBuffer cur, *b = &E.buffers[i];
+    if (i == E.buffer) {
+        b = &cur;
+        BUFFER_FIELDS(BUFFER_PARK)
+        return bufferMemory(b);
+    }
+    if (!b->mem) {
+        size_t mem = bufferMemory(b);
+        b->mem = mem ? mem : 1;
+    }
+    return b->mem;
+}
+
+size_t editorBufferTotal(void)
+{
+    size_t total = 0;
+    int i;
+    for (i = 0; i < E.nbuffers; ++i) total += editorBufferMemoryOf(i);
+    return total;
+}
+
+/* Past the budget, the buffers not selected for the longest drop what is
+ * rebuilt when needed: the highlight of their rows, lexed again as they
+ * are drawn, and the row index. The bracket sum of each row is small and
+ * kept, so the index gets it back without lexing. They stay parked
+ * meanwhile. Returns the bytes still over the budget */
+size_t editorBufferBudget(void)
+{
+    size_t total = editorBufferTotal();
+    while (total > E.budget) {
+        int lru = -1, i, j;
+        for (i = 0; i < E.nbuffers; ++i) {
+            struct editorBuffer *b = &E.buffers[i];
+            if (i != E.buffer && !b->evicted && (lru == -1 || b->used < E.buffers[lru].used)) lru = i;
+        }
+        if (lru == -1) break;
+
+        struct editorBuffer *b = &E.buffers[lru];
+        total -= editorBufferMemoryOf(lru);
+        for (j = 0; j < b->numrows; ++j) {
+            free(b->row[j].hl);
+            free(b->row[j].brblock);
+            b->row[j].hl = NULL;
+            b->row[j].brblock = NULL;
+        }
+        free(b->ri.node);
+        memset(&b->ri, 0, sizeof(b->ri));
+        b->mem = 0;
+        b->evicted = 1;
+        total += editorBufferMemoryOf(lru);
+    }
+    return total > E.budget ? total - E.budget : 0;
+}
+
+/* Shows buffer 'to' */
+void editorBufferSelect(int to)
+{
+    if (to != E.buffer) {
+        editorBufferSwitch(to);
+        E.frame.valid = 0;
+    }
+    E.buffers[to].used = editorNow();
+    E.buffers[to].evicted = 0;
+    editorSetStatusMessage("[%d/%d] %s", to + 1, E.nbuffers,
+            E.filename ? E.filename : E.grep.active ? "[grep]" : "[No Name]");
+}
+
+/* Parks the current buffer and starts an empty one */
+void editorBufferNew(void)
+{
+    static int ids = 1;
+    E.buffers = realloc(E.buffers, sizeof(struct editorBuffer) * (E.nbuffers + 1));
+    if (!E.buffers) die("realloc");
+    struct journalFile none = { 0, -1, NULL };
+    editorBufferPark(&none);
+    editorBufferReset();
+
+    struct editorBuffer *b = &E.buffers[E.nbuffers];
+    memset(b, 0, sizeof(*b));
+    b->id = ++ids;
+    b->used = editorNow();
+    E.buffer = E.nbuffers++;
+    E.frame.valid = 0;
+}
+
+/* Loads a file in the current buffer, and journals it and watches it for
+ * changes when it is a regular one. A followed file grows under the
+ * journal, which would never match it again, and already reads what is
+ * appended: it gets neither */
+void editorOpenFile(char *filename, int follow)
+{
+    struct stat st;
+    editorOpen(filename);
+    if (E.hex.active || E.compress->format != COMPRESS_NONE) return;
+    if (follow) {
+        editorFollowStart();
+        return;
+    }
+    if (!E.replay.script && stat(filename, &st) == 0 && S_ISREG(st.st_mode)) {
+        editorJournalOpen();
+        editorReloadStart();
+    }
+}
 
-            /*Highlight result, saving previous hl*/
-            saved_hl_line = current;
-            saved_hl = malloc(row->rsize);
-            memcpy(saved_hl, row->hl, row->rsize);
-            memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-            break;
+/* Opens a file in a new buffer, or selects the buffer that has it. Older
+ * buffers make room if it takes the buffers past the budget */
+void editorBufferOpen(char *filename, int follow)
+{
+    struct stat st;
+    if (access(filename, R_OK) == -1 || stat(filename, &st) == -1) {
+        editorSetStatusMessage("Can't open %s: %s", filename, strerror(errno));
+        return;
+    }
+    int i;
+    for (i = 0; i < E.nbuffers; ++i) {
+        char *name = (i == E.buffer) ? E.filename : E.buffers[i].filename;
+        if (name && editorSameFile(name, &st)) {
+            editorBufferSelect(i);
+            return;
         }
     }
+
+    editorBufferNew();
+    editorOpenFile(filename, follow);
+    E.undo.recording = 1;
+    size_t over = editorBufferBudget();
+    if (over) editorSetStatusMessage("%s is open, %zu MB over the %zu MB budget of the buffers",
+            filename, (over >> 20) + 1, E.budget >> 20);
 }
 
-void editorFind(void)
+/* Drops the current buffer and shows the one before it. Its edits must be
+ * saved or given up by then. The last one is only emptied */
+void editorBufferClose(void)
 {
-    int saved_cx = E.cx;
-    int saved_cy = E.cy;
-    int saved_rowof = E.rowoff;
-    int saved_coloff = E.coloff;
-
-    char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+    int j;
+    /* A search still running appends its hits here */
+    for (j = 0; j < E.nwatch; ++j)
+        if (E.grep.running && E.watch[j].fd == E.grep.pipe[0] &&
+                E.watch[j].buffer == E.buffers[E.buffer].id) editorGrepStop();
+    editorCloseFile();
+    E.grep.active = 0;
+    if (E.nbuffers == 1) return;
+
+    free(E.row);
+    free(E.ri.node);
+    free(E.undo.log);
+    free(E.hex.pages);
+    free(E.stream.partial.b);
+    free(E.filter.partial.b);
+    free(E.filter.cmd);
+    if (E.compress->notify[0] != -1) {
+        close(E.compress->notify[0]);
+        close(E.compress->notify[1]);
+    }
+    free(E.compress);
+
+    int closed = E.buffer;
+    memmove(&E.buffers[closed], &E.buffers[closed + 1],
+            sizeof(struct editorBuffer) * (E.nbuffers - closed - 1));
+    E.nbuffers--;
+    int to = closed ? closed - 1 : 0;
+    struct journalFile gone;
+    editorJournalSwitch(&gone, &E.buffers[to].journal);
+    editorBufferLoad(to);
+    E.frame.valid = 0;
+    editorBufferSelect(to);
+}
 
-    if (query)
-        free(query);
-    else {
-        /*Restore previous position*/
-        E.cx = saved_cx;
-        E.cy = saved_cy;
-        E.rowoff = saved_rowof;
-        E.coloff = saved_coloff;
+/* Prompts for a buffer number, or a file to open in a new buffer */
+void editorBufferPrompt(void)
+{
+    char prompt[64];
+    snprintf(prompt, sizeof(prompt), "Buffer 1-%d or file to open: %%s (ESC to cancel)", E.nbuffers);
+    char *s = editorPrompt(prompt, NULL);
+    if (!s) return;
+    char *end;
+    long n = strtol(s, &end, 10);
+    if (end > s && *end == '\0') {
+        if (n >= 1 && n <= E.nbuffers) editorBufferSelect(n - 1);
+        else editorSetStatusMessage("No buffer %ld", n);
+    } else {
+        editorBufferOpen(s, 0);
+        /* Unless opening it had something to say */
+        if (!E.statusmsg[0]) editorSetStatusMessage("[%d/%d] %s", E.buffer + 1, E.nbuffers, s);
     }
+    free(s);
 }
 
 /*******************
@@ -868,17 +6799,141 @@ void abFree(struct abuf *ab)
     free(ab->b);
 }
 
+/***********
+*  stats  *
+***********/
+
+/* Bytes held by rows: the row array plus chars, render, hl and column marks */
+size_t rowsMemory(const erow *row, int numrows, int rowcap)
+{
+    size_t mem = sizeof(erow) * rowcap;
+    int j;
+    for (j = 0; j < numrows; ++j)
+        mem += row[j].size + 1 + row[j].rsize + 1 + (row[j].hl ? row[j].rsize : 0) +
+            (row[j].cols ? sizeof(struct colMark) * (row[j].rwidth / KILO_COL_STEP + 1) : 0) +
+            (row[j].brblock ? sizeof(struct bracketSum) *
+             ((row[j].rsize + KILO_BRACKET_BLOCK - 1) / KILO_BRACKET_BLOCK) : 0);
+    return mem;
+}
+
+size_t editorRowMemory(void)
+{
+    return rowsMemory(E.row, E.numrows, E.rowcap);
+}
+
+/* Accounts a frame: t0..t3 delimit scroll, draw and write */
+void editorStatsFrame(double t0, double t1, double t2, double t3, size_t bytes)
+{
+    struct editorStats *st = &E.stats;
+    st->scroll = t1 - t0;
+    st->draw = t2 - t1;
+    st->write = t3 - t2;
+    st->bytes = bytes;
+    st->frame_syscalls = st->syscalls;
+    st->frame_relexed = st->relexed;
+    st->syscalls = st->relexed = 0;
+
+    st->frames++;
+    st->sum_scroll += st->scroll;
+    st->sum_draw += st->draw;
+    st->sum_write += st->write;
+    st->sum_bytes += bytes;
+    st->sum_syscalls += st->frame_syscalls;
+    st->sum_relexed += st->frame_relexed;
+    if (st->key_time) {
+        st->latency = t3 - st->key_time;
+        st->key_time = 0;
+        st->keys++;
+        st->sum_latency += st->latency;
+        if (st->latency > st->max_latency) st->max_latency = st->latency;
+    }
+}
+
+/* Compact summary of the last frame for the status bar */
+void editorStatsFormat(char *buf, size_t size)
+{
+    struct editorStats *st = &E.stats;
+    time_t now = time(NULL);
+    if (now != st->rowmem_time) {
+        st->rowmem = editorRowMemory();
+        st->allmem = (E.nbuffers > 1) ? editorBufferTotal() : 0;
+        st->rowmem_time = now;
+    }
+    int mb = st->rowmem >= (10 << 20);
+    int len = snprintf(buf, size, "%.2fms s%.0f/d%.0f/w%.0fus %zuB %dsc %drl %zu%s | ",
+            st->latency / 1e3, st->scroll, st->draw, st->write, st->bytes,
+            st->frame_syscalls, st->frame_relexed,
+            st->rowmem >> (mb ? 20 : 10), mb ? "MB" : "KB");
+    /* Of the budget, over all the buffers */
+    if (st->allmem && len > 3 && (size_t)len < size)
+        snprintf(buf + len - 3, size - len + 3, " all %zu/%zuMB | ", st->allmem >> 20, E.budget >> 20);
+}
+
+void editorStatsDump(void)
+{
+    struct editorStats *st = &E.stats;
+    FILE *fp = fopen(st->dumpfile, "w");
+    if (!fp) return;
+
+    unsigned long f = st->frames ? st->frames : 1, k = st->keys ? st->keys : 1;
+    fprintf(fp, "frames: %lu\n", st->frames);
+    fprintf(fp, "keys: %lu\n", st->keys);
+    fprintf(fp, "latency: avg %.1f us, max %.1f us\n", st->sum_latency / k, st->max_latency);
+    fprintf(fp, "frame time: scroll %.1f us, draw %.1f us, write %.1f us\n",
+            st->sum_scroll / f, st->sum_draw / f, st->sum_write / f);
+    fprintf(fp, "bytes per frame: %.1f\n", (double)st->sum_bytes / f);
+    fprintf(fp, "syscalls per frame: %.1f\n", (double)st->sum_syscalls / f);
+    fprintf(fp, "rows relexed: %llu (%.1f per key)\n", st->sum_relexed, (double)st->sum_relexed / k);
+    fprintf(fp, "row memory: %zu bytes\n", editorRowMemory());
+    if (E.nbuffers > 1) {
+        int i;
+        fprintf(fp, "buffers: %d, %zu bytes of a %zu bytes budget\n", E.nbuffers,
+                editorBufferTotal(), E.budget);
+        for (i = 0; i < E.nbuffers; ++i) {
+            char *name = (i == E.buffer) ? E.filename : E.buffers[i].filename;
+            fprintf(fp, "  [%d] %s: %zu bytes\n", i + 1, name ? name : "[No Name]", editorBufferMemoryOf(i));
+        }
+    }
+    fclose(fp);
+}
+
+void editorToggleStats(void)
+{
+    E.stats.enabled = !E.stats.enabled;
+    E.stats.syscalls = E.stats.relexed = 0;
+    E.stats.key_time = 0;
+    E.stats.rowmem_time = 0;
+}
+
 /************
 *  output  *
 ************/
 
 void editorScroll(void)
 {
+    if (E.hex.active) {
+        editorHexScroll();
+        return;
+    }
+
     E.rx = 0;
     if (E.cy < E.numrows) {
         E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
     }
 
+    if (E.wrap) {
+        int vline, vcol;
+        editorWrapCursor(&vline, &vcol);
+        E.coloff = 0;
+        if (vline < E.vrowoff) {
+            E.vrowoff = vline;
+        }
+        if (vline >= E.vrowoff + E.screenrows) {
+            E.vrowoff = vline - E.screenrows + 1;
+        }
+        return;
+    }
+
     if (E.cy < E.rowoff) {
         E.rowoff = E.cy;
     }
@@ -893,11 +6948,223 @@ void editorScroll(void)
     }
 }
 
+/* Moves the lines already on screen when the view scrolled by less than a
+ * screen, using a scroll region over the text rows, so only the exposed
+ * lines have to be drawn. Clears the screen instead if it is unknown */
+void editorFrameScroll(struct abuf *ab)
+{
+    struct editorFrame *f = &E.frame;
+    long long top = E.hex.active ? (long long)E.hex.top : E.wrap ? E.vrowoff : E.rowoff;
+
+    if (f->rows != E.screenrows + 2) {
+        f->rows = E.screenrows + 2;
+        f->hash = realloc(f->hash, sizeof(uint64_t) * f->rows);
+        if (!f->hash) die("realloc");
+        f->valid = 0;
+    }
+    if (!f->valid) {
+        abAppend(ab, "\x1b[2J", 4);
+        memset(f->hash, 0, sizeof(uint64_t) * f->rows);
+        f->valid = 1;
+    } else if (f->wrap == E.wrap && top != f->top &&
+            llabs(top - f->top) < E.screenrows) {
+        int delta = top - f->top;
+        int n = abs(delta);
+        char buf[32];
+        /* DECSTBM, then SU (content up) or SD (content down), then reset */
+        int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r",
+                E.screenrows, n, delta > 0 ? 'S' : 'T');
+        abAppend(ab, buf, len);
+        if (delta > 0) {
+            memmove(f->hash, f->hash + n, sizeof(uint64_t) * (E.screenrows - n));
+            memset(f->hash + E.screenrows - n, 0, sizeof(uint64_t) * n);
+        } else {
+            memmove(f->hash + n, f->hash, sizeof(uint64_t) * (E.screenrows - n));
+            memset(f->hash, 0, sizeof(uint64_t) * n);
+        }
+    }
+    f->top = top;
+    f->wrap = E.wrap;
+}
+
+/* Sends screen line 'y', unless the terminal already shows it */
+void editorFrameLine(struct abuf *ab, int y, const char *s, int len)
+{
+    /* FNV-1a, never 0 so an unknown line is always sent */
+    uint64_t h = 14695981039346656037ULL;
+    int j;
+    for (j = 0; j < len; ++j) h = (h ^ (unsigned char)s[j]) * 1099511628211ULL;
+    h |= 1;
+    if (y < E.frame.rows) {
+        if (E.frame.hash[y] == h) return;
+        E.frame.hash[y] = h;
+    }
+
+    char buf[16];
+    int blen = snprintf(buf, sizeof(buf), "\x1b[%d;1H", y + 1);
+    abAppend(ab, buf, blen);
+    if (len) abAppend(ab, s, len);
+    /* Erases rest of the line to the right of the cursor */
+    abAppend(ab, "\x1b[K", 3);
+}
+
+/* Sends the escape to draw with the color of 'hl' unless it is already on */
+void editorDrawColor(struct abuf *ab, int *current_color, int hl)
+{
+    int color = (hl == HL_NORMAL) ? -1 : editorSyntaxToColor(hl);
+    if (*current_color == color) return;
+    *current_color = color;
+    if (color == -1) {
+        abAppend(ab, "\x1b[39m", 5);
+    } else {
+        char buf[16];
+        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
+        abAppend(ab, buf, clen);
+    }
+}
+
+/* Draws a non-printable character inverted, as ^@ to ^Z or '?' */
+void editorDrawControl(struct abuf *ab, int current_color, int cp)
+{
+    char sym = (cp >= 0 && cp <= 26) ? '@' + cp : '?';
+    /*Invert colors*/
+    abAppend(ab, "\x1b[7m", 4);
+    abAppend(ab, &sym, 1);
+    abAppend(ab, "\x1b[m", 3); /* This resets color too, so it needs to be reset */
+    if (current_color != -1) {
+        char buf[16];
+        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
+        abAppend(ab, buf, clen);
+    }
+}
+
+/* Draws the 'len' screen columns of a row with UTF-8 from column 'start',
+ * decoding from the nearest column mark. A wide character cut by either
+ * edge is drawn as blanks */
+void editorDrawUtf8Segment(struct abuf *ab, erow *row, int start, int len)
+{
+    int col, end = start + len;
+    int j = editorRenderOffset(row, start, &col);
+    int current_color = -1;
+    while (j < row->rsize) {
+        int cp, n = utf8Decode(&row->render[j], row->rsize - j, &cp);
+        int w = (cp < 0) ? 1 : charWidth(cp);
+        if (w && col >= end) break;
+        if (col < start || col + w > end) {
+            int blanks = ((col + w < end) ? col + w : end) - ((col > start) ? col : start);
+            while (blanks-- > 0) abAppend(ab, " ", 1);
+        } else if (cp < 32 || (cp >= 127 && cp < 160)) {
+            editorDrawControl(ab, current_color, cp);
+        } else {
+            editorDrawColor(ab, &current_color, row->hl[j]);
+            abAppend(ab, &row->render[j], n);
+        }
+        col += w;
+        j += n;
+    }
+
+    abAppend(ab, "\x1b[39m", 5);
+}
+
+/* Draws 'len' rendered characters of a row starting at 'start', these are
+ * screen columns */
+void editorDrawRowSegment(struct abuf *ab, erow *row, int start, int len)
+{
+    editorEnsureHighlight(row);
+    if (row->cols) {
+        editorDrawUtf8Segment(ab, row, start, len);
+        return;
+    }
+
+    char *c = &row->render[start];
+    unsigned char *hl = &row->hl[start];
+    int current_color = -1;     /* -1 is HL_NORMAL, this prevents sending color codes for every char */
+    int j;
+    for (j = 0; j < len; ++j) {
+        /*Non-printable characters*/
+        if (iscntrl(c[j])) {
+            editorDrawControl(ab, current_color, c[j]);
+        } else if (hl[j] == HL_NORMAL) {
+            if (current_color != -1) {
+                abAppend(ab, "\x1b[39m", 5);
+                current_color = -1;
+            }
+            abAppend(ab, &c[j], 1);
+        } else {
+            int color = editorSyntaxToColor(hl[j]);
+            if (current_color != color) {
+                current_color = color;
+                char buf[16];
+                int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
+                abAppend(ab, buf, clen);
+            }
+            abAppend(ab, &c[j], 1);
+        }
+    }
+
+    abAppend(ab, "\x1b[39m", 5);
+}
+
+/* Lines of the hex view: offset, bytes in hex, and the printable ones */
+void editorHexDrawRows(struct abuf *ab)
+{
+    static const char digits[] = "0123456789abcdef";
+    struct editorHex *h = &E.hex;
+    char line[32 + KILO_HEX_WIDTH * 4];
+    int y;
+    for (y = 0; y < E.screenrows; ++y) {
+        unsigned char bytes[KILO_HEX_WIDTH];
+        size_t n = h->top + y;
+        int count = hexLine(n, bytes), len, j;
+        if (!count) {
+            line[0] = '~';
+            len = 1;
+        } else {
+            len = snprintf(line, sizeof(line), "%0*zx  ", h->digits, n * KILO_HEX_WIDTH);
+            for (j = 0; j < KILO_HEX_WIDTH; ++j) {
+                line[len++] = (j < count) ? digits[bytes[j] >> 4] : ' ';
+                line[len++] = (j < count) ? digits[bytes[j] & 0xf] : ' ';
+                line[len++] = ' ';
+                if (j == KILO_HEX_WIDTH / 2 - 1) line[len++] = ' ';
+            }
+            line[len++] = ' ';
+            for (j = 0; j < count; ++j) line[len++] = isprint(bytes[j]) ? bytes[j] : '.';
+        }
+        if (len > E.screencols) len = E.screencols;
+        editorFrameLine(ab, y, line, len);
+    }
+}
+
 void editorDrawRows(struct abuf *ab)
 {
+    editorFrameScroll(ab);
+    if (E.hex.active) {
+        editorHexDrawRows(ab);
+        return;
+    }
+
+    /* The bracket under the cursor and its match are drawn as HL_BRACKET
+     * for this frame only */
+    int brows[2], boffs[2], i;
+    unsigned char *bhl[2], bsaved[2];
+    int nb = editorBracketCursor(brows, boffs) ? 2 : 0;
+    for (i = 0; i < nb; ++i) {
+        bhl[i] = E.row[brows[i]].hl;
+        bsaved[i] = bhl[i][boffs[i]];
+    }
+    for (i = 0; i < nb; ++i) bhl[i][boffs[i]] = HL_BRACKET;
+
+    /* When wrapping, walk the visual lines starting at the row that holds the
+     * first one on screen */
+    int sub = 0, start = 0;
+    int filerow = E.wrap ? editorWrapFind(E.vrowoff, &sub) : E.rowoff;
+    if (E.wrap && filerow < E.numrows) start = editorWrapStart(&E.row[filerow], sub);
+
+    /* Every line is built apart, and only sent if it changed */
+    struct abuf line = ABUF_INIT;
     int y;
     for (y = 0; y < E.screenrows; ++y) {
-        int filerow = y + E.rowoff;
+        line.len = 0;
         if (filerow >= E.numrows) {
             /* If no file is opened, show welcome screen */
             if (E.numrows == 0 && y == E.screenrows / 3) {
@@ -906,60 +7173,41 @@ void editorDrawRows(struct abuf *ab)
                 if (welcomelen > E.screencols) welcomelen = E.screencols;
                 int padding = (E.screencols - welcomelen) / 2;
                 if (padding) {
-                    abAppend(ab, "~", 1);
+                    abAppend(&line, "~", 1);
                     padding--;
                 }
-                while(padding--) abAppend(ab, " ", 1);
-                abAppend(ab, welcome, welcomelen);
+                while(padding--) abAppend(&line, " ", 1);
+                abAppend(&line, welcome, welcomelen);
+            } else {
+                abAppend(&line, "~", 1);
+            }
+        } else if (E.wrap) {
+            /* Each line starts where the one before it ended */
+            erow *row = &E.row[filerow];
+            int end = editorWrapNext(row, start);
+            editorDrawRowSegment(&line, row, start, end - start);
+
+            if (end >= row->rwidth) {
+                start = 0;
+                filerow++;
             } else {
-                abAppend(ab, "~", 1);
+                start = end;
             }
         } else {
-            int len = E.row[filerow].rsize - E.coloff;
+            int len = E.row[filerow].rwidth - E.coloff;
             if (len < 0) len = 0;
             if (len > E.screencols) len = E.screencols;
-            char *c = &E.row[filerow].render[E.coloff];
-            unsigned char *hl = &E.row[filerow].hl[E.coloff];
-            int current_color = -1;     /* -1 is HL_NORMAL, this prevents sending color codes for every char */
-            int j;
-            for (j = 0; j < len; ++j) {
-                /*Non-printable characters*/
-                if (iscntrl(c[j])) {
-                    char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-                    /*Invert colors*/
-                    abAppend(ab, "\x1b[7m", 4);
-                    abAppend(ab, &sym, 1);
-                    abAppend(ab, "\x1b[m", 3); /* This resets color too, so it needs to be reset */
-                    if (current_color != -1) {
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-                        abAppend(ab, buf, clen);
-                    }
-                } else if (hl[j] == HL_NORMAL) {
-                    if (current_color != -1)
-                        abAppend(ab, "\x1b[39m", 5);
-                    abAppend(ab, &c[j], 1);
-                } else {
-                    int color = editorSyntaxToColor(hl[j]);
-                    if (current_color != color) {
-                        current_color = color;
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-                        abAppend(ab, buf, clen);
-                    }
-                    abAppend(ab, &c[j], 1);
-                }
-            }
-
-            abAppend(ab, "\x1b[39m", 5);
+            editorDrawRowSegment(&line, &E.row[filerow], len ? E.coloff : 0, len);
+            filerow++;
         }
 
-        /* Erases rest of the line to the right of the cursor */
-        abAppend(ab, "\x1b[K", 3);
-        
-        /* End of the line */
-        abAppend(ab, "\r\n", 2);
+        editorFrameLine(ab, y, line.b, line.len);
     }
+    abFree(&line);
+
+    /* Unless a row was lexed again while drawing */
+    for (i = nb - 1; i >= 0; --i)
+        if (E.row[brows[i]].hl == bhl[i]) bhl[i][boffs[i]] = bsaved[i];
 }
 
 void editorDrawStatusBar(struct abuf *ab)
@@ -968,12 +7216,26 @@ void editorDrawStatusBar(struct abuf *ab)
     abAppend(ab, "\x1b[7m", 4);
 
     /* Display file and number of lines */
-    char status[80], rstatus[80];
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-            E.filename ? E.filename : "[No Name]", E.numrows,
+    char status[80], rstatus[160];
+    int blen = (E.nbuffers > 1) ? snprintf(status, sizeof(status), "[%d/%d] ", E.buffer + 1, E.nbuffers) : 0;
+    int len = blen + snprintf(status + blen, sizeof(status) - blen, "%.20s - %d lines %s",
+            E.filename ? E.filename : E.grep.active ? "[grep]" : "[No Name]", E.numrows,
             E.dirty ? "(modified)" : "");
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d", 
+    char stats[80] = "";
+    if (STATS_ON()) editorStatsFormat(stats, sizeof(stats));
+    int first, selected = (E.mark >= 0) ? editorSelection(&first) : 0;
+    if (selected) {
+        int slen = strlen(stats);
+        snprintf(stats + slen, sizeof(stats) - slen, "%d selected | ", selected);
+    }
+    int rlen = snprintf(rstatus, sizeof(rstatus), "%s%s | %d/%d", stats,
             E.syntax ? E.syntax->filetype : "no ft", E.cy+1, E.numrows);
+    if (E.hex.active) {
+        len = blen + snprintf(status + blen, sizeof(status) - blen, "%.20s - %zu bytes %s", E.filename, E.hex.size,
+                E.dirty ? "(modified)" : E.hex.readonly ? "(read-only)" : "");
+        rlen = snprintf(rstatus, sizeof(rstatus), "%shex | 0x%zx/0x%zx", stats,
+                E.hex.off, E.hex.size);
+    }
     if (len > E.screencols) len = E.screencols;
     abAppend(ab, status, len);
 
@@ -990,14 +7252,10 @@ void editorDrawStatusBar(struct abuf *ab)
 
     /* Undo color inversion */
     abAppend(ab, "\x1b[m", 3);
-    /* CRLN for status message */
-    abAppend(ab, "\r\n", 2);
 }
 
 void editorDrawStatusMessage(struct abuf *ab)
 {
-    /* Clear status message */
-    abAppend(ab, "\x1b[K", 3);
     int msglen = strlen(E.statusmsg);
     if (msglen > E.screencols) msglen = E.screencols;
     if (msglen && time(NULL) - E.statusmsg_time < 5)
@@ -1007,32 +7265,49 @@ void editorDrawStatusMessage(struct abuf *ab)
 
 void editorRefreshScreen()
 {
+    TRACE_BEGIN("editorRefreshScreen");
+    double t0 = STATS_ON() ? editorNow() : 0;
     editorScroll();
+    double t1 = STATS_ON() ? editorNow() : 0;
 
     struct abuf ab = ABUF_INIT;
 
     /* Hide cursor while writing to screen */
     abAppend(&ab, "\x1b[?25l", 6);
-    /* Clear screen */
-    abAppend(&ab, "\x1b[2J", 4);
-    /* Position cursor on top left, so we can render the screen */
-    abAppend(&ab, "\x1b[1;1H", 6);
 
     editorDrawRows(&ab);
-    editorDrawStatusBar(&ab);
-    editorDrawStatusMessage(&ab);
+    struct abuf line = ABUF_INIT;
+    editorDrawStatusBar(&line);
+    editorFrameLine(&ab, E.screenrows, line.b, line.len);
+    line.len = 0;
+    editorDrawStatusMessage(&line);
+    editorFrameLine(&ab, E.screenrows + 1, line.b, line.len);
+    abFree(&line);
 
     /* Position the cursor */
+    int cursor_y = E.cy - E.rowoff, cursor_x = E.rx - E.coloff;
+    if (E.hex.active) {
+        int col = E.hex.off % KILO_HEX_WIDTH;
+        cursor_y = E.hex.off / KILO_HEX_WIDTH - E.hex.top;
+        cursor_x = E.hex.digits + 2 + (E.hex.ascii ? KILO_HEX_WIDTH * 3 + 2 + col :
+                col * 3 + (col >= KILO_HEX_WIDTH / 2) + E.hex.low);
+    } else if (E.wrap) {
+        editorWrapCursor(&cursor_y, &cursor_x);
+        cursor_y -= E.vrowoff;
+    }
     char buf[32];
     int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", 
-            E.cy - E.rowoff + 1, E.rx - E.coloff + 1);
+            cursor_y + 1, cursor_x + 1);
     abAppend(&ab, buf, len);
     /* Show cursor after finishing writing to screen */
     abAppend(&ab, "\x1b[?25h", 6);
 
     /* Draw screen */
-    write(STDOUT_FILENO, ab.b, ab.len);
+    double t2 = STATS_ON() ? editorNow() : 0;
+    editorWriteOut(ab.b, ab.len);
+    if (STATS_ON()) editorStatsFrame(t0, t1, t2, editorNow(), ab.len);
     abFree(&ab);
+    TRACE_END("editorRefreshScreen");
 }
 
 /***********
@@ -1052,6 +7327,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int))
         editorRefreshScreen();
 
         int c = editorReadKey();
+        if (c == WAKEUP_KEY) continue;
         if (c == DEL_KEY || c == BACKSPACE || c == CTRL_KEY('h')) {
             if (buflen != 0) buf[--buflen] = '\0';
         } else if (c == '\x1b') {
@@ -1084,11 +7360,11 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int))
 
 void editorMoveCursor(int key)
 {
-    erow *row = (E.cy <= E.numrows) ? &E.row[E.cy] : NULL;
+    erow *row = (E.cy < E.numrows) ? &E.row[E.cy] : NULL;
     switch (key) {
         case ARROW_LEFT:
-            if (E.cx > 0)
-                E.cx--;
+            if (row && E.cx > 0)
+                E.cx = editorRowPrevChar(row, E.cx);
             break;
         case ARROW_UP:
             if (E.cy > 0)
@@ -1100,39 +7376,77 @@ void editorMoveCursor(int key)
             break;
         case ARROW_RIGHT:
             if (row && E.cx < row->size)
-                E.cx++;
+                E.cx = editorRowNextChar(row, E.cx);
             break;
         default:
             break;
     }
 
     /* Correct horizontal position if line is too short */
-    row = (E.cy <= E.numrows) ? &E.row[E.cy] : NULL;    /* Recover row since it could've been moved */
+    row = (E.cy < E.numrows) ? &E.row[E.cy] : NULL;    /* Recover row since it could've been moved */
     int rowlen = (row) ? row->size : 0;
     if (E.cx > rowlen) E.cx = rowlen;
+    /* Never inside a UTF-8 sequence */
+    if (row && row->cols) E.cx = editorRowRxToCx(row, editorRowCxToRx(row, E.cx));
 }
 
 void editorProcessKeypress(void)
 {
     static int quit_times = KILO_QUIT_TIMES;
+    static int last_kind = 0;
+    static unsigned long last_reads = 0;
 
     int c = editorReadKey();
+    if (c == WAKEUP_KEY) return;
+    TRACE_BEGIN("editorProcessKeypress");
+    if (E.hex.active && editorHexKey(c)) {
+        quit_times = KILO_QUIT_TIMES;
+        TRACE_END("editorProcessKeypress");
+        return;
+    }
+    if (E.filter.pid && editorFilterKey(c)) {
+        TRACE_END("editorProcessKeypress");
+        return;
+    }
+
+    /* Runs of typing, of deleting, and pastes (keys that came in with a
+     * single read) are undone at once. Anything else is its own group, but
+     * the rows a filter inserts and deletes while keys are read */
+    int kind = 0;
+    if (c == '\r') kind = 2;
+    else if (c == BACKSPACE || c == CTRL_KEY('h') || c == DEL_KEY) kind = 3;
+    else if (c == '\t' || (c >= 32 && c < 127)) kind = 1;
+    int paste = (E.input.reads == last_reads && kind && kind != 3 && last_kind && last_kind != 3);
+    editorUndoBoundary((kind && (kind == last_kind || paste)) || E.filter.pid);
+    last_kind = kind;
+    last_reads = E.input.reads;
 
     switch (c) {
         case '\r':
-            editorInsertNewline();
+            if (E.grep.active) editorGrepOpen();
+            else editorInsertNewline();
             break;
         case CTRL_KEY('q'):
             if (E.dirty && quit_times > 0) {
                 editorSetStatusMessage("WARNING!! File has unsaved changes. "
-                        "Press CTRL-Q %d more times to quit", quit_times);
+                        "Press CTRL-Q %d more times to %s", quit_times,
+                        E.nbuffers > 1 ? "close it" : "quit");
                 quit_times--;
+                TRACE_END("editorProcessKeypress");
                 return;
             }
+            /* Other buffers are still open, only this one goes, its
+             * unsaved changes with its journal */
+            if (E.nbuffers > 1) {
+                editorBufferClose();
+                break;
+            }
+            /* Quitting on purpose, unsaved changes are dropped with the journal */
+            E.journal.clean = 1;
             /* Clear screen */
-            write(STDOUT_FILENO, "\x1b[2J", 4);
+            editorWriteOut("\x1b[2J", 4);
             /* Position cursor on top left, so we can render the screen */
-            write(STDOUT_FILENO, "\x1b[1;1H", 6);
+            editorWriteOut("\x1b[1;1H", 6);
             exit(0);
             break;
         case ARROW_UP:          /* Fallthrough */
@@ -1143,7 +7457,19 @@ void editorProcessKeypress(void)
             break;
         case PAGE_UP:           /* Fallthrough */
         case PAGE_DOWN:
-            {
+            if (E.wrap) {
+                /* Scroll a screen of visual lines and put the cursor on the
+                 * first (PAGE_UP) or last (PAGE_DOWN) line of the new page */
+                int sub, total = editorWrapTotal();
+                E.vrowoff += (c == PAGE_UP) ? -E.screenrows : E.screenrows;
+                if (E.vrowoff > total - 1) E.vrowoff = total - 1;
+                if (E.vrowoff < 0) E.vrowoff = 0;
+
+                int target = E.vrowoff;
+                if (c == PAGE_DOWN) target += E.screenrows - 1;
+                E.cy = editorWrapFind(target, &sub);
+                E.cx = (E.cy < E.numrows) ? editorRowRxToCx(&E.row[E.cy], editorWrapStart(&E.row[E.cy], sub)) : 0;
+            } else {
                 if (c == PAGE_UP) {
                     E.cy = E.rowoff;
                 } else if (c == PAGE_DOWN) {
@@ -1169,8 +7495,11 @@ void editorProcessKeypress(void)
         case CTRL_KEY('h'):
             editorDelChar();
             break;
-        case CTRL_KEY('l'):     /* Fallthrough */
+        case CTRL_KEY('l'):
+            break;
         case '\x1b':
+            E.mark = -1;
+            editorGrepStop();
             break;
         case CTRL_KEY('s'):
             editorSave();
@@ -1178,55 +7507,388 @@ void editorProcessKeypress(void)
         case CTRL_KEY('f'):
             editorFind();
             break;
+        case CTRL_KEY('r'):
+            editorReplace();
+            break;
+        case CTRL_KEY('e'):
+            editorLineCommand();
+            break;
+        case CTRL_KEY('p'):
+            editorGrep();
+            break;
+        case CTRL_KEY('t'):
+            editorToggleStats();
+            break;
+        case CTRL_KEY('g'):
+            if (kilo_trace) {
+                long n = traceFlush();
+                if (n >= 0) editorSetStatusMessage("%ld trace events written to %s", n, kilo_trace);
+                else editorSetStatusMessage("Can't write trace: %s", strerror(errno));
+            }
+            break;
+        case CTRL_KEY('w'):
+            editorToggleWrap();
+            editorSetStatusMessage("Soft wrap %s", E.wrap ? "on" : "off");
+            break;
+        case CTRL_KEY('b'):
+            editorToggleMark();
+            break;
+        case CTRL_KEY('k'):
+            editorJumpBracket();
+            break;
+        case CTRL_KEY('o'):
+            editorReload();
+            break;
+        case CTRL_KEY('n'):
+            if (E.nbuffers > 1) editorBufferSelect((E.buffer + 1) % E.nbuffers);
+            else editorSetStatusMessage("No other buffer, CTRL-A opens a file in one");
+            break;
+        case CTRL_KEY('a'):
+            editorBufferPrompt();
+            break;
+        case CTRL_KEY('x'):
+            editorCutLines();
+            break;
+        case CTRL_KEY('c'):
+            if (editorCopyLines()) editorSetStatusMessage("%d lines copied", E.cliprows);
+            break;
+        case CTRL_KEY('v'):
+            editorPasteLines();
+            break;
+        case CTRL_KEY('u'):
+            editorMoveLines(-1);
+            break;
+        case CTRL_KEY('d'):
+            editorMoveLines(1);
+            break;
+        case CTRL_KEY('z'):
+            editorUndo();
+            break;
+        case CTRL_KEY('y'):
+            editorRedo();
+            break;
         default:
             editorInsertChar(c);
             break;
     }
 
+    editorUndoCursor();
     quit_times = KILO_QUIT_TIMES;
+    TRACE_END("editorProcessKeypress");
+}
+
+/* Draws at most one frame every KILO_FRAME_US. Input that arrives before the
+ * next frame is due is applied right away and drawn together; past that,
+ * what is already queued is still applied, for at most another frame time,
+ * so key repeat never builds up a backlog of frames */
+void editorRun(void)
+{
+    while (1) {
+        editorRefreshScreen();
+        double due = editorNow() + KILO_FRAME_US;
+
+        /* Sleep until something happens */
+        if (editorWaitKey(-1) == 1) editorProcessKeypress();
+
+        double now;
+        while ((now = editorNow()) < due + KILO_FRAME_US) {
+            int timeout = now < due ? (int)((due - now + 999) / 1000) : 0;
+            int ready = editorWaitKey(timeout);
+            if (ready == -1) break;
+            if (ready == 1) editorProcessKeypress();
+        }
+    }
+}
+
+/************
+*  replay  *
+************/
+
+int compareDouble(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Prints the latency distribution and the output and allocation totals. Runs
+ * from atexit, both at the end of the script and on CTRL-Q */
+void editorReplayReport(void)
+{
+    struct editorReplay *r = &E.replay;
+    unsigned long allocs = kilo_allocs - r->allocs;
+    size_t n = r->nlat;
+
+    qsort(r->lat, n, sizeof(double), compareDouble);
+    printf("keys: %zu\n", n);
+    printf("open: %.3f ms\n", r->open_ms);
+    if (n) {
+        printf("latency: p50 %.1f us, p99 %.1f us, max %.1f us\n",
+                r->lat[n / 2], r->lat[n * 99 / 100], r->lat[n - 1]);
+    }
+    printf("output: %zu bytes (%.1f per key)\n", r->bytes, n ? (double)r->bytes / n : 0.0);
+#ifdef KILO_COUNT_ALLOCS
+    printf("allocations: %lu (%.1f per key)\n", allocs, n ? (double)allocs / n : 0.0);
+#else
+    (void)allocs;
+    printf("allocations: not counted, build with make kilo-bench\n");
+#endif
+    fflush(stdout);
+}
+
+/* Loads the script and sets up the virtual screen, 'size' is COLSxROWS */
+void editorReplayInit(const char *script, const char *size)
+{
+    struct editorReplay *r = &E.replay;
+    FILE *fp = fopen(script, "r");
+    if (!fp) die(script);
+
+    r->cap = 4096;
+    r->script = malloc(r->cap);
+    if (!r->script) die("malloc");
+    r->len = r->pos = 0;
+    size_t n;
+    while ((n = fread(&r->script[r->len], 1, r->cap - r->len, fp)) > 0) {
+        r->len += n;
+        if (r->len == r->cap) {
+            r->cap *= 2;
+            r->script = realloc(r->script, r->cap);
+            if (!r->script) die("realloc");
+        }
+    }
+    fclose(fp);
+
+    r->cols = 80;
+    r->rows = 24;
+    if (size && (sscanf(size, "%dx%d", &r->cols, &r->rows) != 2 || r->cols < 1 || r->rows < 3)) {
+        fprintf(stderr, "Bad screen size: %s\n", size);
+        exit(1);
+    }
+    r->sink = open("/dev/null", O_WRONLY);
+    if (r->sink == -1) die("/dev/null");
+    r->bytes = 0;
+    r->lat = NULL;
+    r->nlat = r->cap = 0;
+    r->open_ms = 0;
+}
+
+/* Main loop of a replay: every key is timed from being read to its frame
+ * being written to the sink */
+void editorReplayRun(void)
+{
+    struct editorReplay *r = &E.replay;
+    r->allocs = kilo_allocs;
+    atexit(editorReplayReport);
+    editorRefreshScreen();
+
+    while (1) {
+        double start = editorNow();
+        editorProcessKeypress();
+        editorRefreshScreen();
+
+        if (r->nlat == r->cap) {
+            r->cap = r->cap ? r->cap * 2 : 1024;
+            r->lat = realloc(r->lat, sizeof(double) * r->cap);
+            if (!r->lat) die("realloc");
+        }
+        r->lat[r->nlat++] = editorNow() - start;
+    }
 }
 
 /**********
 *  init  *
 **********/
 
+/* The terminal went away (e.g. the SSH session dropped) or we were asked to
+ * stop: exit through atexit so the journal gets flushed */
+void handleHangup(int sig)
+{
+    (void)sig;
+    E.hangup = 1;
+}
+
+void handleSigWinch(int sig)
+{
+    (void)sig;
+    E.resized = 1;
+}
+
+void editorHandleResize(void)
+{
+    E.resized = 0;
+    if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
+    E.screenrows -= 2;
+    /* The terminal may have reflowed what it showed */
+    E.frame.valid = 0;
+    /* Row heights depend on the width. The index updates the rows wider
+     * than the screen on the next query, without rendering any row again */
+}
+
 void initEditor(void)
 {
     /* Init global data */
-    E.cx = 0;
-    E.cy = 0;
-    E.rx = 0;
-    E.rowoff = 0;
-    E.numrows = 0;
-    E.coloff = 0;
-    E.row = NULL;
-    E.dirty = 0;
-    E.filename = NULL;
+    E.resized = 0;
+    E.clip.b = NULL;
+    E.clip.len = E.clip.cap = 0;
+    E.cliprows = 0;
     E.statusmsg[0] = 0;
     E.statusmsg_time = 0;
-    E.syntax = NULL;
-
-    /* Get window size */
-    if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
+    E.cache = 0;
+    E.nwatch = 0;
+    memset(&E.stats, 0, sizeof(E.stats));
+    E.frame.hash = NULL;
+    E.frame.rows = 0;
+    E.frame.valid = 0;
+    memset(&E.journal, 0, sizeof(E.journal));
+    E.journal.fd = -1;
+    pthread_mutex_init(&E.journal.lock, NULL);
+    pthread_mutex_init(&E.journal.io, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&E.journal.cond, &attr);
+    pthread_condattr_destroy(&attr);
+    memset(&E.grep, 0, sizeof(E.grep));
+    pthread_mutex_init(&E.grep.lock, NULL);
+    pthread_cond_init(&E.grep.cond, NULL);
+    E.hangup = 0;
+
+    /* The first buffer, empty */
+    memset(&E.undo, 0, sizeof(E.undo));
+    E.undo.limit = (size_t)KILO_UNDO_LIMIT << 20;
+    memset(&E.hex, 0, sizeof(E.hex));
+    editorBufferReset();
+    E.buffers = calloc(1, sizeof(struct editorBuffer));
+    if (!E.buffers) die("calloc");
+    E.buffers[0].id = 1;
+    E.buffers[0].used = editorNow();
+    E.nbuffers = 1;
+    E.buffer = 0;
+    E.budget = (size_t)KILO_MEM_BUDGET << 20;
+
+    /* Get window size, a replay uses a fixed virtual screen */
+    if (E.replay.script) {
+        E.screenrows = E.replay.rows;
+        E.screencols = E.replay.cols;
+    } else if (getWindowSize(&E.screenrows, &E.screencols) == -1) {
+        die("getWindowSize");
+    }
     
     /* Make room for status bar */
     E.screenrows -= 2;
+
+    /* Follow terminal resizes, no SA_RESTART so read() returns and we redraw */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handleSigWinch;
+    sigaction(SIGWINCH, &sa, NULL);
+    sa.sa_handler = handleHangup;
+    sigaction(SIGHUP, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    /* A filter that quits early fails the write with EPIPE instead */
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
 }
 
+/* bench/micro.c includes this file to call the kernels directly */
+#ifndef KILO_NO_MAIN
 int main(int argc, char *argv[])
 {
-    enableRawMode();
-    initEditor();
-    if (argc >= 2) {
-        editorOpen(argv[1]);
+    int cache = 0, follow = 0, hex = 0, undo_mb = KILO_UNDO_LIMIT, mem_mb = KILO_MEM_BUDGET;
+    char *script = NULL, *size = NULL, *statsfile = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:cfM:s:t:T:u:x")) != -1) {
+        switch (opt) {
+            case 'b':
+                script = optarg;
+                break;
+            case 'c':
+                cache = 1;
+                break;
+            case 'f':
+                follow = 1;
+                break;
+            case 'M':
+                mem_mb = atoi(optarg);
+                break;
+            case 's':
+                size = optarg;
+                break;
+            case 't':
+                statsfile = optarg;
+                break;
+            case 'T':
+                kilo_trace = optarg;
+                break;
+            case 'u':
+                undo_mb = atoi(optarg);
+                break;
+            case 'x':
+                hex = 1;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-c] [-f] [-x] [-t statsfile] [-T tracefile] "
+                        "[-u undoMB] [-M buffersMB] [-b script [-s COLSxROWS]] [file | -] [file...]\n",
+                        argv[0]);
+                exit(1);
+        }
     }
 
-    editorSetStatusMessage("HELP: Ctrl-Q to quit");
+    /* Read stdin as a stream when given '-', or when it is a pipe and there
+     * is no file to open. The keyboard is then /dev/tty, as it is when stdin
+     * isn't a terminal at all (xargs, < /dev/null) */
+    int stream = -1;
+    if (script) {
+        editorReplayInit(script, size);
+    } else {
+        if ((optind < argc && !strcmp(argv[optind], "-")) ||
+                (optind == argc && !isatty(STDIN_FILENO))) {
+            stream = dup(STDIN_FILENO);
+            if (stream == -1) die("dup");
+        }
+        if (stream != -1 || !isatty(STDIN_FILENO)) {
+            int tty = open("/dev/tty", O_RDWR);
+            if (tty == -1 || dup2(tty, STDIN_FILENO) == -1) die("/dev/tty");
+            close(tty);
+        }
+    }
 
-    while (1) {
-        editorRefreshScreen();
-        editorProcessKeypress();
+    if (!script) enableRawMode();
+    initEditor();
+    E.cache = cache;
+    E.hex.force = hex;
+    E.undo.limit = (size_t)undo_mb << 20;
+    E.budget = (size_t)mem_mb << 20;
+    if (statsfile) {
+        /* Collect from the start, dump the totals at exit */
+        E.stats.enabled = 1;
+        E.stats.dumpfile = statsfile;
+        atexit(editorStatsDump);
+    }
+    if (kilo_trace) atexit(traceFlushAtExit);
+    editorSetStatusMessage(argc - optind > 1 ? "HELP: Ctrl-N next buffer, Ctrl-A open one, Ctrl-Q close it" :
+            "HELP: Ctrl-Q to quit");
+    if (stream != -1) {
+        editorStreamStart(stream);
+        if (optind < argc && !strcmp(argv[optind], "-")) optind++;
+    } else if (optind < argc) {
+        /* Edits to a file on disk are journaled until saved, replaying what
+         * a crashed session left first */
+        double start = editorNow();
+        editorOpenFile(argv[optind++], follow);
+        E.replay.open_ms = (editorNow() - start) / 1e3;
     }
 
+    /* What was loaded can't be undone, edits from now on can */
+    E.undo.recording = 1;
+
+    /* More files go in buffers of their own, the first one is shown */
+    while (optind < argc) editorBufferOpen(argv[optind++], follow);
+    editorBufferSwitch(0);
+
+    if (script) editorReplayRun();
+
+    editorRun();
+
     return 0;
 }
+#endif